@@ -0,0 +1,409 @@
+#include<stdlib.h>
+#include<stdio.h>
+#include<string.h>
+#include<math.h>
+#include<time.h>
+#include<unistd.h>
+#include<sched.h>
+#include<pthread.h>
+#include"lock_manager.h"
+#include"lock_stats.h"
+#include"lock_engine.h"
+#include"lock_skiplist.h"
+#include"lock_bptree.h"
+#include"lock_compact.h"
+#include"lock_flat.h"
+
+/**
+ * @file
+ * @brief Lock Manager throughput and latency benchmark
+ *
+ * Drives an engine with a synthetic I/O stream: every I/O requests a lock
+ * on its range and, once the window of in-flight I/Os is full, the oldest
+ * granted I/O completes and releases its lock. Every request and release
+ * is timed on its own.
+ *
+ * With -t the ops are split over threads that each keep their own window
+ * on the one namespace, and the run is repeated at 1, 2, 4, ... up to that
+ * many threads to show how the engine scales. -p splits the namespace of
+ * the AVL manager into that many LBA shards, see #lockNamespaceShards.
+ *
+ * usage: lock_bench [-e engine] [-w seq|uniform|zipf] [-n ops] [-q depth]
+ *                   [-r read %] [-s small blocks] [-l large blocks]
+ *                   [-L large %] [-S lba space] [-z zipf theta] [-m streams]
+ *                   [-t max threads] [-p shards]
+ **/
+
+/**
+ * @brief Workload parameters
+ **/
+typedef struct bench_config_s{
+  const lock_engine_t *engine;
+  const char *workload;
+  unsigned long ops;
+  unsigned int depth;
+  unsigned int readPct;
+  unsigned int smallBlocks;
+  unsigned int largeBlocks;
+  unsigned int largePct;
+  unsigned int lbaSpace;
+  unsigned int streams;
+  unsigned int threads;
+  unsigned int shards;
+  double theta;
+}bench_config_t;
+
+/**
+ * @brief An I/O in the in-flight window
+ **/
+typedef struct bench_io_s{
+  union{
+    lock_handle_t avl;
+    skip_handle_t skiplist;
+    bptree_handle_t bptree;
+    compact_handle_t compact;
+    flat_handle_t flat;
+    unsigned char opaque[LOCK_ENGINE_HANDLE_SIZE];
+  }handle;
+}bench_io_t;
+
+static unsigned long long nowNanos(void){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/**
+ * @brief xorshift64*, cheap enough not to show up in the timings
+ **/
+static __thread unsigned long long rngState = 88172645463325252ull;
+
+static unsigned long long rng(void){
+  rngState ^= rngState >> 12;
+  rngState ^= rngState << 25;
+  rngState ^= rngState >> 27;
+  return rngState * 2685821657736338717ull;
+}
+
+static double rngUnit(void){
+  return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * @brief Zipf distributed region picker, regions ranked by a precomputed CDF
+ **/
+static double *zipfCdf;
+static unsigned int zipfRegions;
+
+static void zipfInit(unsigned int regions, double theta){
+  unsigned int n;
+  double total = 0;
+  zipfRegions = regions;
+  zipfCdf = malloc(sizeof(double) * regions);
+  for(n = 0; n < regions; n++)
+    zipfCdf[n] = (total += 1.0 / pow(n + 1, theta));
+  for(n = 0; n < regions; n++)
+    zipfCdf[n] /= total;
+}
+
+static unsigned int zipfNext(void){
+  double u = rngUnit();
+  unsigned int lo = 0, hi = zipfRegions - 1;
+  while(lo < hi){
+    unsigned int mid = (lo + hi) / 2;
+    if(zipfCdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  /*
+   * scatter the ranks so the hot regions are not all adjacent
+   */
+  return (unsigned int) ((lo * 2654435761ull) % zipfRegions);
+}
+
+/**
+ * @brief Pick the range of the next I/O
+ **/
+static void nextRange(const bench_config_t *cfg, unsigned long long *cursor, unsigned int *start_lba, unsigned int *end_lba){
+  unsigned int blocks = (rng() % 100 < cfg->largePct) ? cfg->largeBlocks : cfg->smallBlocks;
+  unsigned int start;
+
+  if(strcmp(cfg->workload, "seq") == 0){
+    unsigned long long *stream = &cursor[rng() % cfg->streams];
+    if(*stream + blocks > cfg->lbaSpace)
+      *stream = 0;
+    start = *stream;
+    *stream += blocks;
+  }
+  else if(strcmp(cfg->workload, "zipf") == 0){
+    unsigned int region = zipfNext();
+    start = region * cfg->largeBlocks + rng() % cfg->largeBlocks;
+  }
+  else
+    start = rng() % cfg->lbaSpace;
+
+  if(start > cfg->lbaSpace - blocks)
+    start = cfg->lbaSpace - blocks;
+  *start_lba = start;
+  *end_lba   = start + blocks - 1;
+}
+
+static int compareLatency(const void *a, const void *b){
+  unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+  return (x > y) - (x < y);
+}
+
+static void printLatency(const char *what, unsigned int *samples, unsigned long count){
+  if(count == 0)
+    return;
+  qsort(samples, count, sizeof(unsigned int), compareLatency);
+  printf("%-8s p50 %6u ns  p99 %6u ns  p999 %7u ns  max %8u ns\n", what,
+	 samples[count / 2], samples[count * 99 / 100], samples[count * 999 / 1000], samples[count - 1]);
+}
+
+/**
+ * @brief One thread of a run, its window and its timings
+ **/
+typedef struct bench_thread_s{
+  const bench_config_t *cfg;
+  pthread_barrier_t *barrier;
+  pthread_t thread;
+  unsigned int index;
+  unsigned long ops;
+  unsigned long long *cursor;
+  bench_io_t *window;
+  unsigned int *acquireLat;
+  unsigned int *releaseLat;
+  unsigned long acquires;
+  unsigned long releases;
+  unsigned long queued;
+  int failed;
+}bench_thread_t;
+
+/**
+ * @brief Complete the oldest granted I/O of the window
+ *
+ * Alone, a window with nothing granted can never drain; with other threads
+ * releasing, it just has to wait for them.
+ *
+ * @retval 0 on success, -1 if nothing is granted and no other thread can grant it
+ **/
+static int completeOldest(bench_thread_t *t, unsigned int *inflight){
+  const bench_config_t *cfg = t->cfg;
+  unsigned long long t0, t1;
+  unsigned int i;
+
+  for(;;){
+    for(i = 0; i < *inflight && !cfg->engine->granted(&t->window[i].handle); i++)
+      continue;
+    if(i < *inflight)
+      break;
+    if(cfg->threads == 1)
+      return -1;
+    sched_yield();
+  }
+  t0 = nowNanos();
+  cfg->engine->release(&t->window[i].handle);
+  t1 = nowNanos();
+  t->releaseLat[t->releases++] = t1 - t0;
+  memmove(&t->window[i], &t->window[i + 1], (*inflight - i - 1) * sizeof(bench_io_t));
+  (*inflight)--;
+  return 0;
+}
+
+/**
+ * @brief Run one thread's share of the ops, then drain its window
+ **/
+static void *benchThread(void *arg){
+  bench_thread_t *t = arg;
+  const bench_config_t *cfg = t->cfg;
+  unsigned long long t0, t1;
+  unsigned int inflight = 0;
+  unsigned long n;
+
+  rngState ^= (t->index + 1) * 0x9e3779b97f4a7c15ull;
+  pthread_barrier_wait(t->barrier);
+  for(n = 0; n < t->ops; n++){
+    unsigned int start_lba, end_lba, type;
+    enum NODE_INSERT_RESULT ret;
+
+    /*
+     * a full window completes its oldest granted I/O first
+     */
+    if(inflight == cfg->depth && completeOldest(t, &inflight)){
+      fprintf(stderr, "no granted I/O left in the window\n");
+      t->failed = 1;
+      return NULL;
+    }
+
+    nextRange(cfg, t->cursor, &start_lba, &end_lba);
+    type = rng() % 100 >= cfg->readPct;
+    t0 = nowNanos();
+    ret = cfg->engine->request(start_lba, end_lba, type, 0, &t->window[inflight].handle);
+    t1 = nowNanos();
+    if(ret == NODE_FAILED){
+      fprintf(stderr, "lock request failed after %lu ops\n", n);
+      t->failed = 1;
+      return NULL;
+    }
+    t->acquireLat[t->acquires++] = t1 - t0;
+    t->queued += ret == NODE_QUEUED;
+    inflight++;
+  }
+  /*
+   * the other threads may wait on this window
+   */
+  while(inflight && completeOldest(t, &inflight) == 0)
+    continue;
+  return NULL;
+}
+
+/**
+ * @brief Run the workload on a number of threads
+ *
+ * @retval 0 on success, 1 if a thread failed
+ **/
+static int benchRun(bench_config_t *cfg, unsigned int threads, int detailed){
+  bench_thread_t *t = calloc(threads, sizeof(bench_thread_t));
+  unsigned long acquires = 0, releases = 0, queued = 0, total, n;
+  unsigned int *acquireLat, *releaseLat, i, s;
+  unsigned long long start, elapsed;
+  pthread_barrier_t barrier;
+  lock_stats_t stats;
+  int failed = 0;
+
+  cfg->threads = threads;
+  cfg->engine->init((cfg->depth * 2 + 1024) * threads);
+  if(cfg->shards > 1){
+    for(s = 0; ((unsigned long long) cfg->shards << s) < cfg->lbaSpace; s++)
+      continue;
+    if(lockNamespaceShards(0, cfg->shards, s) != 0){
+      fprintf(stderr, "can not split the namespace into %u shards\n", cfg->shards);
+      free(t);
+      return 1;
+    }
+  }
+  lockStatsTiming(detailed);
+  lockStatsReset();
+  pthread_barrier_init(&barrier, NULL, threads + 1);
+  for(i = 0; i < threads; i++){
+    t[i].cfg        = cfg;
+    t[i].barrier    = &barrier;
+    t[i].index      = i;
+    t[i].ops        = cfg->ops / threads + (i < cfg->ops % threads);
+    t[i].cursor     = calloc(cfg->streams, sizeof(unsigned long long));
+    for(s = 0; s < cfg->streams; s++)
+      t[i].cursor[s] = (unsigned long long) cfg->lbaSpace / (cfg->streams * threads) * (i * cfg->streams + s);
+    t[i].window     = calloc(cfg->depth, sizeof(bench_io_t));
+    t[i].acquireLat = malloc(sizeof(unsigned int) * t[i].ops);
+    t[i].releaseLat = malloc(sizeof(unsigned int) * (t[i].ops + cfg->depth));
+    pthread_create(&t[i].thread, NULL, benchThread, &t[i]);
+  }
+  pthread_barrier_wait(&barrier);
+  start = nowNanos();
+  for(i = 0; i < threads; i++){
+    pthread_join(t[i].thread, NULL);
+    failed   |= t[i].failed;
+    acquires += t[i].acquires;
+    releases += t[i].releases;
+    queued   += t[i].queued;
+  }
+  elapsed = nowNanos() - start;
+  pthread_barrier_destroy(&barrier);
+
+  acquireLat = malloc(sizeof(unsigned int) * (acquires + 1));
+  releaseLat = malloc(sizeof(unsigned int) * (releases + 1));
+  for(i = 0, total = 0; i < threads; total += t[i++].acquires)
+    memcpy(acquireLat + total, t[i].acquireLat, t[i].acquires * sizeof(unsigned int));
+  for(i = 0, total = 0; i < threads; total += t[i++].releases)
+    memcpy(releaseLat + total, t[i].releaseLat, t[i].releases * sizeof(unsigned int));
+
+  if(!failed && detailed){
+    printf("engine %s workload %s ops %lu depth %u read %u%% small %u large %u (%u%%) space %u shards %u\n",
+	   cfg->engine->name, cfg->workload, cfg->ops, cfg->depth, cfg->readPct,
+	   cfg->smallBlocks, cfg->largeBlocks, cfg->largePct, cfg->lbaSpace, cfg->shards);
+    printf("%.0f ops/s, %.1f%% of requests queued\n", (acquires + releases) / (elapsed / 1e9), 100.0 * queued / acquires);
+    printLatency("acquire", acquireLat, acquires);
+    printLatency("release", releaseLat, releases);
+    lockStatsSnapshot(0, &stats);
+    if(stats.promotions)
+      printf("queue wait p50 %llu ns  p99 %llu ns\n",
+	     lockStatsPercentile(stats.waitHist, 50), lockStatsPercentile(stats.waitHist, 99));
+  }
+  else if(!failed){
+    qsort(acquireLat, acquires, sizeof(unsigned int), compareLatency);
+    printf("%-8s threads %2u  %10.0f ops/s  %5.1f%% queued  acquire p50 %6u ns  p99 %7u ns\n",
+	   cfg->engine->name, threads, (acquires + releases) / (elapsed / 1e9), 100.0 * queued / acquires,
+	   acquireLat[acquires / 2], acquireLat[acquires * 99 / 100]);
+  }
+
+  for(n = 0; n < threads; n++){
+    free(t[n].cursor);
+    free(t[n].window);
+    free(t[n].acquireLat);
+    free(t[n].releaseLat);
+  }
+  free(acquireLat);
+  free(releaseLat);
+  free(t);
+  return failed;
+}
+
+static void usage(const char *prog){
+  fprintf(stderr, "usage: %s [-e ", prog);
+  lockEngineList(stderr);
+  fprintf(stderr, "] [-w seq|uniform|zipf] [-n ops] [-q depth] [-r read %%]\n"
+	  "       [-s small blocks] [-l large blocks] [-L large %%] [-S lba space] [-z zipf theta] [-m streams]\n"
+	  "       [-t max threads] [-p shards]\n");
+  exit(1);
+}
+
+int main(int argc, char **argv){
+  bench_config_t cfg = { &lockEngines[0], "uniform", 1000000, 32, 80, 8, 256, 10, 1u << 24, 4, 1, 1, 0.99 };
+  unsigned int maxThreads = 0, threads;
+  int opt;
+
+  while((opt = getopt(argc, argv, "e:w:n:q:r:s:l:L:S:z:m:t:p:")) != -1){
+    switch(opt){
+    case 'e':
+      if((cfg.engine = lockEngineFind(optarg)) == NULL)
+	usage(argv[0]);
+      break;
+    case 'w': cfg.workload    = optarg; break;
+    case 'n': cfg.ops         = strtoul(optarg, NULL, 0); break;
+    case 'q': cfg.depth       = strtoul(optarg, NULL, 0); break;
+    case 'r': cfg.readPct     = strtoul(optarg, NULL, 0); break;
+    case 's': cfg.smallBlocks = strtoul(optarg, NULL, 0); break;
+    case 'l': cfg.largeBlocks = strtoul(optarg, NULL, 0); break;
+    case 'L': cfg.largePct    = strtoul(optarg, NULL, 0); break;
+    case 'S': cfg.lbaSpace    = strtoul(optarg, NULL, 0); break;
+    case 'z': cfg.theta       = strtod(optarg, NULL); break;
+    case 'm': cfg.streams     = strtoul(optarg, NULL, 0); break;
+    case 't': maxThreads      = strtoul(optarg, NULL, 0); break;
+    case 'p': cfg.shards      = strtoul(optarg, NULL, 0); break;
+    default: usage(argv[0]);
+    }
+  }
+  if(strcmp(cfg.workload, "seq") && strcmp(cfg.workload, "uniform") && strcmp(cfg.workload, "zipf"))
+    usage(argv[0]);
+  if(!cfg.depth || !cfg.smallBlocks || !cfg.largeBlocks || !cfg.streams ||
+     cfg.lbaSpace < cfg.largeBlocks * 2 || cfg.lbaSpace < cfg.smallBlocks * 2)
+    usage(argv[0]);
+
+  if(strcmp(cfg.workload, "zipf") == 0)
+    zipfInit(cfg.lbaSpace / cfg.largeBlocks - 1, cfg.theta);
+  if(maxThreads == 0)
+    return benchRun(&cfg, 1, 1);
+
+  printf("engine %s workload %s ops %lu depth %u per thread, read %u%% small %u large %u (%u%%) space %u shards %u\n",
+	 cfg.engine->name, cfg.workload, cfg.ops, cfg.depth, cfg.readPct,
+	 cfg.smallBlocks, cfg.largeBlocks, cfg.largePct, cfg.lbaSpace, cfg.shards);
+  for(threads = 1; ; threads = MIN(threads * 2, maxThreads)){
+    if(benchRun(&cfg, threads, 0))
+      return 1;
+    if(threads == maxThreads)
+      break;
+  }
+  return 0;
+}
@@ -0,0 +1,481 @@
+#include<stdlib.h>
+#include<string.h>
+#include<pthread.h>
+#include"lock_manager.h"
+#include"lock_bptree.h"
+
+/**
+ * @brief Nodes and requests carved from the heap at a time, as a shift
+ **/
+#define BPTREE_CHUNK_BITS 8
+#define BPTREE_CHUNK      (1u << BPTREE_CHUNK_BITS)
+
+/**
+ * @brief Index of no node and no request, index 0 of either pool is never handed out
+ **/
+#define BPTREE_NONE 0
+
+/**
+ * @brief Tree and pools of one namespace, all guarded by its mutex
+ *
+ * Nodes are only reached under the mutex, so their chunk directory may
+ * grow; requests are polled through their handles without it and sit in
+ * chunks that never move, one directory sized for the engine capacity.
+ **/
+typedef struct bptree_namespace_s{
+  pthread_mutex_t mutex;
+  unsigned int root;
+  /*
+   * inner levels above the leaves
+   */
+  unsigned int height;
+  /*
+   * last arrival order handed out
+   */
+  unsigned long long seq;
+  bptree_node_t **nodeChunk;
+  unsigned int nodeChunks;
+  unsigned int nodeCarved;
+  /*
+   * free nodes linked through ref[0], and their number
+   */
+  unsigned int nodeFree;
+  unsigned int nodeFreeCount;
+  bptree_req_t **reqChunk;
+  unsigned int reqCarved;
+  /*
+   * free requests linked through waitNext
+   */
+  unsigned int reqFree;
+}__attribute__((aligned(CACHE_LINE_SIZE))) bptree_namespace_t;
+
+static bptree_namespace_t bptreeNamespaces[MAX_NAMESPACE_ID];
+
+/**
+ * @brief Most requests held or queued in a namespace, set by #bptreeInit
+ **/
+static unsigned int bptreeCapacity = MAX_NODES;
+
+#define bptNode(ns, i) (&(ns)->nodeChunk[(i) >> BPTREE_CHUNK_BITS][(i) & (BPTREE_CHUNK - 1)])
+#define bptReq(ns, i)  (&(ns)->reqChunk[(i) >> BPTREE_CHUNK_BITS][(i) & (BPTREE_CHUNK - 1)])
+
+/**
+ * @brief Make sure count nodes are free, carving chunks as needed
+ *
+ * @retval 1 -- they are
+ * @retval 0 -- out of memory
+ **/
+static int bptReserve(bptree_namespace_t *ns, unsigned int count){
+  bptree_node_t **grown;
+  unsigned int i, last;
+
+  while(ns->nodeFreeCount < count){
+    if(ns->nodeCarved >> BPTREE_CHUNK_BITS == ns->nodeChunks){
+      if((grown = realloc(ns->nodeChunk, (ns->nodeChunks * 2 + 1) * sizeof(bptree_node_t *))) == NULL)
+	return 0;
+      ns->nodeChunk  = grown;
+      ns->nodeChunks = ns->nodeChunks * 2 + 1;
+    }
+    if((ns->nodeChunk[ns->nodeCarved >> BPTREE_CHUNK_BITS] = aligned_alloc(CACHE_LINE_SIZE, BPTREE_CHUNK * sizeof(bptree_node_t))) == NULL)
+      return 0;
+    last = (ns->nodeCarved | (BPTREE_CHUNK - 1)) + 1;
+    for(i = ns->nodeCarved ? ns->nodeCarved : 1; i < last; i++){
+      bptNode(ns, i)->ref[0] = ns->nodeFree;
+      ns->nodeFree = i;
+      ns->nodeFreeCount++;
+    }
+    ns->nodeCarved = last;
+  }
+  return 1;
+}
+
+/**
+ * @brief Take a node reserved by #bptReserve
+ **/
+static unsigned int bptNodeAlloc(bptree_namespace_t *ns, unsigned char leaf){
+  unsigned int index = ns->nodeFree;
+  bptree_node_t *node = bptNode(ns, index);
+  ns->nodeFree = node->ref[0];
+  ns->nodeFreeCount--;
+  node->count = 0;
+  node->leaf  = leaf;
+  return index;
+}
+
+static void bptNodeFree(bptree_namespace_t *ns, unsigned int index){
+  bptNode(ns, index)->ref[0] = ns->nodeFree;
+  ns->nodeFree = index;
+  ns->nodeFreeCount++;
+}
+
+/**
+ * @brief Take a free request, carving a chunk if needed
+ *
+ * @retval Pointer to the request, NULL past the capacity or out of memory
+ **/
+static bptree_req_t *bptReqAlloc(bptree_namespace_t *ns){
+  unsigned int limit = bptreeCapacity + 1, i, last;
+  bptree_req_t *req;
+
+  if(ns->reqChunk == NULL && (ns->reqChunk = calloc((limit + BPTREE_CHUNK - 1) / BPTREE_CHUNK, sizeof(bptree_req_t *))) == NULL)
+    return NULL;
+  if(ns->reqFree == BPTREE_NONE){
+    if(ns->reqCarved >= limit ||
+       (ns->reqChunk[ns->reqCarved >> BPTREE_CHUNK_BITS] = malloc(BPTREE_CHUNK * sizeof(bptree_req_t))) == NULL)
+      return NULL;
+    last = MIN(limit, (ns->reqCarved | (BPTREE_CHUNK - 1)) + 1);
+    for(i = ns->reqCarved ? ns->reqCarved : 1; i < last; i++){
+      req = bptReq(ns, i);
+      req->self     = i;
+      req->state    = LOCK_FREE;
+      req->waitNext = ns->reqFree;
+      ns->reqFree   = i;
+    }
+    ns->reqCarved = last;
+  }
+  req = bptReq(ns, ns->reqFree);
+  ns->reqFree = req->waitNext;
+  return req;
+}
+
+static void bptReqFree(bptree_namespace_t *ns, bptree_req_t *req){
+  __atomic_store_n(&req->state, LOCK_FREE, __ATOMIC_RELAXED);
+  req->waitNext = ns->reqFree;
+  ns->reqFree = req->self;
+}
+
+/**
+ * @brief Largest end LBA below a node
+ **/
+static unsigned int bptMaxEnd(const bptree_node_t *node){
+  unsigned int i, end = node->end[0];
+  for(i = 1; i < node->count; i++)
+    end = MAX(end, node->end[i]);
+  return end;
+}
+
+/**
+ * @brief Find a request that req has to wait for below a node
+ *
+ * That is an older request overlapping req, unless both are reads. The
+ * entries are sorted by start, so the scan of a node stops at the first
+ * one starting past req; a child is only entered if its largest end
+ * reaches req.
+ *
+ * @retval The request, NULL if there is none
+ **/
+static bptree_req_t *bptConflict(bptree_namespace_t *ns, unsigned int index, unsigned int level, const bptree_req_t *req){
+  bptree_node_t *node = bptNode(ns, index);
+  bptree_req_t *other;
+  unsigned int i;
+
+  for(i = 0; i < node->count && node->start[i] <= req->end_lba; i++){
+    if(node->end[i] < req->start_lba)
+      continue;
+    if(level){
+      if((other = bptConflict(ns, node->ref[i], level - 1, req)) != NULL)
+	return other;
+      continue;
+    }
+    other = bptReq(ns, node->ref[i]);
+    if(other->seq < req->seq && (other->type || req->type))
+      return other;
+  }
+  return NULL;
+}
+
+static bptree_req_t *bptFindConflict(bptree_namespace_t *ns, const bptree_req_t *req){
+  return ns->root == BPTREE_NONE ? NULL : bptConflict(ns, ns->root, ns->height, req);
+}
+
+/**
+ * @brief Insert an entry below a node, splitting the node if it is full
+ *
+ * Equal starts keep their arrival order. An inner node routes a start to
+ * the last child whose least start is not above it, so every start in a
+ * child is at most the least start of the next child. Splitting needs a
+ * node from #bptReserve.
+ *
+ * @retval Index of the new right sibling of the node, #BPTREE_NONE if it did not split
+ **/
+static unsigned int bptInsert(bptree_namespace_t *ns, unsigned int index, unsigned int level,
+			      unsigned int start, unsigned int end, unsigned int ref){
+  unsigned int starts[BPTREE_FANOUT + 1], ends[BPTREE_FANOUT + 1], refs[BPTREE_FANOUT + 1];
+  bptree_node_t *node = bptNode(ns, index), *sibling;
+  unsigned int pos, child, split, n, i;
+
+  if(level == 0){
+    for(pos = node->count; pos > 0 && node->start[pos - 1] > start; pos--)
+      continue;
+  }
+  else{
+    for(child = node->count - 1; child > 0 && node->start[child] > start; child--)
+      continue;
+    node->start[child] = MIN(node->start[child], start);
+    node->end[child]   = MAX(node->end[child], end);
+    if((split = bptInsert(ns, node->ref[child], level - 1, start, end, ref)) == BPTREE_NONE)
+      return BPTREE_NONE;
+    node->end[child] = bptMaxEnd(bptNode(ns, node->ref[child]));
+    sibling = bptNode(ns, split);
+    start = sibling->start[0];
+    end   = bptMaxEnd(sibling);
+    ref   = split;
+    pos   = child + 1;
+  }
+
+  if(node->count < BPTREE_FANOUT){
+    memmove(&node->start[pos + 1], &node->start[pos], (node->count - pos) * sizeof(unsigned int));
+    memmove(&node->end[pos + 1], &node->end[pos], (node->count - pos) * sizeof(unsigned int));
+    memmove(&node->ref[pos + 1], &node->ref[pos], (node->count - pos) * sizeof(unsigned int));
+    node->start[pos] = start;
+    node->end[pos]   = end;
+    node->ref[pos]   = ref;
+    node->count++;
+    return BPTREE_NONE;
+  }
+
+  /*
+   * full: spread the entries and the new one over the node and a new right sibling
+   */
+  for(n = 0, i = 0; n <= BPTREE_FANOUT; n++){
+    if(n == pos){
+      starts[n] = start;
+      ends[n]   = end;
+      refs[n]   = ref;
+      continue;
+    }
+    starts[n] = node->start[i];
+    ends[n]   = node->end[i];
+    refs[n]   = node->ref[i++];
+  }
+  split = bptNodeAlloc(ns, node->leaf);
+  sibling = bptNode(ns, split);
+  node->count    = (BPTREE_FANOUT + 1) / 2;
+  sibling->count = BPTREE_FANOUT + 1 - node->count;
+  memcpy(node->start, starts, node->count * sizeof(unsigned int));
+  memcpy(node->end, ends, node->count * sizeof(unsigned int));
+  memcpy(node->ref, refs, node->count * sizeof(unsigned int));
+  memcpy(sibling->start, starts + node->count, sibling->count * sizeof(unsigned int));
+  memcpy(sibling->end, ends + node->count, sibling->count * sizeof(unsigned int));
+  memcpy(sibling->ref, refs + node->count, sibling->count * sizeof(unsigned int));
+  return split;
+}
+
+/**
+ * @brief Insert the entry of a request, growing a new root if the old one splits
+ **/
+static void bptInsertRoot(bptree_namespace_t *ns, const bptree_req_t *req){
+  unsigned int split, root;
+  bptree_node_t *node;
+
+  if(ns->root == BPTREE_NONE){
+    ns->root   = bptNodeAlloc(ns, 1);
+    ns->height = 0;
+  }
+  if((split = bptInsert(ns, ns->root, ns->height, req->start_lba, req->end_lba, req->self)) == BPTREE_NONE)
+    return;
+  root = bptNodeAlloc(ns, 0);
+  node = bptNode(ns, root);
+  node->count    = 2;
+  node->start[0] = bptNode(ns, ns->root)->start[0];
+  node->end[0]   = bptMaxEnd(bptNode(ns, ns->root));
+  node->ref[0]   = ns->root;
+  node->start[1] = bptNode(ns, split)->start[0];
+  node->end[1]   = bptMaxEnd(bptNode(ns, split));
+  node->ref[1]   = split;
+  ns->root = root;
+  ns->height++;
+}
+
+/**
+ * @brief Remove the entry of a request below a node
+ *
+ * Only the children that can hold the start of req are searched: those
+ * whose least start is not above it and whose right neighbour does not
+ * start below it. A child left empty is freed, underfull nodes are not
+ * merged; the largest ends on the path are recomputed.
+ *
+ * @retval 1 -- found and removed
+ * @retval 0 -- not below this node
+ **/
+static int bptRemove(bptree_namespace_t *ns, unsigned int index, unsigned int level, const bptree_req_t *req){
+  bptree_node_t *node = bptNode(ns, index), *child;
+  unsigned int i;
+
+  for(i = 0; i < node->count && node->start[i] <= req->start_lba; i++){
+    if(level == 0){
+      if(node->ref[i] != req->self)
+	continue;
+    }
+    else{
+      if((i + 1 < node->count && node->start[i + 1] < req->start_lba) || node->end[i] < req->end_lba)
+	continue;
+      if(!bptRemove(ns, node->ref[i], level - 1, req))
+	continue;
+      child = bptNode(ns, node->ref[i]);
+      if(child->count){
+	node->end[i] = bptMaxEnd(child);
+	return 1;
+      }
+      bptNodeFree(ns, node->ref[i]);
+    }
+    node->count--;
+    memmove(&node->start[i], &node->start[i + 1], (node->count - i) * sizeof(unsigned int));
+    memmove(&node->end[i], &node->end[i + 1], (node->count - i) * sizeof(unsigned int));
+    memmove(&node->ref[i], &node->ref[i + 1], (node->count - i) * sizeof(unsigned int));
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Remove the entry of a request, dropping roots left with one child or none
+ **/
+static void bptRemoveRoot(bptree_namespace_t *ns, const bptree_req_t *req){
+  bptree_node_t *root;
+  unsigned int old;
+
+  bptRemove(ns, ns->root, ns->height, req);
+  root = bptNode(ns, ns->root);
+  while(ns->height && root->count == 1){
+    old = ns->root;
+    ns->root = root->ref[0];
+    ns->height--;
+    bptNodeFree(ns, old);
+    root = bptNode(ns, ns->root);
+  }
+  if(root->count == 0){
+    bptNodeFree(ns, ns->root);
+    ns->root = BPTREE_NONE;
+  }
+}
+
+/**
+ * @brief Queue req behind the request it has to wait for
+ **/
+static void bptWait(bptree_namespace_t *ns, bptree_req_t *blocker, bptree_req_t *req){
+  req->waitOn   = blocker->self;
+  req->waitNext = BPTREE_NONE;
+  if(blocker->waitTail != BPTREE_NONE)
+    bptReq(ns, blocker->waitTail)->waitNext = req->self;
+  else
+    blocker->waitHead = req->self;
+  blocker->waitTail = req->self;
+  __atomic_store_n(&req->state, LOCK_QUEUED, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Reset the engine for at most capacity locks held or queued per namespace
+ *
+ * Every lock must be released.
+ **/
+void bptreeInit(unsigned int capacity){
+  bptree_namespace_t *ns;
+  unsigned int n;
+
+  for(ns = bptreeNamespaces; ns < bptreeNamespaces + MAX_NAMESPACE_ID; ns++){
+    for(n = 0; n < ns->nodeCarved / BPTREE_CHUNK; n++)
+      free(ns->nodeChunk[n]);
+    free(ns->nodeChunk);
+    for(n = 0; ns->reqChunk && n < (ns->reqCarved + BPTREE_CHUNK - 1) / BPTREE_CHUNK; n++)
+      free(ns->reqChunk[n]);
+    free(ns->reqChunk);
+    memset(ns, 0, sizeof(bptree_namespace_t));
+    pthread_mutex_init(&ns->mutex, NULL);
+  }
+  bptreeCapacity = capacity;
+}
+
+/**
+ * @brief Request a lock, see #lock_engine_t
+ *
+ * @param[out] handle -- a #bptree_handle_t
+ **/
+enum NODE_INSERT_RESULT bptreeRequest(unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned int namespaceID, void *handle){
+  bptree_handle_t *h = handle;
+  bptree_namespace_t *ns;
+  bptree_req_t *req, *blocker;
+
+  if(namespaceID >= MAX_NAMESPACE_ID || start_lba > end_lba)
+    return NODE_FAILED;
+  ns = &bptreeNamespaces[namespaceID];
+  pthread_mutex_lock(&ns->mutex);
+  if((req = bptReqAlloc(ns)) == NULL || !bptReserve(ns, ns->height + 2)){
+    if(req)
+      bptReqFree(ns, req);
+    pthread_mutex_unlock(&ns->mutex);
+    return NODE_FAILED;
+  }
+  req->seq       = ++ns->seq;
+  req->start_lba = start_lba;
+  req->end_lba   = end_lba;
+  req->type      = type;
+  req->waitOn    = req->waitHead = req->waitTail = req->waitNext = BPTREE_NONE;
+  h->req         = req;
+  h->namespaceID = namespaceID;
+  blocker = bptFindConflict(ns, req);
+  bptInsertRoot(ns, req);
+  if(blocker){
+    bptWait(ns, blocker, req);
+    pthread_mutex_unlock(&ns->mutex);
+    return NODE_QUEUED;
+  }
+  __atomic_store_n(&req->state, LOCK_GRANTED, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&ns->mutex);
+  return NODE_ADDED;
+}
+
+/**
+ * @brief Nonzero once the request behind the handle holds its lock
+ **/
+int bptreeGranted(void *handle){
+  return __atomic_load_n(&((bptree_handle_t *) handle)->req->state, __ATOMIC_ACQUIRE) == LOCK_GRANTED;
+}
+
+/**
+ * @brief Release a granted lock
+ *
+ * The requests that waited on it are checked again in the order they
+ * queued, each is granted or queued on the next request in its way.
+ **/
+void bptreeRelease(void *handle){
+  bptree_handle_t *h = handle;
+  bptree_namespace_t *ns = &bptreeNamespaces[h->namespaceID];
+  bptree_req_t *req = h->req, *waiter, *blocker;
+  unsigned int next;
+
+  pthread_mutex_lock(&ns->mutex);
+  if(req->state != LOCK_GRANTED){
+    pthread_mutex_unlock(&ns->mutex);
+    return;
+  }
+  bptRemoveRoot(ns, req);
+  for(next = req->waitHead; next != BPTREE_NONE; ){
+    waiter = bptReq(ns, next);
+    next = waiter->waitNext;
+    if((blocker = bptFindConflict(ns, waiter)) != NULL)
+      bptWait(ns, blocker, waiter);
+    else{
+      waiter->waitOn = BPTREE_NONE;
+      __atomic_store_n(&waiter->state, LOCK_GRANTED, __ATOMIC_RELEASE);
+    }
+  }
+  bptReqFree(ns, req);
+  pthread_mutex_unlock(&ns->mutex);
+}
+
+/**
+ * @brief Count the requests queued on the request a queued lock waits for
+ **/
+unsigned int bptreeQueueLength(void *handle){
+  bptree_handle_t *h = handle;
+  bptree_namespace_t *ns = &bptreeNamespaces[h->namespaceID];
+  unsigned int length = 0, next;
+
+  pthread_mutex_lock(&ns->mutex);
+  if(h->req->state == LOCK_QUEUED)
+    for(next = bptReq(ns, h->req->waitOn)->waitHead; next != BPTREE_NONE; next = bptReq(ns, next)->waitNext)
+      length++;
+  pthread_mutex_unlock(&ns->mutex);
+  return length;
+}
@@ -0,0 +1,92 @@
+#ifndef LOCK_BPTREE_H
+#define LOCK_BPTREE_H
+#include "lock_manager.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+/**
+ * @file
+ * @brief B+tree range lock engine
+ *
+ * Every namespace keeps its locks, held and queued, in a B+tree ordered by
+ * start LBA whose nodes are one cache line each: sorted arrays of start,
+ * end and a 32-bit reference, to a request in a leaf and to a child in an
+ * inner node, where start and end sum up the child as its least start and
+ * largest end. A conflict search scans the arrays of a node and only
+ * descends into children whose summary overlaps the range, so it touches a
+ * few contiguous lines per level instead of one scattered node per level.
+ *
+ * Like the AVL manager a request waits for older conflicting requests,
+ * held or queued, so nothing jumps the queue; it waits on one of them at a
+ * time and is checked again when that one is released. Nodes are freed
+ * once empty and never merged, so deletes never rebalance.
+ **/
+
+/**
+ * @brief Entries of a node, the most that fit a cache line beside the header
+ **/
+#define BPTREE_FANOUT 5
+
+/**
+ * @brief A node of the tree, one cache line
+ **/
+typedef struct bptree_node_s{
+  /*
+   * leaf: the ranges of the requests; inner: least start and largest end in each child
+   */
+  unsigned int start[BPTREE_FANOUT];
+  unsigned int end[BPTREE_FANOUT];
+  /*
+   * leaf: request index; inner: child node index
+   */
+  unsigned int ref[BPTREE_FANOUT];
+  unsigned short count;
+  unsigned char leaf;
+}__attribute__((aligned(CACHE_LINE_SIZE))) bptree_node_t;
+
+/**
+ * @brief A lock request
+ **/
+typedef struct bptree_req_s{
+  /*
+   * arrival order in the namespace
+   */
+  unsigned long long seq;
+  unsigned int start_lba;
+  unsigned int end_lba;
+  /*
+   * index of the request in its pool
+   */
+  unsigned int self;
+  /*
+   * request this one waits on, and FIFO of the requests waiting on this one, linked through waitNext
+   */
+  unsigned int waitOn;
+  unsigned int waitHead;
+  unsigned int waitTail;
+  unsigned int waitNext;
+  unsigned char type;
+  unsigned char state;
+}bptree_req_t;
+
+/**
+ * @brief Handle of a B+tree lock
+ **/
+typedef struct bptree_handle_s{
+  bptree_req_t *req;
+  unsigned int namespaceID;
+}bptree_handle_t;
+
+void bptreeInit(unsigned int capacity);
+
+enum NODE_INSERT_RESULT bptreeRequest(unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned int namespaceID, void *handle);
+
+int bptreeGranted(void *handle);
+
+void bptreeRelease(void *handle);
+
+unsigned int bptreeQueueLength(void *handle);
+#ifdef __cplusplus
+}
+#endif
+#endif//lock_bptree.h
@@ -0,0 +1,358 @@
+#include<stdlib.h>
+#include<string.h>
+#include<pthread.h>
+#include"lock_manager.h"
+#include"lock_compact.h"
+
+/**
+ * @brief Tree of one namespace, guarded by its mutex
+ **/
+typedef struct compact_namespace_s{
+  pthread_mutex_t mutex;
+  compact_tree_t tree;
+}__attribute__((aligned(CACHE_LINE_SIZE))) compact_namespace_t;
+
+static compact_namespace_t compactNamespaces[MAX_NAMESPACE_ID];
+
+#define compactNode(tree, i) compactTreeNode(tree, i)
+
+static inline unsigned int compactHeight(compact_tree_t *tree, unsigned int index){
+  return index == COMPACT_NONE ? 0 : compactNode(tree, index)->bits & COMPACT_HEIGHT;
+}
+
+/**
+ * @brief Recompute the height and largest end of a node from its children
+ **/
+static void compactUpdate(compact_tree_t *tree, compact_node_t *node){
+  unsigned int left = compactHeight(tree, node->child[0]), right = compactHeight(tree, node->child[1]), dir, bits;
+
+  node->max_end_lba = node->end_lba;
+  for(dir = 0; dir < 2; dir++)
+    if(node->child[dir] != COMPACT_NONE)
+      node->max_end_lba = MAX(node->max_end_lba, compactNode(tree, node->child[dir])->max_end_lba);
+  bits = (node->bits & ~COMPACT_HEIGHT) | (MAX(left, right) + 1);
+  if(bits != node->bits)
+    compactSetBits(node, bits);
+}
+
+/**
+ * @brief Rotate the child on side dir of a subtree up to its root
+ *
+ * @retval Index of the new root
+ **/
+static unsigned int compactRotate(compact_tree_t *tree, unsigned int index, unsigned int dir){
+  compact_node_t *node = compactNode(tree, index);
+  unsigned int up = node->child[dir];
+  compact_node_t *child = compactNode(tree, up);
+
+  node->child[dir] = child->child[!dir];
+  child->child[!dir] = index;
+  compactUpdate(tree, node);
+  compactUpdate(tree, child);
+  return up;
+}
+
+/**
+ * @brief Update a subtree root after one of its children changed, rotating it back into balance
+ *
+ * @retval Index of the root of the balanced subtree
+ **/
+static unsigned int compactBalance(compact_tree_t *tree, unsigned int index){
+  compact_node_t *node = compactNode(tree, index), *child;
+  int balance = (int) compactHeight(tree, node->child[1]) - (int) compactHeight(tree, node->child[0]);
+  unsigned int dir;
+
+  if(balance < -1 || balance > 1){
+    dir = balance > 0;
+    child = compactNode(tree, node->child[dir]);
+    if(compactHeight(tree, child->child[!dir]) > compactHeight(tree, child->child[dir]))
+      node->child[dir] = compactRotate(tree, node->child[dir], !dir);
+    return compactRotate(tree, index, dir);
+  }
+  compactUpdate(tree, node);
+  return index;
+}
+
+/**
+ * @brief Side of node the key of req goes to: by start LBA, then arrival
+ **/
+static inline unsigned int compactSide(const compact_node_t *node, const compact_node_t *req){
+  return req->start_lba != node->start_lba ? req->start_lba > node->start_lba : req->seq > node->seq;
+}
+
+static unsigned int compactInsert(compact_tree_t *tree, unsigned int index, unsigned int add){
+  compact_node_t *node;
+  unsigned int dir;
+
+  if(index == COMPACT_NONE)
+    return add;
+  node = compactNode(tree, index);
+  dir  = compactSide(node, compactNode(tree, add));
+  node->child[dir] = compactInsert(tree, node->child[dir], add);
+  return compactBalance(tree, index);
+}
+
+/**
+ * @brief Unlink the leftmost node of a subtree
+ *
+ * @param[out] min -- index of that node
+ * @retval Index of the root of what is left
+ **/
+static unsigned int compactRemoveMin(compact_tree_t *tree, unsigned int index, unsigned int *min){
+  compact_node_t *node = compactNode(tree, index);
+
+  if(node->child[0] == COMPACT_NONE){
+    *min = index;
+    return node->child[1];
+  }
+  node->child[0] = compactRemoveMin(tree, node->child[0], min);
+  return compactBalance(tree, index);
+}
+
+/**
+ * @brief Unlink a node from a subtree, its successor takes its place
+ *
+ * @retval Index of the root of what is left
+ **/
+static unsigned int compactRemove(compact_tree_t *tree, unsigned int index, const compact_node_t *del){
+  compact_node_t *node = compactNode(tree, index), *min;
+  unsigned int dir, right, up;
+
+  if(node != del){
+    dir = compactSide(node, del);
+    node->child[dir] = compactRemove(tree, node->child[dir], del);
+    return compactBalance(tree, index);
+  }
+  if(node->child[0] == COMPACT_NONE || node->child[1] == COMPACT_NONE)
+    return node->child[node->child[0] == COMPACT_NONE];
+  right = compactRemoveMin(tree, node->child[1], &up);
+  min = compactNode(tree, up);
+  min->child[0] = node->child[0];
+  min->child[1] = right;
+  return compactBalance(tree, up);
+}
+
+/**
+ * @brief Count the requests req has to wait for below a node, up to limit
+ *
+ * That is the older requests overlapping req, unless both are reads. The
+ * largest end prunes subtrees ending before req, the key those starting
+ * after it.
+ **/
+static unsigned int compactConflicts(compact_tree_t *tree, unsigned int index, const compact_node_t *req, unsigned int limit){
+  compact_node_t *node;
+  unsigned int count = 0;
+
+  while(index != COMPACT_NONE && count < limit){
+    node = compactNode(tree, index);
+    if(node->max_end_lba < req->start_lba)
+      break;
+    count += compactConflicts(tree, node->child[0], req, limit - count);
+    if(count >= limit || node->start_lba > req->end_lba)
+      break;
+    if(node->end_lba >= req->start_lba && node->seq < req->seq && ((node->bits | req->bits) & COMPACT_WRITE))
+      count++;
+    index = node->child[1];
+  }
+  return count;
+}
+
+/**
+ * @brief Grant the queued requests overlapping [start_lba, end_lba] below a node that no longer wait for anything
+ **/
+static void compactRetry(compact_tree_t *tree, unsigned int index, unsigned int start_lba, unsigned int end_lba){
+  compact_node_t *node;
+
+  while(index != COMPACT_NONE){
+    node = compactNode(tree, index);
+    if(node->max_end_lba < start_lba)
+      return;
+    compactRetry(tree, node->child[0], start_lba, end_lba);
+    if(node->start_lba > end_lba)
+      return;
+    if(node->end_lba >= start_lba && !(node->bits & COMPACT_GRANTED) && compactConflicts(tree, tree->root, node, 1) == 0)
+      compactSetBits(node, node->bits | COMPACT_GRANTED);
+    index = node->child[1];
+  }
+}
+
+/**
+ * @brief Empty a tree and free its pool, then size it for capacity nodes
+ *
+ * @param[in,out] tree -- zeroed, or set up by an earlier call
+ **/
+void compactTreeInit(compact_tree_t *tree, unsigned int capacity){
+  unsigned int n;
+
+  for(n = 0; tree->chunk && n < (tree->carved + COMPACT_CHUNK - 1) / COMPACT_CHUNK; n++)
+    free(tree->chunk[n]);
+  free(tree->chunk);
+  memset(tree, 0, sizeof(compact_tree_t));
+  tree->capacity = capacity;
+}
+
+/**
+ * @brief Take a node for a new request, queued and not in the tree yet
+ *
+ * The request is younger than every node taken before it.
+ *
+ * @retval Index of the node, #COMPACT_NONE past the capacity or out of memory
+ **/
+unsigned int compactTreeAlloc(compact_tree_t *tree, unsigned int start_lba, unsigned int end_lba, unsigned int type){
+  unsigned int limit = tree->capacity + 1, i, last, index;
+  compact_node_t *node;
+
+  if(tree->chunk == NULL && (tree->chunk = calloc((limit + COMPACT_CHUNK - 1) / COMPACT_CHUNK, sizeof(compact_node_t *))) == NULL)
+    return COMPACT_NONE;
+  if(tree->free == COMPACT_NONE){
+    if(tree->carved >= limit ||
+       (tree->chunk[tree->carved >> COMPACT_CHUNK_BITS] = aligned_alloc(CACHE_LINE_SIZE, COMPACT_CHUNK * sizeof(compact_node_t))) == NULL)
+      return COMPACT_NONE;
+    last = MIN(limit, (tree->carved | (COMPACT_CHUNK - 1)) + 1);
+    for(i = tree->carved ? tree->carved : 1; i < last; i++){
+      compactNode(tree, i)->bits     = 0;
+      compactNode(tree, i)->child[0] = tree->free;
+      tree->free = i;
+    }
+    tree->carved = last;
+  }
+  index = tree->free;
+  node  = compactNode(tree, index);
+  tree->free = node->child[0];
+  tree->count++;
+  node->seq       = ++tree->seq;
+  node->start_lba = start_lba;
+  node->end_lba   = end_lba;
+  compactSetBits(node, type ? COMPACT_WRITE : 0);
+  return index;
+}
+
+/**
+ * @brief Return a node to the pool, it must not be in the tree
+ **/
+void compactTreeFree(compact_tree_t *tree, unsigned int index){
+  compact_node_t *node = compactNode(tree, index);
+  compactSetBits(node, 0);
+  node->child[0] = tree->free;
+  tree->free = index;
+  tree->count--;
+}
+
+/**
+ * @brief Link a node into the tree
+ **/
+void compactTreeInsert(compact_tree_t *tree, unsigned int index){
+  compact_node_t *node = compactNode(tree, index);
+  node->child[0]    = node->child[1] = COMPACT_NONE;
+  node->max_end_lba = node->end_lba;
+  compactSetBits(node, (node->bits & ~COMPACT_HEIGHT) | 1);
+  tree->root = compactInsert(tree, tree->root, index);
+}
+
+/**
+ * @brief Unlink a node from the tree
+ **/
+void compactTreeRemove(compact_tree_t *tree, unsigned int index){
+  tree->root = compactRemove(tree, tree->root, compactNode(tree, index));
+}
+
+/**
+ * @brief Count the nodes in the tree req has to wait for, up to limit
+ **/
+unsigned int compactTreeConflicts(compact_tree_t *tree, const compact_node_t *req, unsigned int limit){
+  return compactConflicts(tree, tree->root, req, limit);
+}
+
+/**
+ * @brief Grant the queued nodes in the tree overlapping [start_lba, end_lba] that no longer wait for anything
+ **/
+void compactTreeRetry(compact_tree_t *tree, unsigned int start_lba, unsigned int end_lba){
+  compactRetry(tree, tree->root, start_lba, end_lba);
+}
+
+/**
+ * @brief Reset the engine for at most capacity locks held or queued per namespace
+ *
+ * Every lock must be released.
+ **/
+void compactInit(unsigned int capacity){
+  compact_namespace_t *ns;
+
+  for(ns = compactNamespaces; ns < compactNamespaces + MAX_NAMESPACE_ID; ns++){
+    compactTreeInit(&ns->tree, capacity);
+    pthread_mutex_init(&ns->mutex, NULL);
+  }
+}
+
+/**
+ * @brief Request a lock, see #lock_engine_t
+ *
+ * @param[out] handle -- a #compact_handle_t
+ **/
+enum NODE_INSERT_RESULT compactRequest(unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned int namespaceID, void *handle){
+  compact_handle_t *h = handle;
+  compact_namespace_t *ns;
+  compact_node_t *node;
+  unsigned int index;
+  int granted;
+
+  if(namespaceID >= MAX_NAMESPACE_ID || start_lba > end_lba)
+    return NODE_FAILED;
+  ns = &compactNamespaces[namespaceID];
+  pthread_mutex_lock(&ns->mutex);
+  if((index = compactTreeAlloc(&ns->tree, start_lba, end_lba, type)) == COMPACT_NONE){
+    pthread_mutex_unlock(&ns->mutex);
+    return NODE_FAILED;
+  }
+  node = compactNode(&ns->tree, index);
+  granted = compactTreeConflicts(&ns->tree, node, 1) == 0;
+  if(granted)
+    compactSetBits(node, node->bits | COMPACT_GRANTED);
+  compactTreeInsert(&ns->tree, index);
+  h->node        = node;
+  h->index       = index;
+  h->namespaceID = namespaceID;
+  pthread_mutex_unlock(&ns->mutex);
+  return granted ? NODE_ADDED : NODE_QUEUED;
+}
+
+/**
+ * @brief Nonzero once the request behind the handle holds its lock
+ **/
+int compactGranted(void *handle){
+  return (__atomic_load_n(&((compact_handle_t *) handle)->node->bits, __ATOMIC_ACQUIRE) & COMPACT_GRANTED) != 0;
+}
+
+/**
+ * @brief Release a granted lock, granting the queued requests it was the last to hold back
+ **/
+void compactRelease(void *handle){
+  compact_handle_t *h = handle;
+  compact_namespace_t *ns = &compactNamespaces[h->namespaceID];
+  compact_node_t *node = h->node;
+
+  pthread_mutex_lock(&ns->mutex);
+  if(!(node->bits & COMPACT_GRANTED)){
+    pthread_mutex_unlock(&ns->mutex);
+    return;
+  }
+  compactTreeRemove(&ns->tree, h->index);
+  compactTreeRetry(&ns->tree, node->start_lba, node->end_lba);
+  compactTreeFree(&ns->tree, h->index);
+  pthread_mutex_unlock(&ns->mutex);
+}
+
+/**
+ * @brief Count the older requests a queued lock waits for
+ **/
+unsigned int compactQueueLength(void *handle){
+  compact_handle_t *h = handle;
+  compact_namespace_t *ns = &compactNamespaces[h->namespaceID];
+  unsigned int length = 0;
+
+  pthread_mutex_lock(&ns->mutex);
+  if(!(h->node->bits & COMPACT_GRANTED))
+    length = compactTreeConflicts(&ns->tree, h->node, ~0u);
+  pthread_mutex_unlock(&ns->mutex);
+  return length;
+}
@@ -0,0 +1,146 @@
+#ifndef LOCK_COMPACT_H
+#define LOCK_COMPACT_H
+#include "lock_manager.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+/**
+ * @file
+ * @brief Compact AVL range lock engine, 32 bytes per lock
+ *
+ * An interval tree like the AVL manager's, cut down to what a lock needs:
+ * nodes come from a per-namespace pool and link to their children by
+ * 32-bit index, there is no parent link, and height, type and state share
+ * one word. Two nodes fit a cache line, so a table of millions of locks
+ * takes a quarter of the memory of #tree_node_t and more of it stays cached.
+ *
+ * Queued requests sit in the tree beside the granted ones and, as in the
+ * AVL manager, a request waits for every older conflicting request, held
+ * or queued. There are no wait lists: a release checks the queued requests
+ * its range overlaps again, the only ones it can unblock.
+ **/
+
+/**
+ * @brief compact_node_t::bits: the height of the node's subtree
+ **/
+#define COMPACT_HEIGHT  0x3fu
+
+/**
+ * @brief compact_node_t::bits: a write lock
+ **/
+#define COMPACT_WRITE   0x40u
+
+/**
+ * @brief compact_node_t::bits: the lock is granted, else queued
+ **/
+#define COMPACT_GRANTED 0x80u
+
+/**
+ * @brief A lock request, held or queued
+ **/
+typedef struct compact_node_s{
+  /*
+   * arrival order in the namespace, ties the tree key
+   */
+  unsigned long long seq;
+  unsigned int start_lba;
+  unsigned int end_lba;
+  /*
+   * largest end LBA in the node's subtree
+   */
+  unsigned int max_end_lba;
+  /*
+   * pool index of the children, 0 for none; child[0] links the free list
+   */
+  unsigned int child[2];
+  /*
+   * COMPACT_HEIGHT, COMPACT_WRITE and COMPACT_GRANTED; polled by the owner without the mutex
+   */
+  unsigned int bits;
+}compact_node_t;
+
+/**
+ * @brief Handle of a compact lock
+ **/
+typedef struct compact_handle_s{
+  compact_node_t *node;
+  unsigned int index;
+  unsigned int namespaceID;
+}compact_handle_t;
+
+/**
+ * @brief Nodes carved from the heap at a time, as a shift
+ **/
+#define COMPACT_CHUNK_BITS 10
+#define COMPACT_CHUNK      (1u << COMPACT_CHUNK_BITS)
+
+/**
+ * @brief Index of no node, index 0 of a pool is never handed out
+ **/
+#define COMPACT_NONE 0
+
+/**
+ * @brief Node pool and tree, one per namespace of the compact engine
+ *
+ * Engines that keep their requests in compact nodes build on it too, see
+ * lock_flat.h. The caller serializes every call. Handles are polled
+ * without that lock, so the chunks never move; their directory is sized
+ * for the capacity.
+ **/
+typedef struct compact_tree_s{
+  compact_node_t **chunk;
+  unsigned int carved;
+  /*
+   * free nodes linked through child[0]
+   */
+  unsigned int free;
+  unsigned int root;
+  /*
+   * nodes taken from the pool, in the tree or not
+   */
+  unsigned int count;
+  unsigned int capacity;
+  /*
+   * last arrival order handed out
+   */
+  unsigned long long seq;
+}compact_tree_t;
+
+static inline compact_node_t *compactTreeNode(compact_tree_t *tree, unsigned int index){
+  return &tree->chunk[index >> COMPACT_CHUNK_BITS][index & (COMPACT_CHUNK - 1)];
+}
+
+/**
+ * @brief Store the bits of a node, the owner may be polling them
+ **/
+static inline void compactSetBits(compact_node_t *node, unsigned int bits){
+  __atomic_store_n(&node->bits, bits, __ATOMIC_RELEASE);
+}
+
+void compactTreeInit(compact_tree_t *tree, unsigned int capacity);
+
+unsigned int compactTreeAlloc(compact_tree_t *tree, unsigned int start_lba, unsigned int end_lba, unsigned int type);
+
+void compactTreeFree(compact_tree_t *tree, unsigned int index);
+
+void compactTreeInsert(compact_tree_t *tree, unsigned int index);
+
+void compactTreeRemove(compact_tree_t *tree, unsigned int index);
+
+unsigned int compactTreeConflicts(compact_tree_t *tree, const compact_node_t *req, unsigned int limit);
+
+void compactTreeRetry(compact_tree_t *tree, unsigned int start_lba, unsigned int end_lba);
+
+void compactInit(unsigned int capacity);
+
+enum NODE_INSERT_RESULT compactRequest(unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned int namespaceID, void *handle);
+
+int compactGranted(void *handle);
+
+void compactRelease(void *handle);
+
+unsigned int compactQueueLength(void *handle);
+#ifdef __cplusplus
+}
+#endif
+#endif//lock_compact.h
@@ -0,0 +1,71 @@
+#include<stdio.h>
+#include<string.h>
+#include"lock_manager.h"
+#include"lock_engine.h"
+#include"lock_skiplist.h"
+#include"lock_bptree.h"
+#include"lock_compact.h"
+#include"lock_flat.h"
+
+/**
+ * @brief The AVL lock manager
+ **/
+static enum NODE_INSERT_RESULT avlRequest(unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned int namespaceID, void *handle){
+  return lockRequest(start_lba, end_lba, type, 1, namespaceID, handle);
+}
+
+static int avlGranted(void *handle){
+  return lockGranted(handle);
+}
+
+static void avlRelease(void *handle){
+  lockRelease(handle);
+}
+
+/**
+ * @brief Count the waiters on the pending list a queued node is on
+ *
+ * The list is circular through its holder, the only granted node on it.
+ **/
+static unsigned int avlQueueLength(void *handle){
+  tree_node_t *node = ((lock_handle_t *) handle)->node;
+  list_head_t *iter;
+  unsigned int length = 0;
+  for(iter = node->list.next; iter != &node->list; iter = iter->next)
+    length++;
+  return length;
+}
+
+/**
+ * @brief All engines, terminated by an entry without a name
+ **/
+const lock_engine_t lockEngines[] = {
+  { "avl", treeInitCapacity, avlRequest, avlGranted, avlRelease, avlQueueLength },
+  { "skiplist", skipListInit, skipListRequest, skipListGranted, skipListRelease, NULL },
+  { "bptree", bptreeInit, bptreeRequest, bptreeGranted, bptreeRelease, bptreeQueueLength },
+  { "compact", compactInit, compactRequest, compactGranted, compactRelease, compactQueueLength },
+  { "flat", flatInit, flatRequest, flatGranted, flatRelease, flatQueueLength },
+  { NULL }
+};
+
+/**
+ * @brief Look an engine up by name
+ *
+ * @retval The engine, NULL if there is none of that name
+ **/
+const lock_engine_t *lockEngineFind(const char *name){
+  const lock_engine_t *engine;
+  for(engine = lockEngines; engine->name; engine++)
+    if(strcmp(engine->name, name) == 0)
+      return engine;
+  return NULL;
+}
+
+/**
+ * @brief Print the engine names, separated by '|'
+ **/
+void lockEngineList(FILE *out){
+  const lock_engine_t *engine;
+  for(engine = lockEngines; engine->name; engine++)
+    fprintf(out, "%s%s", engine == lockEngines ? "" : "|", engine->name);
+}
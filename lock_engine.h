@@ -0,0 +1,51 @@
+#ifndef LOCK_ENGINE_H
+#define LOCK_ENGINE_H
+#include <stdio.h>
+#include "lock_manager.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+/**
+ * @file
+ * @brief Lock engines the benchmark and replay tools can drive
+ *
+ * Every engine hides its lock behind an opaque handle of at most
+ * #LOCK_ENGINE_HANDLE_SIZE bytes and queues a conflicting request
+ * rather than refusing it.
+ **/
+
+/**
+ * @brief Room the tools reserve for an engine's handle
+ **/
+#define LOCK_ENGINE_HANDLE_SIZE 32
+
+/**
+ * @brief Operations of a lock engine
+ **/
+typedef struct lock_engine_s{
+  const char *name;
+  /*
+   * reset the engine for at most capacity locks held or queued at a time
+   */
+  void (*init)(unsigned int capacity);
+  enum NODE_INSERT_RESULT (*request)(unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned int namespaceID, void *handle);
+  /*
+   * nonzero once the request behind the handle holds its lock
+   */
+  int  (*granted)(void *handle);
+  void (*release)(void *handle);
+  /*
+   * length of the queue a NODE_QUEUED request waits in, NULL if the engine can not tell
+   */
+  unsigned int (*queueLength)(void *handle);
+}lock_engine_t;
+
+extern const lock_engine_t lockEngines[];
+
+const lock_engine_t *lockEngineFind(const char *name);
+
+void lockEngineList(FILE *out);
+#ifdef __cplusplus
+}
+#endif
+#endif//lock_engine.h
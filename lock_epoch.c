@@ -0,0 +1,205 @@
+#include<stdlib.h>
+#include<pthread.h>
+#include"lock_manager.h"
+#include"lock_epoch.h"
+
+/**
+ * @brief Lists of retired memory, one per epoch still in its grace period
+ **/
+#define EPOCH_LISTS 3
+
+/**
+ * @brief Retires between two attempts to move the global epoch on
+ **/
+#define EPOCH_ADVANCE_EVERY 64
+
+/**
+ * @brief Most pointers freed by one epochEnter, so no caller pays for a whole list
+ **/
+#define EPOCH_FREE_BATCH 8
+
+/**
+ * @brief Epoch record of one thread
+ *
+ * Records are never freed: the record of an exited thread is adopted, with
+ * whatever it still has to free, by the next thread that starts.
+ **/
+typedef struct epoch_thread_s{
+  struct epoch_thread_s *next;
+  /*
+   * epoch announced on entry, read by the other threads
+   */
+  unsigned long epoch;
+  unsigned int active;
+  unsigned int owned;
+  /*
+   * nesting depth of epochEnter, local
+   */
+  unsigned int depth;
+  unsigned int retires;
+  /*
+   * retired pointers, list i holds those retired in epoch listEpoch[i]
+   */
+  unsigned long listEpoch[EPOCH_LISTS];
+  void **list[EPOCH_LISTS];
+  size_t count[EPOCH_LISTS];
+  size_t size[EPOCH_LISTS];
+}__attribute__((aligned(CACHE_LINE_SIZE))) epoch_thread_t;
+
+static unsigned long globalEpoch __attribute__((aligned(CACHE_LINE_SIZE))) = EPOCH_LISTS;
+static epoch_thread_t *epochThreads __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static __thread epoch_thread_t *epochThread;
+static pthread_key_t epochKey;
+static pthread_once_t epochOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Thread exit hook, leaves the record and its lists to the next thread
+ **/
+static void epochThreadExit(void *arg){
+  epoch_thread_t *thread = arg;
+  __atomic_store_n(&thread->active, 0, __ATOMIC_RELEASE);
+  __atomic_store_n(&thread->owned, 0, __ATOMIC_RELEASE);
+  epochThread = NULL;
+}
+
+static void epochKeyCreate(void){
+  pthread_key_create(&epochKey, epochThreadExit);
+}
+
+/**
+ * @brief Get the record of the calling thread, adopting a free one or registering a new one
+ *
+ * @retval Pointer to the record, NULL if it could not be allocated
+ **/
+static epoch_thread_t *epochLocal(void){
+  epoch_thread_t *thread = epochThread;
+  unsigned int unowned;
+
+  if(thread)
+    return thread;
+  pthread_once(&epochOnce, epochKeyCreate);
+  for(thread = __atomic_load_n(&epochThreads, __ATOMIC_ACQUIRE); thread; thread = thread->next){
+    unowned = 0;
+    if(__atomic_compare_exchange_n(&thread->owned, &unowned, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+  if(thread == NULL){
+    if((thread = aligned_alloc(CACHE_LINE_SIZE, sizeof(epoch_thread_t))) == NULL)
+      return NULL;
+    *thread = (epoch_thread_t){ .owned = 1 };
+    thread->next = __atomic_load_n(&epochThreads, __ATOMIC_RELAXED);
+    while(!__atomic_compare_exchange_n(&epochThreads, &thread->next, thread, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      continue;
+  }
+  pthread_setspecific(epochKey, thread);
+  epochThread = thread;
+  return thread;
+}
+
+/**
+ * @brief Free a list of retired pointers
+ **/
+static void epochFree(epoch_thread_t *thread, unsigned int list){
+  size_t n;
+  for(n = 0; n < thread->count[list]; n++)
+    free(thread->list[list][n]);
+  thread->count[list] = 0;
+}
+
+/**
+ * @brief Move the global epoch on if every thread inside has seen it
+ **/
+static void epochAdvance(void){
+  unsigned long epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+  epoch_thread_t *thread;
+
+  for(thread = __atomic_load_n(&epochThreads, __ATOMIC_ACQUIRE); thread; thread = thread->next)
+    if(__atomic_load_n(&thread->active, __ATOMIC_SEQ_CST) && __atomic_load_n(&thread->epoch, __ATOMIC_SEQ_CST) != epoch)
+      return;
+  __atomic_compare_exchange_n(&globalEpoch, &epoch, epoch + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Start reading shared memory, nests
+ *
+ * Frees a few of the pointers the thread retired two epochs ago or earlier.
+ **/
+void epochEnter(void){
+  epoch_thread_t *thread = epochLocal();
+  unsigned int list, budget = EPOCH_FREE_BATCH;
+  unsigned long epoch;
+
+  if(thread == NULL)
+    abort();
+  if(thread->depth++)
+    return;
+  __atomic_store_n(&thread->active, 1, __ATOMIC_SEQ_CST);
+  epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&thread->epoch, epoch, __ATOMIC_SEQ_CST);
+  for(list = 0; list < EPOCH_LISTS; list++)
+    if(thread->listEpoch[list] + 2 <= epoch)
+      while(budget && thread->count[list]){
+	free(thread->list[list][--thread->count[list]]);
+	budget--;
+      }
+}
+
+/**
+ * @brief Stop reading shared memory
+ **/
+void epochExit(void){
+  epoch_thread_t *thread = epochThread;
+  if(--thread->depth == 0)
+    __atomic_store_n(&thread->active, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Free memory once no thread can still be reading it, call between epochEnter and epochExit
+ *
+ * The memory must already be unreachable to threads entering from now on.
+ *
+ * @param[in] ptr -- memory from malloc
+ **/
+void epochRetire(void *ptr){
+  epoch_thread_t *thread = epochThread;
+  unsigned long epoch;
+  unsigned int list;
+  void **grown;
+
+  /*
+   * the global epoch, not the one the thread entered in: it may have moved
+   * on already and let in readers that can still reach ptr
+   */
+  epoch = __atomic_load_n(&globalEpoch, __ATOMIC_SEQ_CST);
+  list  = epoch % EPOCH_LISTS;
+
+  /*
+   * the list last held an epoch at least EPOCH_LISTS back, long safe
+   */
+  if(thread->listEpoch[list] != epoch){
+    epochFree(thread, list);
+    thread->listEpoch[list] = epoch;
+  }
+  if(thread->count[list] == thread->size[list]){
+    size_t size = thread->size[list] ? thread->size[list] * 2 : 64;
+    if((grown = realloc(thread->list[list], size * sizeof(void *))) == NULL)
+      return;  /* leaked rather than freed while it may still be read */
+    thread->list[list] = grown;
+    thread->size[list] = size;
+  }
+  thread->list[list][thread->count[list]++] = ptr;
+  if(++thread->retires % EPOCH_ADVANCE_EVERY == 0)
+    epochAdvance();
+}
+
+/**
+ * @brief Free everything retired by every thread, only when no thread is between epochEnter and epochExit
+ **/
+void epochBarrier(void){
+  epoch_thread_t *thread;
+  unsigned int list;
+  for(thread = __atomic_load_n(&epochThreads, __ATOMIC_ACQUIRE); thread; thread = thread->next)
+    for(list = 0; list < EPOCH_LISTS; list++)
+      epochFree(thread, list);
+}
@@ -0,0 +1,33 @@
+#ifndef LOCK_EPOCH_H
+#define LOCK_EPOCH_H
+#ifdef __cplusplus
+extern "C" {
+#endif
+/**
+ * @file
+ * @brief Epoch based reclamation for structures read without a lock
+ *
+ *     epochEnter();
+ *     ...                   // follow shared pointers, unlink a node
+ *     epochRetire(node);    // freed once no thread can still be reading it
+ *     epochExit();
+ *
+ * A thread announces the global epoch it entered in; the epoch only moves
+ * on once every thread inside has seen it, so memory retired in epoch e is
+ * unreachable to everyone by epoch e + 2 and is freed then. Retired memory
+ * waits on lists of the retiring thread, nothing is shared on the fast path
+ * but the read of the global epoch.
+ **/
+
+void epochEnter(void);
+
+void epochExit(void);
+
+void epochRetire(void *ptr);
+
+void epochBarrier(void);
+
+#ifdef __cplusplus
+}
+#endif
+#endif//lock_epoch.h
@@ -0,0 +1,338 @@
+#include<stdint.h>
+#include<string.h>
+#include<pthread.h>
+#if defined(__x86_64__) && !defined(LOCK_FLAT_SCALAR)
+#include<immintrin.h>
+#endif
+#include"lock_manager.h"
+#include"lock_compact.h"
+#include"lock_flat.h"
+
+/**
+ * @brief Flips the top bit of an LBA, so signed compares order LBAs as unsigned
+ **/
+#define FLAT_BIAS 0x80000000u
+
+/**
+ * @brief Locks of one namespace, guarded by its mutex
+ **/
+typedef struct flat_namespace_s{
+  /*
+   * biased start and end LBA of each slot, in arrival order
+   */
+  int starts[FLAT_SLOTS] __attribute__((aligned(CACHE_LINE_SIZE)));
+  int ends[FLAT_SLOTS] __attribute__((aligned(CACHE_LINE_SIZE)));
+  /*
+   * compact node of each slot
+   */
+  unsigned int index[FLAT_SLOTS];
+  /*
+   * slots holding a write, and slots still queued
+   */
+  uint64_t writes;
+  uint64_t queued;
+  unsigned int count;
+  /*
+   * set while the locks are in the tree of pool instead of the arrays
+   */
+  unsigned int tree;
+  pthread_mutex_t mutex;
+  compact_tree_t pool;
+}__attribute__((aligned(CACHE_LINE_SIZE))) flat_namespace_t;
+
+static flat_namespace_t flatNamespaces[MAX_NAMESPACE_ID];
+
+static inline int flatBias(unsigned int lba){
+  return (int) (lba ^ FLAT_BIAS);
+}
+
+/**
+ * @brief Mask of the first count slots
+ **/
+static inline uint64_t flatSlots(unsigned int count){
+  return count >= FLAT_SLOTS ? ~0ull : (1ull << count) - 1;
+}
+
+#if defined(__x86_64__) && !defined(LOCK_FLAT_SCALAR)
+/**
+ * @brief Mask of the slots overlapping [start_lba, end_lba], four slots at a time
+ *
+ * Slots past the count are compared too and masked off.
+ **/
+static uint64_t flatOverlapSse2(const flat_namespace_t *ns, unsigned int start_lba, unsigned int end_lba){
+  __m128i start = _mm_set1_epi32(flatBias(start_lba)), end = _mm_set1_epi32(flatBias(end_lba)), miss;
+  uint64_t mask = 0;
+  unsigned int i;
+
+  for(i = 0; i < ns->count; i += 4){
+    miss = _mm_or_si128(_mm_cmpgt_epi32(_mm_load_si128((const __m128i *) &ns->starts[i]), end),
+			_mm_cmpgt_epi32(start, _mm_load_si128((const __m128i *) &ns->ends[i])));
+    mask |= (uint64_t) (~_mm_movemask_ps(_mm_castsi128_ps(miss)) & 0xf) << i;
+  }
+  return mask & flatSlots(ns->count);
+}
+
+/**
+ * @brief #flatOverlapSse2 eight slots at a time
+ **/
+__attribute__((target("avx2")))
+static uint64_t flatOverlapAvx2(const flat_namespace_t *ns, unsigned int start_lba, unsigned int end_lba){
+  __m256i start = _mm256_set1_epi32(flatBias(start_lba)), end = _mm256_set1_epi32(flatBias(end_lba)), miss;
+  uint64_t mask = 0;
+  unsigned int i;
+
+  for(i = 0; i < ns->count; i += 8){
+    miss = _mm256_or_si256(_mm256_cmpgt_epi32(_mm256_load_si256((const __m256i *) &ns->starts[i]), end),
+			   _mm256_cmpgt_epi32(start, _mm256_load_si256((const __m256i *) &ns->ends[i])));
+    mask |= (uint64_t) (~_mm256_movemask_ps(_mm256_castsi256_ps(miss)) & 0xff) << i;
+  }
+  return mask & flatSlots(ns->count);
+}
+
+static uint64_t (*flatOverlap)(const flat_namespace_t *, unsigned int, unsigned int) = flatOverlapSse2;
+#else
+/**
+ * @brief Mask of the slots overlapping [start_lba, end_lba], one compare per slot
+ **/
+static uint64_t flatOverlap(const flat_namespace_t *ns, unsigned int start_lba, unsigned int end_lba){
+  int start = flatBias(start_lba), end = flatBias(end_lba);
+  uint64_t mask = 0;
+  unsigned int i;
+
+  for(i = 0; i < ns->count; i++)
+    mask |= (uint64_t) (ns->starts[i] <= end && ns->ends[i] >= start) << i;
+  return mask;
+}
+#endif
+
+/**
+ * @brief Mask of the slots a lock has to wait for among those in mask
+ **/
+static inline uint64_t flatConflicts(const flat_namespace_t *ns, const compact_node_t *node, uint64_t mask){
+  mask &= flatOverlap(ns, node->start_lba, node->end_lba);
+  return node->bits & COMPACT_WRITE ? mask : mask & ns->writes;
+}
+
+/**
+ * @brief Put a lock in the next slot
+ **/
+static void flatAppend(flat_namespace_t *ns, unsigned int index){
+  compact_node_t *node = compactTreeNode(&ns->pool, index);
+  unsigned int slot = ns->count++;
+
+  ns->starts[slot] = flatBias(node->start_lba);
+  ns->ends[slot]   = flatBias(node->end_lba);
+  ns->index[slot]  = index;
+  ns->writes |= (uint64_t) !!(node->bits & COMPACT_WRITE) << slot;
+  ns->queued |= (uint64_t) !(node->bits & COMPACT_GRANTED) << slot;
+}
+
+/**
+ * @brief Drop the bit of a slot from a mask, moving the younger bits down
+ **/
+static inline uint64_t flatSqueeze(uint64_t mask, unsigned int slot){
+  return (mask & flatSlots(slot)) | (slot + 1 < FLAT_SLOTS ? mask >> (slot + 1) << slot : 0);
+}
+
+/**
+ * @brief Take a lock out of its slot, the younger slots move down
+ **/
+static void flatRemove(flat_namespace_t *ns, unsigned int slot){
+  unsigned int after = ns->count - slot - 1;
+
+  memmove(&ns->starts[slot], &ns->starts[slot + 1], after * sizeof(int));
+  memmove(&ns->ends[slot], &ns->ends[slot + 1], after * sizeof(int));
+  memmove(&ns->index[slot], &ns->index[slot + 1], after * sizeof(unsigned int));
+  ns->writes = flatSqueeze(ns->writes, slot);
+  ns->queued = flatSqueeze(ns->queued, slot);
+  ns->count--;
+}
+
+/**
+ * @brief Grant the queued slots overlapping [start_lba, end_lba] that no longer wait for any older slot
+ **/
+static void flatRetry(flat_namespace_t *ns, unsigned int start_lba, unsigned int end_lba){
+  uint64_t retry = flatOverlap(ns, start_lba, end_lba) & ns->queued;
+  compact_node_t *node;
+  unsigned int slot;
+
+  while(retry){
+    slot   = __builtin_ctzll(retry);
+    retry &= retry - 1;
+    node   = compactTreeNode(&ns->pool, ns->index[slot]);
+    if(flatConflicts(ns, node, flatSlots(slot)) == 0){
+      ns->queued &= ~(1ull << slot);
+      compactSetBits(node, node->bits | COMPACT_GRANTED);
+    }
+  }
+}
+
+/**
+ * @brief Move the locks from the arrays into the tree
+ **/
+static void flatGrow(flat_namespace_t *ns){
+  unsigned int slot;
+
+  for(slot = 0; slot < ns->count; slot++)
+    compactTreeInsert(&ns->pool, ns->index[slot]);
+  ns->count  = 0;
+  ns->writes = ns->queued = 0;
+  ns->tree   = 1;
+}
+
+/**
+ * @brief Gather the nodes of a subtree into the slot indices, in key order
+ **/
+static void flatCollect(flat_namespace_t *ns, unsigned int index){
+  compact_node_t *node;
+
+  while(index != COMPACT_NONE){
+    node = compactTreeNode(&ns->pool, index);
+    flatCollect(ns, node->child[0]);
+    ns->index[ns->count++] = index;
+    index = node->child[1];
+  }
+}
+
+/**
+ * @brief Move the locks from the tree back into the arrays, in arrival order
+ **/
+static void flatShrink(flat_namespace_t *ns){
+  unsigned int index[FLAT_SHRINK], count, i, j;
+
+  ns->count = 0;
+  flatCollect(ns, ns->pool.root);
+  count = ns->count;
+  for(i = 0; i < count; i++){
+    for(j = i; j > 0 && compactTreeNode(&ns->pool, index[j - 1])->seq > compactTreeNode(&ns->pool, ns->index[i])->seq; j--)
+      index[j] = index[j - 1];
+    index[j] = ns->index[i];
+  }
+  ns->count = 0;
+  for(i = 0; i < count; i++)
+    flatAppend(ns, index[i]);
+  ns->pool.root = COMPACT_NONE;
+  ns->tree = 0;
+}
+
+/**
+ * @brief Reset the engine for at most capacity locks held or queued per namespace
+ *
+ * Every lock must be released. Picks the widest compare the CPU runs.
+ **/
+void flatInit(unsigned int capacity){
+  flat_namespace_t *ns;
+
+#if defined(__x86_64__) && !defined(LOCK_FLAT_SCALAR)
+  flatOverlap = __builtin_cpu_supports("avx2") ? flatOverlapAvx2 : flatOverlapSse2;
+#endif
+  for(ns = flatNamespaces; ns < flatNamespaces + MAX_NAMESPACE_ID; ns++){
+    compactTreeInit(&ns->pool, capacity);
+    memset(ns->starts, 0, sizeof(ns->starts));
+    memset(ns->ends, 0, sizeof(ns->ends));
+    ns->count  = 0;
+    ns->writes = ns->queued = 0;
+    ns->tree   = 0;
+    pthread_mutex_init(&ns->mutex, NULL);
+  }
+}
+
+/**
+ * @brief Request a lock, see #lock_engine_t
+ *
+ * @param[out] handle -- a #flat_handle_t
+ **/
+enum NODE_INSERT_RESULT flatRequest(unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned int namespaceID, void *handle){
+  flat_handle_t *h = handle;
+  flat_namespace_t *ns;
+  compact_node_t *node;
+  unsigned int index;
+  int granted;
+
+  if(namespaceID >= MAX_NAMESPACE_ID || start_lba > end_lba)
+    return NODE_FAILED;
+  ns = &flatNamespaces[namespaceID];
+  pthread_mutex_lock(&ns->mutex);
+  if((index = compactTreeAlloc(&ns->pool, start_lba, end_lba, type)) == COMPACT_NONE){
+    pthread_mutex_unlock(&ns->mutex);
+    return NODE_FAILED;
+  }
+  node = compactTreeNode(&ns->pool, index);
+  if(!ns->tree && ns->count == FLAT_SLOTS)
+    flatGrow(ns);
+  if(ns->tree)
+    granted = compactTreeConflicts(&ns->pool, node, 1) == 0;
+  else
+    granted = flatConflicts(ns, node, ~0ull) == 0;
+  if(granted)
+    compactSetBits(node, node->bits | COMPACT_GRANTED);
+  if(ns->tree)
+    compactTreeInsert(&ns->pool, index);
+  else
+    flatAppend(ns, index);
+  h->node        = node;
+  h->index       = index;
+  h->namespaceID = namespaceID;
+  pthread_mutex_unlock(&ns->mutex);
+  return granted ? NODE_ADDED : NODE_QUEUED;
+}
+
+/**
+ * @brief Nonzero once the request behind the handle holds its lock
+ **/
+int flatGranted(void *handle){
+  return compactGranted(handle);
+}
+
+/**
+ * @brief Release a granted lock, granting the queued requests it was the last to hold back
+ **/
+void flatRelease(void *handle){
+  flat_handle_t *h = handle;
+  flat_namespace_t *ns = &flatNamespaces[h->namespaceID];
+  compact_node_t *node = h->node;
+  unsigned int slot;
+
+  pthread_mutex_lock(&ns->mutex);
+  if(!(node->bits & COMPACT_GRANTED)){
+    pthread_mutex_unlock(&ns->mutex);
+    return;
+  }
+  if(ns->tree){
+    compactTreeRemove(&ns->pool, h->index);
+    compactTreeRetry(&ns->pool, node->start_lba, node->end_lba);
+    compactTreeFree(&ns->pool, h->index);
+    if(ns->pool.count <= FLAT_SHRINK)
+      flatShrink(ns);
+  }
+  else{
+    for(slot = 0; ns->index[slot] != h->index; slot++)
+      continue;
+    flatRemove(ns, slot);
+    flatRetry(ns, node->start_lba, node->end_lba);
+    compactTreeFree(&ns->pool, h->index);
+  }
+  pthread_mutex_unlock(&ns->mutex);
+}
+
+/**
+ * @brief Count the older requests a queued lock waits for
+ **/
+unsigned int flatQueueLength(void *handle){
+  flat_handle_t *h = handle;
+  flat_namespace_t *ns = &flatNamespaces[h->namespaceID];
+  unsigned int length = 0, slot;
+
+  pthread_mutex_lock(&ns->mutex);
+  if(!(h->node->bits & COMPACT_GRANTED)){
+    if(ns->tree)
+      length = compactTreeConflicts(&ns->pool, h->node, ~0u);
+    else{
+      for(slot = 0; ns->index[slot] != h->index; slot++)
+	continue;
+      length = __builtin_popcountll(flatConflicts(ns, h->node, flatSlots(slot)));
+    }
+  }
+  pthread_mutex_unlock(&ns->mutex);
+  return length;
+}
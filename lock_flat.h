@@ -0,0 +1,57 @@
+#ifndef LOCK_FLAT_H
+#define LOCK_FLAT_H
+#include "lock_manager.h"
+#include "lock_compact.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+/**
+ * @file
+ * @brief Flat array range lock engine for small lock tables
+ *
+ * A namespace with a few locks keeps them, held and queued, in arrival
+ * order in two aligned arrays of start and end LBAs, so checking a request
+ * is one pass of vector compares over the whole table with no pointer to
+ * chase: eight ranges at a time with AVX2, four with SSE2, else, or when
+ * built with -DLOCK_FLAT_SCALAR, a plain loop. The result is a bitmask of
+ * the overlapping slots; masks of the writes and of the queued slots turn
+ * it into the conflicts.
+ *
+ * Past #FLAT_SLOTS locks the namespace moves them into a compact AVL tree,
+ * see lock_compact.h, and back into the arrays once no more than
+ * #FLAT_SHRINK are left. The requests are compact nodes either way, so a
+ * handle outlives the moves. As in the AVL manager a request waits for
+ * every older conflicting request, held or queued.
+ **/
+
+/**
+ * @brief Locks a namespace keeps in the arrays, one bit each in a 64-bit mask
+ **/
+#define FLAT_SLOTS 64
+
+/**
+ * @brief Locks left in the tree at which a namespace moves back to the arrays
+ *
+ * Well below #FLAT_SLOTS so a table hovering at the threshold does not move
+ * on every request.
+ **/
+#define FLAT_SHRINK 16
+
+/**
+ * @brief Handle of a flat lock
+ **/
+typedef compact_handle_t flat_handle_t;
+
+void flatInit(unsigned int capacity);
+
+enum NODE_INSERT_RESULT flatRequest(unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned int namespaceID, void *handle);
+
+int flatGranted(void *handle);
+
+void flatRelease(void *handle);
+
+unsigned int flatQueueLength(void *handle);
+#ifdef __cplusplus
+}
+#endif
+#endif//lock_flat.h
@@ -1,13 +1,19 @@
 #include"lock_manager.h"
+#include"lock_trace.h"
+#include"lock_stats.h"
+#include"lock_engine.h"
+#include"lock_skiplist.h"
+#include"lock_bptree.h"
+#include"lock_compact.h"
+#include"lock_flat.h"
 #include<stdlib.h>
 #include<stdio.h>
 #include<string.h>
 #include<time.h>
 #include<limits.h>
-extern list_head_t freeNodes;
-extern tree_node_t *rootArray[MAX_NAMESPACE_ID];
-extern next_index[MAX_NAMESPACE_ID];
-extern tree_array[MAX_NODES+1];
+#include<pthread.h>
+#include<poll.h>
+#include<sched.h>
 
 /**
  * @brief generate range lba range. Used for unit test.
@@ -24,6 +30,17 @@ void random_lba_range(int *start_lba, int *end_lba){
     }
 }
 
+/**
+ * @brief release a lock by its node, the way a caller holding its handle would.
+ **/
+void release_node(tree_node_t *node, unsigned int namespaceID){
+  lock_handle_t handle;
+  handle.node        = node;
+  handle.generation  = node->generation;
+  handle.namespaceID = namespaceID;
+  lockRelease(&handle);
+}
+
 /**
  * @brief  obtain random node.
  *
@@ -37,14 +54,7 @@ void obtain_random_node(tree_node_t *node){
     node->end_lba   = end_lba;
     node->type = rand()%2;
 
-    if(next_index[0] + 1 > MAX_NODES){     
-      memset(tree_array, 0, sizeof(tree_array));
-      obtainEventInexMarker(rootArray[0]);
-      updateIndex(rootArray[0]);
-      next_index[0] = sum(MAX_NODES);
-    }
-    next_index[0]++;
-    node->eventIndex = next_index[0];
+    node->eventIndex = ++namespaces[0].next_index;
 }
 
 /**
@@ -67,6 +77,96 @@ int test_AVL_balanced(tree_node_t *node){
   return 1;
 }
 
+/**
+ * @brief Test the subtree spans of the interval tree are maintained or not.
+ *
+ * @para[in] node -- root node of AVL tree
+ *
+ * @retval 1 -- every span is the hull of its group and children
+ * @retval 0 -- a span is stale
+ */
+int test_AVL_span(tree_node_t *node){
+  unsigned int lo, hi;
+  tree_node_t *pnode;
+
+  if(node == NULL) return 1;
+
+  lo = node->start_lba;
+  hi = node->end_lba;
+  for(pnode = (tree_node_t *) node->pendingList.next; pnode != node; pnode = (tree_node_t *) pnode->list.next){
+    /*
+     * the pending list is in arrival order and inside its cached hull
+     */
+    if(pnode->list.prev != &node->list && ((tree_node_t *) pnode->list.prev)->eventIndex > pnode->eventIndex)
+      return 0;
+    if(pnode->start_lba < node->pending_start_lba || pnode->end_lba > node->pending_end_lba ||
+       (pnode->type && !node->pending_writes))
+      return 0;
+    lo = MIN(lo, pnode->start_lba);
+    hi = MAX(hi, pnode->end_lba);
+  }
+  if(node->child[LEFT]){
+    if(node->child[LEFT]->parent != node) return 0;
+    lo = MIN(lo, node->child[LEFT]->min_start_lba);
+    hi = MAX(hi, node->child[LEFT]->max_end_lba);
+  }
+  if(node->child[RIGHT]){
+    if(node->child[RIGHT]->parent != node) return 0;
+    lo = MIN(lo, node->child[RIGHT]->min_start_lba);
+    hi = MAX(hi, node->child[RIGHT]->max_end_lba);
+  }
+  if(lo != node->min_start_lba || hi != node->max_end_lba)
+    return 0;
+
+  return test_AVL_span(node->child[LEFT]) && test_AVL_span(node->child[RIGHT]);
+}
+
+/**
+ * @brief Brute force check for a lock blocking a request
+ *
+ * @retval 1 -- some held lock, or some queued lock that arrived earlier, overlaps the range and is not a shared read
+ * @retval 0 -- the request can be granted
+ */
+int test_blocked(tree_node_t *node, tree_node_t *req){
+  tree_node_t *pnode;
+
+  if(node == NULL) return 0;
+
+  pnode = node;
+  do{
+    if(req->start_lba <= pnode->end_lba && req->end_lba >= pnode->start_lba &&
+       (pnode->type || req->type) &&
+       (pnode == node || pnode->eventIndex < req->eventIndex))
+      return 1;
+  }while((pnode = (tree_node_t *) pnode->list.next) != node);
+
+  return test_blocked(node->child[LEFT], req) || test_blocked(node->child[RIGHT], req);
+}
+
+/**
+ * @brief Check every queued lock waits on a group that blocks it
+ *
+ * @retval 1 -- each queued lock overlaps its holder, or a lock queued
+ *              before it on the same list, in a conflicting mode
+ * @retval 0 -- a queued lock waits on a group that does not block it
+ */
+int test_AVL_queues(tree_node_t *node){
+  tree_node_t *pnode, *older;
+
+  if(node == NULL) return 1;
+
+  for(pnode = (tree_node_t *) node->pendingList.next; pnode != node; pnode = (tree_node_t *) pnode->list.next){
+    int blocked = 0;
+    older = node;
+    do{
+      blocked |= pnode->start_lba <= older->end_lba && pnode->end_lba >= older->start_lba && (pnode->type || older->type);
+      older = (tree_node_t *) older->list.next;
+    }while(older != pnode && !blocked);
+    if(!blocked || pnode->state != LOCK_QUEUED)
+      return 0;
+  }
+  return test_AVL_queues(node->child[LEFT]) && test_AVL_queues(node->child[RIGHT]);
+}
 
 /**
  * @brief test insert to AVL tree 
@@ -84,22 +184,22 @@ void test_insert_AVL(){
     
     obtain_random_node(node);
     
-    printf("inserting [%d -- %d] R(%d) eventIndex %d \n", 
+    printf("inserting [%d -- %d] R(%d) eventIndex %llu \n", 
 	   node->start_lba, 
 	   node->end_lba, 
 	   node->type, 
 	   node->eventIndex);
    
-    insertNode(&rootArray[0], node, 1);
+    insertNode(&namespaces[0].root, node, 1);
   
     printf("AVL tree propety maintained? ");
-    if(test_AVL_balanced(rootArray[0]) == 1)
+    if(test_AVL_balanced(namespaces[0].root) == 1)
       printf("Y\n");
     else
       printf("N\n");
     printf("\n");
   }
-  treeDump(rootArray[0]); 
+  treeDump(namespaces[0].root); 
 }
 
 
@@ -108,20 +208,20 @@ void test_delete_AVL(){
   
   for(i = 0; i < MAX_NODES; i++){
     printf("delete case %d\n", i);
-    int index = rand()%MAX_NODES;
+    tree_node_t *node = lockNodeAt(rand()%MAX_NODES);
    
-    if(isInAVL(rootArray[0], &nodes[index])){
+    if(node && isInAVL(namespaces[0].root, node)){
       /*found nodes and then to delete it*/
-       printf("delete  event index %d\n", nodes[index].eventIndex);
-      removeNode(&rootArray[0], &nodes[index]);
+       printf("delete  event index %llu\n", node->eventIndex);
+      removeNode(&namespaces[0].root, node);
 
      /*
       * check if this node has pending locks associated with it.
       * And if so, try to add each one to the tree
       */
-      tree_node_t *pendingNode  = (tree_node_t *)  (nodes[index].pendingList.next);
-      while(pendingNode != &nodes[index]){
-	printf("insert node with index %2d\n", pendingNode->eventIndex);
+      tree_node_t *pendingNode  = (tree_node_t *)  (node->pendingList.next);
+      while(pendingNode != node){
+	printf("insert node with index %2llu\n", pendingNode->eventIndex);
 	tree_node_t *nextNode = (tree_node_t *)  (pendingNode->pendingList.next); 
 
 	pendingNode->child[0] = NULL;
@@ -134,16 +234,16 @@ void test_delete_AVL(){
 	pendingNode->pendingList.prev = 
 	&pendingNode->pendingList;
     
-	insertNode(&rootArray[0], pendingNode, 1);
+	insertNode(&namespaces[0].root, pendingNode, 1);
     
 	pendingNode = nextNode;
       }
   
       /*Add the removed node back to the free list*/
-      freeNode(&nodes[index]);
+      freeNode(node);
       
       printf("AVL tree propety maintained? ");
-      if(test_AVL_balanced(rootArray[0]) == 1)
+      if(test_AVL_balanced(namespaces[0].root) == 1)
 	printf("Y\n");
       else
 	printf("N\n");
@@ -220,32 +320,32 @@ void test_case1(){
   /*insert all events, it should be a linked list
    * event 1 R[1-40] -->event 2 W[1-10] -->event 3 W[8-20] -->event 4 W[21-30] -->event 5 W[31-40] -->event 6 R[1-40]
    */
-  insertNode(&rootArray[0], n1, 1);
-  insertNode(&rootArray[0], n2, 1);
-  insertNode(&rootArray[0], n3, 1);
-  insertNode(&rootArray[0], n4, 1);
-  insertNode(&rootArray[0], n5, 1);
-  insertNode(&rootArray[0], n6, 1);
+  insertNode(&namespaces[0].root, n1, 1);
+  insertNode(&namespaces[0].root, n2, 1);
+  insertNode(&namespaces[0].root, n3, 1);
+  insertNode(&namespaces[0].root, n4, 1);
+  insertNode(&namespaces[0].root, n5, 1);
+  insertNode(&namespaces[0].root, n6, 1);
 
-  treeDump(rootArray[0]);
+  treeDump(namespaces[0].root);
 
   printf("remove n1\n");
-  lockRelease(n1, 0);
+  release_node(n1, 0);
  /*
   * the avl tree should be:
   *            event 4 --> event 6
   *                 / \
   *event 3 <- event 2 event 5
   */
-  treeDump(rootArray[0]);
+  treeDump(namespaces[0].root);
 
   /**
    * delete event 6, and it should be rejected.
    */
   printf("----\n\n");
   printf("remove n6\n");
-  lockRelease(n6, 0);
-  treeDump(rootArray[0]);
+  release_node(n6, 0);
+  treeDump(namespaces[0].root);
   /*
    * delete event 2, and the AVL tree should be like this
    * 
@@ -255,8 +355,8 @@ void test_case1(){
    */
   printf("---\n\n");
   printf("remove n2\n");
-  lockRelease(n2, 0);
-  treeDump(rootArray[0]);
+  release_node(n2, 0);
+  treeDump(namespaces[0].root);
   
   /*
    * delete event 4, and the AVL tree should be like this
@@ -267,8 +367,8 @@ void test_case1(){
    */
   printf("--\n\n");
   printf("remove n4\n");
-  lockRelease(n4, 0);
-  treeDump(rootArray[0]);
+  release_node(n4, 0);
+  treeDump(namespaces[0].root);
   
   /*
    * delete event 5, and the AVL tree should be like this
@@ -278,8 +378,8 @@ void test_case1(){
    */
   printf("---\n\n");
   printf("remove n5\n");
-  lockRelease(n5, 0);
-  treeDump(rootArray[0]);
+  release_node(n5, 0);
+  treeDump(namespaces[0].root);
   
   /*
    * delete event 3, and the AVL tree should be like this.
@@ -288,8 +388,8 @@ void test_case1(){
    */
   printf("--\n\n");
   printf("remove n3\n");
-  lockRelease(n3, 0);
-  treeDump(rootArray[0]);
+  release_node(n3, 0);
+  treeDump(namespaces[0].root);
 }
 
 /*
@@ -311,7 +411,7 @@ void random_test1(){
       unsigned start_lba = i*5;
       unsigned end_lba   = start_lba + 4;
       unsigned type      = rand()%2;
-      lockRequest(start_lba, end_lba, type, 1, 0);
+      lockRequest(start_lba, end_lba, type, 1, 0, NULL);
     }
 
     /*
@@ -321,21 +421,21 @@ void random_test1(){
       unsigned start_lba = i + 1;
       unsigned end_lba   = start_lba + rand()%10;
       unsigned type      = rand()%2;
-      lockRequest(start_lba, end_lba, type, 1, 0);
+      lockRequest(start_lba, end_lba, type, 1, 0, NULL);
     }
   
-    // treeDump(rootArray[0]);
+    // treeDump(namespaces[0].root);
 
     /*
      * to check the lock release
      */
     for(i = 0; i < MAX_NODES; i++){
       printf("\n\ndeleting case %d with ", i+ 1);
-      int index = (MAX_NODES - i - 1);
-      printf("event index %d\n", nodes[index].eventIndex);
-      lockRelease(&nodes[index], 0);
+      tree_node_t *node = lockNodeAt(MAX_NODES - i - 1);
+      printf("event index %llu\n", node->eventIndex);
+      release_node(node, 0);
     }
-      treeDump(rootArray[0]);
+      treeDump(namespaces[0].root);
       printf("\n");
   }
 }
@@ -356,21 +456,21 @@ void random_test2(){
       unsigned start_lba = i*5;
       unsigned end_lba   = start_lba + 4;
       unsigned type      = rand()%2;
-      lockRequest(start_lba, end_lba, type, 1, 0);
+      lockRequest(start_lba, end_lba, type, 1, 0, NULL);
     }
   
-    //treeDump(rootArray[0]);
+    //treeDump(namespaces[0].root);
 
     /*
      *to check the unlock
      */
     for(i = 0; i < MAX_NODES -2; i++){
       printf("\n\ndeleting case %d with", i+ 1);
-      int index = (MAX_NODES - i - 1);
-      printf("  event index %d\n", nodes[index].eventIndex);
-      lockRelease(&nodes[index], 0);
+      tree_node_t *node = lockNodeAt(MAX_NODES - i - 1);
+      printf("  event index %llu\n", node->eventIndex);
+      release_node(node, 0);
     }
-     treeDump(rootArray[0]);
+     treeDump(namespaces[0].root);
 
     /*
      *to check the index overflow
@@ -379,13 +479,1536 @@ void random_test2(){
       unsigned start_lba = i*5;
       unsigned end_lba   = start_lba + 4;
       unsigned type      = rand()%2;
-      lockRequest(start_lba, end_lba, type, 1, 0);
-      treeDump(rootArray[0]);
+      lockRequest(start_lba, end_lba, type, 1, 0, NULL);
+      treeDump(namespaces[0].root);
     }
     printf("\n");
   }
 }
 
+/**
+ * @brief: overlapping reads share the range, a writer waits for all of them
+ * and readers arriving behind a queued writer do not overtake it.
+ */
+void test_shared_reads(){
+  lock_handle_t r1, r2, w3, r4;
+  int ok = 1;
+
+  treeInit();
+  ok &= lockRequest(1, 10, 0, 1, 0, &r1) == NODE_ADDED;
+  ok &= lockRequest(5, 15, 0, 1, 0, &r2) == NODE_ADDED;
+  ok &= lockRequest(8,  9, 1, 1, 0, &w3) == NODE_QUEUED;
+  ok &= lockRequest(9, 12, 0, 1, 0, &r4) == NODE_QUEUED;
+
+  lockRelease(&r1);
+  ok &= w3.node->state == LOCK_QUEUED;
+  lockRelease(&r2);
+  ok &= w3.node->state == LOCK_GRANTED && r4.node->state == LOCK_QUEUED;
+  lockRelease(&w3);
+  ok &= r4.node->state == LOCK_GRANTED;
+  lockRelease(&r4);
+  ok &= namespaces[0].root == NULL;
+
+  /*
+   * a released handle is stale, its node is back in the arena
+   */
+  lockRelease(&r4);
+  ok &= r4.node->state == LOCK_FREE;
+
+  printf("shared read locks granted in order? %s\n", ok ? "Y" : "N");
+}
+
+/**
+ * @brief: releasing a writer grants every waiter nothing else blocks, in
+ * one pass, and leaves the rest queued behind their new blockers.
+ */
+void test_release_batch(){
+  lock_handle_t w, r1, r2, w3, r4, w5, w6, r7, other;
+  int ok = 1;
+
+  treeInit();
+  ok &= lockRequest(  0,  99, 1, 1, 0, &w)  == NODE_ADDED;
+  ok &= lockRequest(200, 209, 1, 1, 0, &other) == NODE_ADDED;
+  ok &= lockRequest(  0,   9, 0, 1, 0, &r1) == NODE_QUEUED;
+  ok &= lockRequest( 10,  19, 0, 1, 0, &r2) == NODE_QUEUED;
+  ok &= lockRequest(  5,  15, 1, 1, 0, &w3) == NODE_QUEUED;
+  ok &= lockRequest( 50,  60, 0, 1, 0, &r4) == NODE_QUEUED;
+  ok &= lockRequest( 90,  99, 1, 1, 0, &w5) == NODE_QUEUED;
+  ok &= lockRequest( 90, 205, 1, 1, 0, &w6) == NODE_QUEUED;
+  ok &= lockRequest( 12,  13, 0, 1, 0, &r7) == NODE_QUEUED;
+
+  lockRelease(&w);
+  ok &= r1.node->state == LOCK_GRANTED && r2.node->state == LOCK_GRANTED && r4.node->state == LOCK_GRANTED;
+  ok &= w5.node->state == LOCK_GRANTED;
+  ok &= w3.node->state == LOCK_QUEUED && w6.node->state == LOCK_QUEUED && r7.node->state == LOCK_QUEUED;
+  ok &= test_AVL_balanced(namespaces[0].root) && test_AVL_span(namespaces[0].root) && test_AVL_queues(namespaces[0].root);
+
+  lockRelease(&r1);
+  ok &= w3.node->state == LOCK_QUEUED;
+  lockRelease(&r2);
+  ok &= w3.node->state == LOCK_GRANTED && r7.node->state == LOCK_QUEUED;
+  lockRelease(&w3);
+  ok &= r7.node->state == LOCK_GRANTED;
+  lockRelease(&w5);
+  ok &= w6.node->state == LOCK_QUEUED;
+  lockRelease(&other);
+  ok &= w6.node->state == LOCK_GRANTED;
+  lockRelease(&r4);
+  lockRelease(&w6);
+  lockRelease(&r7);
+  ok &= namespaces[0].root == NULL;
+
+  printf("waiters granted in one pass on release? %s\n", ok ? "Y" : "N");
+}
+
+/**
+ * @brief: a batch merges its ranges, locks all or nothing without queueing,
+ * and two batches taking the same namespaces in opposite orders are granted
+ * one after the other instead of deadlocking.
+ */
+void test_lock_batch(){
+  lock_range_t merge[] = { { 9, 10, 19, 0 }, { 9, 0, 9, 0 }, { 9, 15, 30, 1 }, { 9, 100, 109, 0 } };
+  lock_range_t probe[] = { { 9, 150, 160, 1 }, { 9, 205, 206, 0 } };
+  lock_range_t copyA[] = { { 10, 0, 9, 1 }, { 11, 0, 9, 1 } };
+  lock_range_t copyB[] = { { 11, 0, 9, 1 }, { 10, 0, 9, 1 } };
+  lock_batch_t batch, a, b;
+  lock_handle_t held;
+  int ok = 1;
+
+  treeInit();
+  ok &= lockRequestBatch(merge, 4, 1, &batch) == NODE_ADDED && batch.count == 2;
+  ok &= batch.handle[0].node->start_lba == 0 && batch.handle[0].node->end_lba == 30 && batch.handle[0].node->type == 1;
+  ok &= batch.handle[1].node->start_lba == 100 && batch.handle[1].node->type == 0;
+  ok &= batch.handle[0].node->eventIndex == batch.handle[1].node->eventIndex;
+  lockReleaseBatch(&batch);
+  ok &= namespaces[9].root == NULL;
+
+  lockRequest(200, 209, 1, 1, 9, &held);
+  ok &= lockRequestBatch(probe, 2, 0, &batch) == NODE_COLLISION;
+  ok &= lockRequest(150, 160, 1, 0, 9, NULL) == NODE_ADDED;
+  ok &= lockRequestBatch(probe, 2, 0, &batch) == NODE_COLLISION;
+  lockRelease(&held);
+
+  lockRequest(5, 5, 1, 1, 11, &held);
+  ok &= lockRequestBatch(copyA, 2, 1, &a) == NODE_QUEUED && !lockBatchGranted(&a);
+  ok &= lockRequestBatch(copyB, 2, 1, &b) == NODE_QUEUED && !lockBatchGranted(&b);
+  lockReleaseBatch(&a);
+  ok &= !lockBatchGranted(&a);
+  lockRelease(&held);
+  ok &= lockBatchGranted(&a) && !lockBatchGranted(&b);
+  lockReleaseBatch(&a);
+  ok &= lockBatchGranted(&b);
+  lockReleaseBatch(&b);
+  ok &= namespaces[10].root == NULL && namespaces[11].root == NULL;
+
+  printf("lock batches granted all or nothing without deadlock? %s\n", ok ? "Y" : "N");
+}
+
+/**
+ * @brief: requests queued across the 32 bit boundary of the event index
+ * are still granted in arrival order.
+ */
+void test_event_order(){
+  lock_handle_t w1, w2, r3, w4;
+  int ok = 1;
+
+  treeInit();
+  namespaces[0].next_index = UINT_MAX - 2;
+  ok &= lockRequest(0, 9, 1, 1, 0, &w1) == NODE_ADDED;
+  ok &= lockRequest(0, 9, 1, 1, 0, &w2) == NODE_QUEUED;
+  ok &= lockRequest(5, 6, 0, 1, 0, &r3) == NODE_QUEUED;
+  ok &= lockRequest(6, 8, 1, 1, 0, &w4) == NODE_QUEUED;
+  ok &= w2.node->eventIndex == UINT_MAX && r3.node->eventIndex == UINT_MAX + 1ull;
+
+  lockRelease(&w1);
+  ok &= w2.node->state == LOCK_GRANTED && r3.node->state == LOCK_QUEUED;
+  lockRelease(&w2);
+  ok &= r3.node->state == LOCK_GRANTED && w4.node->state == LOCK_QUEUED;
+  lockRelease(&r3);
+  ok &= w4.node->state == LOCK_GRANTED;
+  lockRelease(&w4);
+  ok &= namespaces[0].root == NULL;
+
+  printf("event order kept past 32 bit indices? %s\n", ok ? "Y" : "N");
+}
+
+/**
+ * @brief: a handle stays valid across other locks coming and going and goes
+ * stale once released, even after its node is handed out again.
+ */
+void test_lock_handles(){
+  lock_handle_t a, b, c;
+  int ok = 1;
+
+  treeInit();
+  ok &= lockRequest(0, 7, 1, 1, 3, &a) == NODE_ADDED;
+  ok &= lockRequest(4, 9, 1, 1, 3, &b) == NODE_QUEUED;
+  lockRelease(&b);
+  ok &= b.node->state == LOCK_QUEUED;
+  lockRelease(&a);
+  ok &= b.node->state == LOCK_GRANTED && a.node->state == LOCK_FREE;
+
+  /*
+   * the freed node comes straight back from the thread's magazine
+   */
+  ok &= lockRequest(20, 29, 0, 1, 3, &c) == NODE_ADDED && c.node == a.node;
+  lockRelease(&a);
+  ok &= c.node->state == LOCK_GRANTED;
+
+  /*
+   * a handle copied to another namespace is refused, and a node kept by
+   * lockReleaseNode is stale after its first release
+   */
+  a = c;
+  a.namespaceID = 4;
+  lockRelease(&a);
+  ok &= c.node->state == LOCK_GRANTED && isInAVL(namespaces[3].root, c.node);
+  ok &= lockRequestNode(allocNodes(), 40, 49, 1, 3, NULL, &a) == NODE_ADDED;
+  lockReleaseNode(&a);
+  ok &= a.node->state == LOCK_FREE;
+  lockReleaseNode(&a);
+  ok &= a.node->state == LOCK_FREE && isInAVL(namespaces[3].root, c.node) && isInAVL(namespaces[3].root, b.node);
+  freeNode(a.node);
+  lockRelease(&c);
+  lockRelease(&b);
+  ok &= namespaces[3].root == NULL;
+
+  printf("lock handles validated? %s\n", ok ? "Y" : "N");
+}
+
+/**
+ * @brief: time lock and unlock of overlapping ranges, all reads against all
+ * writes. Reads are granted together while writes queue one behind another.
+ */
+void bench_shared_reads(){
+  lock_handle_t locks[MAX_NODES];
+  struct timespec t0, t1;
+  int i, type, granted;
+  double secs;
+
+  for(type = 0; type < 2; type++){
+    treeInit();
+    granted = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(i = 0; i < MAX_NODES; i++)
+      granted += lockRequest(i % 16, i % 16 + 64, type, 1, 0, &locks[i]) == NODE_ADDED;
+    for(i = 0; i < MAX_NODES; i++)
+      lockRelease(&locks[i]);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    fprintf(stderr, "%s: %d of %d overlapping locks granted at once, %.0f lock+unlock/s\n",
+	    type ? "write" : "read", granted, MAX_NODES, MAX_NODES / secs);
+  }
+}
+
+/**
+ * @brief: time a deep queue of writers building up behind one hot range,
+ * every request appends to the same pending list.
+ */
+void bench_deep_queue(){
+  enum { DEPTH = 4000 };
+  lock_handle_t *locks = malloc(sizeof(lock_handle_t) * DEPTH);
+  struct timespec t0, t1;
+  int i, queued = 0;
+  double secs;
+
+  treeInitCapacity(DEPTH + 64);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for(i = 0; i < DEPTH; i++)
+    queued += lockRequest(i % 8, i % 8 + 8, 1, 1, 0, &locks[i]) == NODE_QUEUED;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  for(i = 0; i < DEPTH; i++)
+    lockRelease(&locks[i]);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  fprintf(stderr, "%d writers queued behind one range: %.0f ns per request, %.0f ns per release\n", queued,
+	  secs * 1e9 / DEPTH, ((t0.tv_sec - t1.tv_sec) * 1e9 + (t0.tv_nsec - t1.tv_nsec)) / DEPTH);
+  free(locks);
+}
+
+/**
+ * @brief: time the release of a writer covering a thousand waiters spread
+ * over its range, most of them granted by the release.
+ */
+void bench_release_herd(){
+  enum { HELD = 200, WAITERS = 1000, ROUNDS = 100 };
+  lock_handle_t *held = malloc(sizeof(lock_handle_t) * (HELD + WAITERS)), *waiters = held + HELD, big;
+  struct timespec t0, t1;
+  double nanos = 0;
+  int i, r;
+
+  treeInitCapacity(HELD + WAITERS + 64);
+  for(i = 0; i < HELD; i++)
+    lockRequest(2000000 + i * 100, 2000000 + i * 100 + 9, 1, 1, 0, &held[i]);
+  for(r = 0; r < ROUNDS; r++){
+    lockRequest(0, 999999, 1, 1, 0, &big);
+    for(i = 0; i < WAITERS; i++)
+      lockRequest(i * 7919 % 100000 * 10, i * 7919 % 100000 * 10 + 7, i % 4 == 0, 1, 0, &waiters[i]);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    lockRelease(&big);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    nanos += (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+    for(i = 0; i < WAITERS; i++)
+      lockRelease(&waiters[i]);
+  }
+  for(i = 0; i < HELD; i++)
+    lockRelease(&held[i]);
+  fprintf(stderr, "release of a writer with %d waiters: %.0f ns\n", WAITERS, nanos / ROUNDS);
+  free(held);
+}
+
+/**
+ * @brief: time vectors of 16 extents locked one call per extent against
+ * one batch per vector.
+ */
+void bench_lock_batch(){
+  enum { EXTENTS = 16, VECTORS = 20000 };
+  lock_range_t ranges[EXTENTS];
+  lock_handle_t handles[EXTENTS];
+  lock_batch_t batch;
+  struct timespec t0, t1;
+  double secs[2];
+  int v, i, mode;
+
+  for(mode = 0; mode < 2; mode++){
+    treeInitCapacity(4096);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(v = 0; v < VECTORS; v++){
+      for(i = 0; i < EXTENTS; i++){
+	ranges[i].namespaceID = 0;
+	ranges[i].start_lba   = (v * 7919 + i * 104729) % 1000000 * 8;
+	ranges[i].end_lba     = ranges[i].start_lba + 7;
+	ranges[i].type        = v & 1;
+      }
+      if(mode){
+	lockRequestBatch(ranges, EXTENTS, 1, &batch);
+	lockReleaseBatch(&batch);
+      }
+      else{
+	for(i = 0; i < EXTENTS; i++)
+	  lockRequest(ranges[i].start_lba, ranges[i].end_lba, ranges[i].type, 1, 0, &handles[i]);
+	for(i = 0; i < EXTENTS; i++)
+	  lockRelease(&handles[i]);
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs[mode] = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  }
+  fprintf(stderr, "%d extent vectors: %.0f/s one call per extent, %.0f/s batched\n",
+	  EXTENTS, VECTORS / secs[0], VECTORS / secs[1]);
+}
+
+static int compare_latency(const void *a, const void *b){
+  unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief: time every request while most of the default capacity is held,
+ * the tail shows any pause on the submit path such as a walk of the tree.
+ */
+void bench_request_latency(){
+  enum { HELD = MAX_NODES - 16, REQUESTS = 100000 };
+  lock_handle_t held[HELD], h;
+  unsigned int *lat = malloc(sizeof(unsigned int) * REQUESTS);
+  struct timespec t0, t1;
+  int i;
+
+  treeInit();
+  for(i = 0; i < HELD; i++)
+    lockRequest(i * 100, i * 100 + 9, 1, 1, 0, &held[i]);
+  for(i = 0; i < REQUESTS; i++){
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    lockRequest(HELD * 100 + i % 1000, HELD * 100 + i % 1000 + 7, 1, 1, 0, &h);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    lockRelease(&h);
+    lat[i] = (t1.tv_sec - t0.tv_sec) * 1000000000u + (t1.tv_nsec - t0.tv_nsec);
+  }
+  for(i = 0; i < HELD; i++)
+    lockRelease(&held[i]);
+  qsort(lat, REQUESTS, sizeof(unsigned int), compare_latency);
+  fprintf(stderr, "request with %d locks held: p50 %u ns, p999 %u ns, max %u ns\n",
+	  HELD, lat[REQUESTS / 2], lat[REQUESTS * 999 / 1000], lat[REQUESTS - 1]);
+  free(lat);
+}
+
+/**
+ * @brief: random test 3, the interval tree finds every collision, including
+ * locks held or queued off the insertion path, and keeps its spans across
+ * insertions, removals and rotations.
+ */
+void random_test3(){
+  int i, j, errors = 0;
+
+  treeInit();
+  for(i = 0; i < 20 * MAX_NODES; i++){
+    if(rand()%3){
+      int start_lba, end_lba;
+      random_lba_range(&start_lba, &end_lba);
+      lockRequest(start_lba, end_lba, rand()%2, 1, 0, NULL);
+    }
+    else{
+      tree_node_t *node = lockNodeAt(rand()%MAX_NODES);
+      if(node && isInAVL(namespaces[0].root, node))
+	release_node(node, 0);
+    }
+
+    /*
+     * probe a few ranges without queueing, a probe may only be granted if
+     * nothing overlaps it
+     */
+    for(j = 0; j < 4; j++){
+      tree_node_t *probe = allocNodes();
+      int start_lba, end_lba, overlap;
+      if(probe == NULL) break;
+
+      random_lba_range(&start_lba, &end_lba);
+      probe->start_lba  = start_lba;
+      probe->end_lba    = end_lba;
+      probe->type       = rand()%2;
+      probe->eventIndex = ULLONG_MAX;
+      overlap = test_blocked(namespaces[0].root, probe);
+      if(insertNode(&namespaces[0].root, probe, 0) == NODE_ADDED){
+	if(overlap) errors++;
+	removeNode(&namespaces[0].root, probe);
+      }
+      else if(!overlap)
+	errors++;
+      freeNode(probe);
+    }
+
+    if(!test_AVL_balanced(namespaces[0].root) || !test_AVL_span(namespaces[0].root) ||
+       !test_AVL_queues(namespaces[0].root))
+      errors++;
+  }
+  printf("interval tree property maintained? %s\n", errors ? "N" : "Y");
+}
+
+/**
+ * @brief per thread arguments of #test_namespace_worker
+ */
+typedef struct{
+  unsigned int namespaceID;
+  unsigned int failures;
+}test_worker_t;
+
+#define TEST_WORKER_OPS    20000
+#define TEST_WORKER_WINDOW 8
+
+/**
+ * @brief keep a window of write locks outstanding on one namespace,
+ * releasing the oldest one before requesting the next.
+ */
+void *test_namespace_worker(void *arg){
+  test_worker_t *worker = arg;
+  lock_handle_t window[TEST_WORKER_WINDOW];
+  int i;
+
+  memset(window, 0, sizeof(window));
+  for(i = 0; i < TEST_WORKER_OPS; i++){
+    lock_handle_t *slot = &window[i % TEST_WORKER_WINDOW];
+    if(slot->node)
+      lockRelease(slot);
+    if(lockRequest(i*8, i*8 + 7, 1, 1, worker->namespaceID, slot) != NODE_ADDED){
+      worker->failures++;
+      slot->node = NULL;
+    }
+  }
+  for(i = 0; i < TEST_WORKER_WINDOW; i++)
+    if(window[i].node)
+      lockRelease(&window[i]);
+  return NULL;
+}
+
+/**
+ * @brief: a thread that exits hands its cached nodes back, so a capacity
+ * can be used up by threads one after another, and the arena can grow past
+ * the compile time default.
+ */
+void *test_alloc_worker(void *arg){
+  tree_node_t *node;
+  unsigned int *count = arg;
+  while(*count < nodeCapacity/2 && (node = allocNodes()) != NULL){
+    (*count)++;
+    freeNode(node);
+    if(rand()%4 == 0)
+      break;
+  }
+  return NULL;
+}
+
+void test_node_arena(){
+  tree_node_t **all;
+  pthread_t thread;
+  unsigned int i, count = 0, ok = 1;
+
+  treeInitCapacity(10 * MAX_NODES);
+  for(i = 0; i < 64; i++){
+    pthread_create(&thread, NULL, test_alloc_worker, &count);
+    pthread_join(thread, NULL);
+  }
+
+  /*
+   * every node of the capacity can still be allocated from this thread
+   */
+  all = calloc(nodeCapacity, sizeof(tree_node_t *));
+  for(i = 0; i < nodeCapacity; i++)
+    ok &= (all[i] = allocNodes()) != NULL;
+  ok &= allocNodes() == NULL;
+  for(i = 0; i < nodeCapacity; i++)
+    if(all[i])
+      freeNode(all[i]);
+  free(all);
+
+  printf("node arena capacity %u usable across threads? %s\n", nodeCapacity, ok ? "Y" : "N");
+}
+
+/**
+ * @brief: threads locking their own namespaces never wait on each other's
+ * namespace mutex and each namespace ends up empty.
+ */
+void test_namespace_threads(){
+  pthread_t threads[MAX_NAMESPACE_ID];
+  test_worker_t workers[MAX_NAMESPACE_ID];
+  struct timespec t0, t1;
+  unsigned long contended = 0;
+  unsigned int i, nthreads, failures = 0, empty = 1;
+
+  for(nthreads = 1; nthreads <= MAX_NAMESPACE_ID; nthreads *= 2){
+    treeInitCapacity(4096);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(i = 0; i < nthreads; i++){
+      workers[i].namespaceID = i;
+      workers[i].failures    = 0;
+      pthread_create(&threads[i], NULL, test_namespace_worker, &workers[i]);
+    }
+    for(i = 0; i < nthreads; i++){
+      pthread_join(threads[i], NULL);
+      failures  += workers[i].failures;
+      contended += namespaces[i].contended;
+      empty     &= namespaces[i].root == NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    fprintf(stderr, "%2u threads on %2u namespaces: %.0f lock+unlock/s\n", nthreads, nthreads,
+	    nthreads * TEST_WORKER_OPS / ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9));
+  }
+  printf("namespaces locked without contention? %s\n", (!failures && !contended && empty) ? "Y" : "N");
+}
+
+#define TEST_RANGE_OPS 20000
+
+/**
+ * @brief Threads taking the same write range with #lockRange
+ */
+typedef struct test_range_s{
+  unsigned int ops;
+  unsigned int inside;
+  unsigned long count;
+  unsigned int overlaps;
+}test_range_t;
+
+void *test_range_worker(void *arg){
+  test_range_t *shared = arg;
+  lock_handle_t handle;
+  unsigned int i;
+
+  for(i = 0; i < shared->ops; i++){
+    if(lockRange(0, 15, 1, 3, &handle) != NODE_ADDED){
+      __atomic_add_fetch(&shared->overlaps, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+    if(__atomic_add_fetch(&shared->inside, 1, __ATOMIC_RELAXED) != 1)
+      shared->overlaps++;
+    shared->count++;
+    __atomic_sub_fetch(&shared->inside, 1, __ATOMIC_RELAXED);
+    lockRelease(&handle);
+  }
+  return NULL;
+}
+
+/**
+ * @brief: lockRange returns only once the lock is held, a waiter that
+ * sleeps is woken by the release, and writers contending on one range
+ * never overlap.
+ */
+void test_lock_range(){
+  test_range_t shared = { 1, 0, 0, 0 };
+  pthread_t threads[8];
+  lock_handle_t held;
+  lock_stats_t stats;
+  struct timespec pause = { 0, 20000000 };
+  unsigned int i;
+  int ok = 1;
+
+  treeInitCapacity(1024);
+  lockStatsReset();
+  ok &= lockRange(0, 99, 1, 3, &held) == NODE_ADDED;
+  pthread_create(&threads[0], NULL, test_range_worker, &shared);
+  nanosleep(&pause, NULL);
+  ok &= shared.count == 0;
+  lockRelease(&held);
+  pthread_join(threads[0], NULL);
+  ok &= shared.count == 1;
+  lockStatsSnapshot(3, &stats);
+#if LOCK_STATS
+  ok &= stats.parks == 1;
+#endif
+
+  shared.ops = TEST_RANGE_OPS / 8;
+  for(i = 0; i < 8; i++)
+    pthread_create(&threads[i], NULL, test_range_worker, &shared);
+  for(i = 0; i < 8; i++)
+    pthread_join(threads[i], NULL);
+  ok &= shared.overlaps == 0 && shared.count == 1 + TEST_RANGE_OPS && namespaces[3].root == NULL;
+  printf("blocking lockRange hands the lock over? %s\n", ok ? "Y" : "N");
+}
+
+/**
+ * @brief: hand-off rate of one write range between threads blocked in lockRange
+ */
+void bench_lock_range(){
+  test_range_t shared = { TEST_RANGE_OPS, 0, 0, 0 };
+  pthread_t threads[8];
+  struct timespec t0, t1;
+  lock_stats_t stats;
+  unsigned int i, nthreads;
+
+  for(nthreads = 2; nthreads <= 8; nthreads *= 2){
+    treeInitCapacity(1024);
+    lockStatsReset();
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(i = 0; i < nthreads; i++)
+      pthread_create(&threads[i], NULL, test_range_worker, &shared);
+    for(i = 0; i < nthreads; i++)
+      pthread_join(threads[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    lockStatsSnapshot(3, &stats);
+    fprintf(stderr, "%u threads on one range: %.0f lockRange+release/s, %.1f%% queued, %.1f%% of those slept\n", nthreads,
+	    nthreads * TEST_RANGE_OPS / ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9),
+	    100.0 * stats.queued / (stats.requests ? stats.requests : 1), 100.0 * stats.parks / (stats.queued ? stats.queued : 1));
+  }
+}
+
+/**
+ * @brief: true if the completion queue eventfd is readable
+ */
+static int cq_signalled(lock_cq_t *cq){
+  struct pollfd pfd = { cq->fd, POLLIN, 0 };
+  return poll(&pfd, 1, 0) == 1;
+}
+
+/**
+ * @brief: queued asynchronous requests post their cookies when a release
+ * grants them, with one eventfd signal for the batch, and a full queue
+ * refuses further requests.
+ */
+void test_lock_cq(){
+  lock_cq_t *cq = lockCqCreate(8);
+  lock_handle_t held, free_range, queued[11];
+  unsigned long long cookies[16];
+  unsigned int i, n;
+  int ok = cq != NULL;
+
+  treeInitCapacity(1024);
+  lockRequest(0, 99, 1, 1, 4, &held);
+  for(i = 0; i < 3; i++)
+    ok &= lockRequestAsync(i * 10, i * 10 + 5, 0, 4, cq, 100 + i, &queued[i]) == NODE_QUEUED;
+  ok &= lockRequestAsync(200, 299, 1, 4, cq, 99, &free_range) == NODE_ADDED;
+  ok &= !cq_signalled(cq) && lockCqDrain(cq, cookies, 16) == 0;
+
+  lockRelease(&held);
+  ok &= cq_signalled(cq);
+  n = lockCqDrain(cq, cookies, 16);
+  ok &= n == 3 && cookies[0] == 100 && cookies[1] == 101 && cookies[2] == 102;
+  ok &= !cq_signalled(cq);
+  for(i = 0; i < 3; i++)
+    lockRelease(&queued[i]);
+
+  /*
+   * a drain returning max leaves the rest on the queue
+   */
+  ok &= lockRequest(0, 99, 1, 1, 4, &held) == NODE_ADDED;
+  for(i = 3; i < 11; i++)
+    ok &= lockRequestAsync(i * 5, i * 5 + 2, 0, 4, cq, 100 + i, &queued[i]) == NODE_QUEUED;
+  ok &= lockRequestAsync(90, 95, 0, 4, cq, 0, NULL) == NODE_FAILED;
+  lockRelease(&held);
+  ok &= lockCqDrain(cq, cookies, 2) == 2 && cookies[0] == 103 && cookies[1] == 104;
+  ok &= lockCqDrain(cq, cookies, 16) == 6 && cookies[0] == 105 && cookies[5] == 110;
+  ok &= !cq_signalled(cq);
+
+  for(i = 3; i < 11; i++)
+    lockRelease(&queued[i]);
+  lockRelease(&free_range);
+  lockCqDestroy(cq);
+  printf("asynchronous grants posted to the completion queue? %s\n", ok ? "Y" : "N");
+}
+
+#define BENCH_CQ_OUTSTANDING 4096
+#define BENCH_CQ_OPS         400000
+
+/**
+ * @brief: one thread keeps thousands of asynchronous range locks
+ * outstanding, completing the oldest granted one and draining the grants
+ * it frees up whenever the eventfd turns readable.
+ */
+void bench_lock_cq(){
+  lock_cq_t *cq = lockCqCreate(BENCH_CQ_OUTSTANDING);
+  lock_handle_t *handle = calloc(BENCH_CQ_OUTSTANDING, sizeof(lock_handle_t));
+  unsigned int *granted = calloc(BENCH_CQ_OUTSTANDING, sizeof(unsigned int));
+  unsigned long long cookies[256];
+  unsigned int head = 0, tail = 0, i, n, slot, start_lba;
+  unsigned long ops, wakeups = 0, posted = 0;
+  struct timespec t0, t1;
+
+  treeInitCapacity(2 * BENCH_CQ_OUTSTANDING);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for(ops = 0; ops < BENCH_CQ_OPS; ops++){
+    if(ops >= BENCH_CQ_OUTSTANDING){
+      /*
+       * a reactor turn every 32 completions, or when nothing granted is left
+       */
+      if((head == tail || ops % 32 == 0) && cq_signalled(cq)){
+	wakeups++;
+	do{
+	  n = lockCqDrain(cq, cookies, 256);
+	  for(i = 0; i < n; i++)
+	    granted[tail++ % BENCH_CQ_OUTSTANDING] = cookies[i];
+	  posted += n;
+	}while(n == 256);
+      }
+      /*
+       * complete the oldest granted I/O, its slot takes the next request
+       */
+      slot = granted[head++ % BENCH_CQ_OUTSTANDING];
+      lockRelease(&handle[slot]);
+    }
+    else
+      slot = ops;
+    start_lba = rand() % 65536;
+    if(lockRequestAsync(start_lba, start_lba + 15, rand() % 2, 5, cq, slot, &handle[slot]) == NODE_ADDED)
+      granted[tail++ % BENCH_CQ_OUTSTANDING] = slot;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  fprintf(stderr, "%u outstanding asynchronous locks: %.0f request+release/s, %.1f grants drained per wakeup\n",
+	  BENCH_CQ_OUTSTANDING, ops / ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9),
+	  wakeups ? (double) posted / wakeups : 0.0);
+  free(granted);
+  free(handle);
+  lockCqDestroy(cq);
+}
+
+/**
+ * @brief: probes see held locks only, reads not blocking reads
+ */
+void test_probe_range(){
+  lock_handle_t w, r, q;
+  int ok = 1;
+
+  treeInitCapacity(1024);
+  lockRequest(100, 199, 1, 1, 6, &w);
+  lockRequest(300, 399, 0, 1, 6, &r);
+  lockRequest(150, 349, 1, 1, 6, &q);
+  ok &= probeRange(199, 250, 0, 6) == 1 && probeRange(200, 299, 1, 6) == 0;
+  ok &= probeRange(300, 300, 0, 6) == 0 && probeRange(399, 500, 1, 6) == 1;
+  ok &= probeRange(0, 99, 1, 6) == 0 && probeRange(0, 99, 1, MAX_NAMESPACE_ID) == -1;
+  lockRelease(&w);
+  lockRelease(&r);
+  ok &= probeRange(100, 199, 0, 6) == 1 && probeRange(90, 149, 1, 6) == 0;
+  lockRelease(&q);
+  ok &= probeRange(0, 1000, 1, 6) == 0;
+  printf("probes see exactly the held locks? %s\n", ok ? "Y" : "N");
+}
+
+/**
+ * @brief Probing threads and the writer churning their namespace
+ */
+typedef struct test_probe_s{
+  unsigned int stop;
+  unsigned long probes;
+  unsigned long errors;
+}test_probe_t;
+
+void *test_probe_writer(void *arg){
+  test_probe_t *shared = arg;
+  lock_handle_t window[16];
+  unsigned int i, seed = 1;
+
+  memset(window, 0, sizeof(window));
+  for(i = 0; !__atomic_load_n(&shared->stop, __ATOMIC_RELAXED); i++){
+    lock_handle_t *slot = &window[i % 16];
+    unsigned int start = 2000 + rand_r(&seed) % 100000;
+    if(slot->node)
+      lockRelease(slot);
+    if(lockRequest(start, start + rand_r(&seed) % 64, i & 1, 0, 6, slot) != NODE_ADDED)
+      slot->node = NULL;
+  }
+  for(i = 0; i < 16; i++)
+    if(window[i].node)
+      lockRelease(&window[i]);
+  return NULL;
+}
+
+void *test_probe_reader(void *arg){
+  test_probe_t *shared = arg;
+  unsigned long probes = 0, errors = 0;
+
+  while(!__atomic_load_n(&shared->stop, __ATOMIC_RELAXED)){
+    errors += probeRange(1500, 1500, 0, 6) != 1;
+    errors += probeRange(200000, 300000, 1, 6) != 0;
+    probes += 2;
+  }
+  __atomic_add_fetch(&shared->probes, probes, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&shared->errors, errors, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+/**
+ * @brief: probes racing a writer that keeps rebalancing the tree always
+ * see the write lock held across the race, and never one that is not
+ */
+void test_probe_threads(){
+  test_probe_t shared = { 0, 0, 0 };
+  pthread_t writer, readers[4];
+  struct timespec run = { 0, 200000000 }, t0, t1;
+  lock_handle_t held;
+  lock_stats_t stats;
+  unsigned int i;
+
+  treeInitCapacity(1024);
+  lockRequest(1000, 1999, 1, 0, 6, &held);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  pthread_create(&writer, NULL, test_probe_writer, &shared);
+  for(i = 0; i < 4; i++)
+    pthread_create(&readers[i], NULL, test_probe_reader, &shared);
+  nanosleep(&run, NULL);
+  __atomic_store_n(&shared.stop, 1, __ATOMIC_RELAXED);
+  pthread_join(writer, NULL);
+  for(i = 0; i < 4; i++)
+    pthread_join(readers[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  lockRelease(&held);
+  lockStatsSnapshot(6, &stats);
+  fprintf(stderr, "4 probing threads against a writer: %.0f probes/s, %llu of %llu probes took the mutex (%.2f%%)\n",
+	  shared.probes / ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9),
+	  stats.probesLocked, stats.probes, 100.0 * stats.probesLocked / (stats.probes ? stats.probes : 1));
+  printf("lock-free probes consistent under a writer? %s\n", shared.errors == 0 && shared.probes ? "Y" : "N");
+}
+
+/**
+ * @brief: the skip list grants disjoint ranges at once, joins a read
+ * contained in a granted read, and queues conflicts on the entry in their
+ * way until its release grants them; reads stop joining a read once a
+ * writer waits for it.
+ */
+void test_skiplist_engine(){
+  skip_handle_t w1, r1, w2, r2, r3, w3, r4;
+  int ok = 1;
+
+  skipListInit(0);
+  ok &= skipListRequest(0, 9, 1, 0, &w1) == NODE_ADDED;
+  ok &= skipListRequest(5, 5, 0, 0, &r1) == NODE_QUEUED;
+  ok &= skipListRequest(20, 29, 1, 0, &w2) == NODE_ADDED;
+  ok &= !skipListGranted(&r1);
+  skipListRelease(&w1);
+  ok &= skipListGranted(&r1);
+  skipListRelease(&r1);
+  skipListRelease(&w2);
+
+  ok &= skipListRequest(100, 199, 0, 0, &r2) == NODE_ADDED;
+  ok &= skipListRequest(120, 130, 0, 0, &r3) == NODE_ADDED;
+  ok &= skipListRequest(150, 150, 1, 0, &w3) == NODE_QUEUED;
+  ok &= skipListRequest(110, 115, 0, 0, &r4) == NODE_QUEUED;
+  skipListRelease(&r2);
+  ok &= !skipListGranted(&w3);
+  skipListRelease(&r3);
+  ok &= skipListGranted(&w3) && skipListGranted(&r4);
+  skipListRelease(&w3);
+  skipListRelease(&r4);
+
+  /*
+   * nothing left behind: the whole space is free again
+   */
+  ok &= skipListRequest(0, UINT_MAX, 1, 0, &w1) == NODE_ADDED;
+  skipListRelease(&w1);
+  printf("skip list joins contained reads and queues conflicts on their entry? %s\n", ok ? "Y" : "N");
+}
+
+#define TEST_BPTREE_RANGES 1000
+
+/**
+ * @brief: the B+tree shares overlapping reads, queues a request behind any
+ * older conflicting one, held or queued, and grants it once the last is
+ * gone; a thousand ranges deepen the tree, released out of order each
+ * grants the write queued behind it, and the tree ends empty.
+ */
+void test_bptree_engine(){
+  static bptree_handle_t held[TEST_BPTREE_RANGES], queued[TEST_BPTREE_RANGES];
+  bptree_handle_t w1, r1, r2, w2;
+  unsigned int i, k;
+  int ok = 1;
+
+  bptreeInit(4 * TEST_BPTREE_RANGES);
+  ok &= bptreeRequest(0, 99, 0, 0, &r1) == NODE_ADDED;
+  ok &= bptreeRequest(50, 149, 0, 0, &r2) == NODE_ADDED;
+  ok &= bptreeRequest(140, 140, 1, 0, &w1) == NODE_QUEUED;
+  /*
+   * a read overlapping only the queued write still waits for it
+   */
+  ok &= bptreeRequest(140, 200, 0, 0, &w2) == NODE_QUEUED;
+  ok &= bptreeQueueLength(&w1) == 1;
+  bptreeRelease(&r1);
+  ok &= !bptreeGranted(&w1);
+  bptreeRelease(&r2);
+  ok &= bptreeGranted(&w1) && !bptreeGranted(&w2);
+  bptreeRelease(&w1);
+  ok &= bptreeGranted(&w2);
+  bptreeRelease(&w2);
+  ok &= bptreeRequest(5, 1, 1, 0, &w1) == NODE_FAILED;
+
+  for(i = 0; i < TEST_BPTREE_RANGES; i++)
+    ok &= bptreeRequest(i * 16, i * 16 + 9, i % 2, 1, &held[i]) == NODE_ADDED;
+  for(i = 0; i < TEST_BPTREE_RANGES; i++)
+    ok &= bptreeRequest(i * 16 + 9, i * 16 + 12, 1, 1, &queued[i]) == NODE_QUEUED;
+  for(i = 0; i < TEST_BPTREE_RANGES; i++){
+    k = (i * 389) % TEST_BPTREE_RANGES;
+    ok &= !bptreeGranted(&queued[k]);
+    bptreeRelease(&held[k]);
+    ok &= bptreeGranted(&queued[k]);
+  }
+  for(i = 0; i < TEST_BPTREE_RANGES; i++)
+    bptreeRelease(&queued[(i * 611) % TEST_BPTREE_RANGES]);
+
+  /*
+   * nothing left behind: the whole space is free again
+   */
+  ok &= bptreeRequest(0, UINT_MAX, 1, 1, &w1) == NODE_ADDED;
+  bptreeRelease(&w1);
+  printf("B+tree queues behind older conflicts and grants them in order? %s\n", ok ? "Y" : "N");
+}
+
+/**
+ * @brief: compact nodes are 32 bytes, the compact engine shares reads and
+ * queues a request behind every older conflicting one, held or queued;
+ * a release grants exactly the requests it was the last to hold back,
+ * here over a thousand ranges released out of order.
+ */
+void test_compact_engine(){
+  static compact_handle_t held[TEST_BPTREE_RANGES], queued[TEST_BPTREE_RANGES];
+  compact_handle_t w1, r1, r2, w2;
+  unsigned int i, k;
+  int ok = sizeof(compact_node_t) == 32;
+
+  compactInit(4 * TEST_BPTREE_RANGES);
+  ok &= compactRequest(0, 99, 0, 0, &r1) == NODE_ADDED;
+  ok &= compactRequest(50, 149, 0, 0, &r2) == NODE_ADDED;
+  ok &= compactRequest(140, 140, 1, 0, &w1) == NODE_QUEUED;
+  ok &= compactRequest(140, 200, 0, 0, &w2) == NODE_QUEUED;
+  ok &= compactQueueLength(&w1) == 1 && compactQueueLength(&w2) == 1;
+  compactRelease(&r1);
+  ok &= !compactGranted(&w1);
+  compactRelease(&r2);
+  ok &= compactGranted(&w1) && !compactGranted(&w2);
+  compactRelease(&w1);
+  ok &= compactGranted(&w2);
+  compactRelease(&w2);
+  ok &= compactRequest(5, 1, 1, 0, &w1) == NODE_FAILED;
+
+  for(i = 0; i < TEST_BPTREE_RANGES; i++)
+    ok &= compactRequest(i * 16, i * 16 + 9, i % 2, 1, &held[i]) == NODE_ADDED;
+  for(i = 0; i < TEST_BPTREE_RANGES; i++)
+    ok &= compactRequest(i * 16 + 9, i * 16 + 12, 1, 1, &queued[i]) == NODE_QUEUED;
+  for(i = 0; i < TEST_BPTREE_RANGES; i++){
+    k = (i * 389) % TEST_BPTREE_RANGES;
+    ok &= !compactGranted(&queued[k]);
+    compactRelease(&held[k]);
+    ok &= compactGranted(&queued[k]);
+  }
+  for(i = 0; i < TEST_BPTREE_RANGES; i++)
+    compactRelease(&queued[(i * 611) % TEST_BPTREE_RANGES]);
+
+  ok &= compactRequest(0, UINT_MAX, 1, 1, &w1) == NODE_ADDED;
+  compactRelease(&w1);
+  printf("compact 32-byte nodes queue behind older conflicts and grant them in order? %s\n", ok ? "Y" : "N");
+}
+
+#define TEST_FLAT_HELD 8
+
+/**
+ * @brief: the flat engine orders LBAs as unsigned at both ends of the
+ * space, queues behind older conflicts in its arrays, and keeps doing so
+ * while locks held and queued across both moves grow the namespace into
+ * the tree and shrink it back.
+ */
+void test_flat_engine(){
+  static flat_handle_t held[TEST_BPTREE_RANGES], queued[TEST_BPTREE_RANGES];
+  flat_handle_t w1, w2, r1, r2, keep[TEST_FLAT_HELD], wait[TEST_FLAT_HELD];
+  unsigned int i, k;
+  int ok = 1;
+
+  flatInit(4 * TEST_BPTREE_RANGES);
+  ok &= flatRequest(UINT_MAX - 5, UINT_MAX, 1, 0, &w1) == NODE_ADDED;
+  ok &= flatRequest(0, 0, 1, 0, &w2) == NODE_ADDED;
+  ok &= flatRequest(1, UINT_MAX - 6, 0, 0, &r1) == NODE_ADDED;
+  ok &= flatRequest(0, UINT_MAX, 0, 0, &r2) == NODE_QUEUED;
+  ok &= flatQueueLength(&r2) == 2;
+  flatRelease(&w1);
+  ok &= !flatGranted(&r2);
+  flatRelease(&w2);
+  ok &= flatGranted(&r2);
+  flatRelease(&r1);
+  flatRelease(&r2);
+  ok &= flatRequest(5, 1, 1, 0, &w1) == NODE_FAILED;
+
+  /*
+   * locks that live through the moves, each queued write behind its read
+   */
+  for(i = 0; i < TEST_FLAT_HELD; i++){
+    ok &= flatRequest(1000000 + i * 16, 1000000 + i * 16 + 9, 0, 1, &keep[i]) == NODE_ADDED;
+    ok &= flatRequest(1000000 + i * 16 + 9, 1000000 + i * 16 + 9, 1, 1, &wait[i]) == NODE_QUEUED;
+  }
+  for(i = 0; i < TEST_BPTREE_RANGES; i++)
+    ok &= flatRequest(i * 16, i * 16 + 9, i % 2, 1, &held[i]) == NODE_ADDED;
+  for(i = 0; i < TEST_BPTREE_RANGES; i++)
+    ok &= flatRequest(i * 16 + 9, i * 16 + 12, 1, 1, &queued[i]) == NODE_QUEUED;
+  for(i = 0; i < TEST_BPTREE_RANGES; i++){
+    k = (i * 389) % TEST_BPTREE_RANGES;
+    ok &= !flatGranted(&queued[k]);
+    flatRelease(&held[k]);
+    ok &= flatGranted(&queued[k]);
+  }
+  for(i = 0; i < TEST_BPTREE_RANGES; i++)
+    flatRelease(&queued[(i * 611) % TEST_BPTREE_RANGES]);
+  for(i = 0; i < TEST_FLAT_HELD; i++){
+    ok &= !flatGranted(&wait[i]) && flatQueueLength(&wait[i]) == 1;
+    flatRelease(&keep[i]);
+    ok &= flatGranted(&wait[i]);
+    flatRelease(&wait[i]);
+  }
+
+  ok &= flatRequest(0, UINT_MAX, 1, 1, &w1) == NODE_ADDED;
+  flatRelease(&w1);
+  printf("flat engine queues behind older conflicts in arrays and tree alike? %s\n", ok ? "Y" : "N");
+}
+
+#define TEST_ENGINE_LBAS    256
+#define TEST_ENGINE_THREADS 4
+
+/**
+ * @brief Engine and LBA owners shared by #test_engine_worker threads,
+ * an owner is -1 for a writer, else the number of readers
+ */
+typedef struct test_engine_s{
+  const lock_engine_t *engine;
+  int owners[TEST_ENGINE_LBAS];
+  unsigned int overlaps;
+  unsigned int failures;
+}test_engine_t;
+
+/**
+ * @brief A lock of a #test_engine_worker window
+ */
+typedef struct test_engine_lock_s{
+  unsigned char handle[LOCK_ENGINE_HANDLE_SIZE] __attribute__((aligned(8)));
+  unsigned int start_lba;
+  unsigned int end_lba;
+  unsigned int type;
+  int claimed;
+}test_engine_lock_t;
+
+/**
+ * @brief Mark the LBAs of a granted lock as owned, counting the owners it overlaps
+ */
+static void test_engine_claim(test_engine_t *shared, test_engine_lock_t *lock){
+  unsigned int lba;
+  int owner;
+  for(lba = lock->start_lba; lba <= lock->end_lba; lba++){
+    owner = __atomic_load_n(&shared->owners[lba], __ATOMIC_ACQUIRE);
+    do{
+      if(lock->type ? owner != 0 : owner < 0){
+	__atomic_add_fetch(&shared->overlaps, 1, __ATOMIC_RELAXED);
+	break;
+      }
+    }while(!__atomic_compare_exchange_n(&shared->owners[lba], &owner, lock->type ? -1 : owner + 1, 1,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+  }
+  lock->claimed = 1;
+}
+
+static void test_engine_unclaim(test_engine_t *shared, test_engine_lock_t *lock){
+  unsigned int lba;
+  for(lba = lock->start_lba; lba <= lock->end_lba; lba++)
+    if(lock->type)
+      __atomic_store_n(&shared->owners[lba], 0, __ATOMIC_RELEASE);
+    else
+      __atomic_sub_fetch(&shared->owners[lba], 1, __ATOMIC_ACQ_REL);
+}
+
+/**
+ * @brief Claim every lock of the window that got granted, then release the
+ * oldest granted one
+ *
+ * @retval 0 if nothing is granted yet
+ */
+static int test_engine_complete(test_engine_t *shared, test_engine_lock_t *window, unsigned int *inflight){
+  unsigned int i, oldest = *inflight;
+  for(i = 0; i < *inflight; i++)
+    if(window[i].claimed || shared->engine->granted(window[i].handle)){
+      if(!window[i].claimed)
+	test_engine_claim(shared, &window[i]);
+      if(oldest == *inflight)
+	oldest = i;
+    }
+  if(oldest == *inflight)
+    return 0;
+  test_engine_unclaim(shared, &window[oldest]);
+  shared->engine->release(window[oldest].handle);
+  memmove(&window[oldest], &window[oldest + 1], (*inflight - oldest - 1) * sizeof(test_engine_lock_t));
+  (*inflight)--;
+  return 1;
+}
+
+/**
+ * @brief keep a window of random reads and writes outstanding on a small
+ * LBA space, so that most requests collide.
+ */
+void *test_engine_worker(void *arg){
+  test_engine_t *shared = arg;
+  test_engine_lock_t window[TEST_WORKER_WINDOW];
+  unsigned int i, inflight = 0, seed = (unsigned int) (uintptr_t) &window;
+  enum NODE_INSERT_RESULT ret;
+
+  for(i = 0; i < TEST_WORKER_OPS; i++){
+    test_engine_lock_t *lock;
+    while(inflight == TEST_WORKER_WINDOW && !test_engine_complete(shared, window, &inflight))
+      sched_yield();
+    lock = &window[inflight];
+    lock->start_lba = rand_r(&seed) % (TEST_ENGINE_LBAS - 8);
+    lock->end_lba   = lock->start_lba + rand_r(&seed) % 8;
+    lock->type      = rand_r(&seed) % 2;
+    lock->claimed   = 0;
+    ret = shared->engine->request(lock->start_lba, lock->end_lba, lock->type, 8, lock->handle);
+    if(ret == NODE_FAILED){
+      shared->failures++;
+      continue;
+    }
+    if(ret == NODE_ADDED)
+      test_engine_claim(shared, lock);
+    inflight++;
+  }
+  while(inflight)
+    if(!test_engine_complete(shared, window, &inflight))
+      sched_yield();
+  return NULL;
+}
+
+/**
+ * @brief Run #test_engine_worker threads on an engine already initialised
+ *
+ * @retval 1 if no locks overlapped and every LBA is free in the end
+ */
+static int test_engine_run(test_engine_t *shared, const char *what){
+  pthread_t threads[TEST_ENGINE_THREADS];
+  struct timespec t0, t1;
+  unsigned int i, lba;
+  int ok;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for(i = 0; i < TEST_ENGINE_THREADS; i++)
+    pthread_create(&threads[i], NULL, test_engine_worker, shared);
+  for(i = 0; i < TEST_ENGINE_THREADS; i++)
+    pthread_join(threads[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  ok = shared->overlaps == 0 && shared->failures == 0;
+  for(lba = 0; lba < TEST_ENGINE_LBAS; lba++)
+    ok &= shared->owners[lba] == 0;
+  fprintf(stderr, "%u threads colliding on %u LBAs with the %s: %.0f lock+unlock/s\n",
+	  TEST_ENGINE_THREADS, TEST_ENGINE_LBAS, what,
+	  TEST_ENGINE_THREADS * TEST_WORKER_OPS / ((t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9));
+  return ok;
+}
+
+/**
+ * @brief: every engine keeps reads and writers apart, and grants every
+ * queued lock in the end, with threads colliding on a small LBA space.
+ */
+void test_engine_threads(){
+  const lock_engine_t *engine;
+  test_engine_t shared;
+  char what[64];
+
+  for(engine = lockEngines; engine->name; engine++){
+    memset(&shared, 0, sizeof(shared));
+    shared.engine = engine;
+    engine->init(TEST_ENGINE_THREADS * TEST_WORKER_WINDOW * 2 + 1024);
+    snprintf(what, sizeof(what), "%s engine", engine->name);
+    printf("%s engine keeps colliding threads apart? %s\n", engine->name, test_engine_run(&shared, what) ? "Y" : "N");
+  }
+}
+
+/**
+ * @brief: a namespace split into shards keeps each shard to its own tree,
+ * a range across shards waits for every shard it overlaps and is granted
+ * once the last one frees up, and threads locking across the shards of
+ * a small LBA space never overlap.
+ */
+void test_namespace_shards(){
+  lock_handle_t w1, w2, x, r;
+  lock_range_t ranges[2] = { { 12, 250, 260, 1 }, { 12, 1000, 1000, 0 } };
+  lock_batch_t batch;
+  test_engine_t shared;
+  int ok = 1;
+
+  treeInitCapacity(1024);
+  ok &= lockNamespaceShards(12, 0, 8) == -1 && lockNamespaceShards(12, LOCK_SHARDS_MAX + 1, 8) == -1;
+  ok &= lockNamespaceShards(12, 4, 31) == -1;
+  ok &= lockNamespaceShards(12, 4, 8) == 0;
+
+  ok &= lockRequest(100, 150, 1, 1, 12, &w1) == NODE_ADDED;
+  ok &= lockRequest(300, 310, 1, 1, 12, &w2) == NODE_ADDED;
+  ok &= namespaces[12].root == w1.node && namespaces[12].shards[0].root == w2.node;
+  ok &= lockNamespaceShards(12, 2, 8) == -1;
+
+  /*
+   * the last shard runs to the end of the LBA space
+   */
+  ok &= lockRequest(5000, 5000, 1, 1, 12, &r) == NODE_ADDED && namespaces[12].shards[2].root == r.node;
+  lockRelease(&r);
+
+  ok &= lockRequest(120, 520, 1, 1, 12, &x) == NODE_QUEUED && !lockGranted(&x);
+  ok &= probeRange(600, 700, 1, 12) == 0 && probeRange(515, 515, 0, 12) == 1;
+  ok &= lockRequest(0, 1000, 0, 0, 12, &r) == NODE_COLLISION;
+  lockRelease(&w1);
+  ok &= !lockGranted(&x);
+  lockRelease(&w2);
+  ok &= lockGranted(&x) && lockWait(&x) == 0;
+  lockRelease(&x);
+  ok &= namespaces[12].root == NULL && namespaces[12].shards[0].root == NULL && namespaces[12].shards[1].root == NULL;
+
+  /*
+   * a batch range across a shard boundary becomes a lock per shard
+   */
+  ok &= lockRequestBatch(ranges, 2, 1, &batch) == NODE_ADDED && batch.count == 3;
+  lockReleaseBatch(&batch);
+  ok &= namespaces[12].root == NULL && namespaces[12].shards[0].root == NULL && namespaces[12].shards[2].root == NULL;
+  ok &= lockNamespaceShards(12, 1, 0) == 0 && namespaces[12].shards == NULL;
+
+  /*
+   * 8 shards of 32 LBAs, so many of the colliding requests cross shards
+   */
+  memset(&shared, 0, sizeof(shared));
+  shared.engine = lockEngineFind("avl");
+  shared.engine->init(TEST_ENGINE_THREADS * TEST_WORKER_WINDOW * 2 + 1024);
+  ok &= lockNamespaceShards(8, 8, 5) == 0;
+  ok &= test_engine_run(&shared, "avl engine in 8 shards");
+  printf("namespace shards lock apart and ranges across them wait for every shard? %s\n", ok ? "Y" : "N");
+}
+
+#define TEST_CQ_THREADS 4
+#define TEST_CQ_WINDOW  8
+#define TEST_CQ_OPS     5000
+
+typedef struct test_cq_worker_s{
+  unsigned int index;
+  unsigned int errors;
+}test_cq_worker_t;
+
+/**
+ * @brief Drain a worker's completion queue, checking every cookie is one
+ * of its queued requests and arrives once
+ *
+ * @retval number of cookies drained
+ */
+static unsigned int test_cq_drain(lock_cq_t *cq, test_cq_worker_t *self, unsigned char *posted, unsigned long *received){
+  unsigned long long cookies[16], op;
+  unsigned int n, i, total = 0;
+
+  while((n = lockCqDrain(cq, cookies, 16)) > 0){
+    total += n;
+    for(i = 0; i < n; i++, (*received)++){
+      op = cookies[i] & 0xffffffffull;
+      if(cookies[i] >> 32 != self->index || op >= TEST_CQ_OPS || posted[op] != 1)
+	self->errors++;
+      else
+	posted[op] = 2;
+    }
+  }
+  return total;
+}
+
+/**
+ * @brief Keep a window of asynchronous write locks on a sharded namespace,
+ * finding out about grants by polling the handle or by draining the queue
+ */
+void *test_cq_worker(void *arg){
+  test_cq_worker_t *self = arg;
+  lock_cq_t *cq = lockCqCreate(TEST_CQ_WINDOW * 2);
+  lock_handle_t window[TEST_CQ_WINDOW];
+  unsigned char *posted = calloc(TEST_CQ_OPS, 1);
+  unsigned long queued = 0, received = 0;
+  unsigned int op, seed = self->index + 1, start, tries;
+  enum NODE_INSERT_RESULT ret;
+
+  memset(window, 0, sizeof(window));
+  for(op = 0; op < TEST_CQ_OPS + TEST_CQ_WINDOW; op++){
+    lock_handle_t *handle = &window[op % TEST_CQ_WINDOW];
+    if(handle->node){
+      while(!lockGranted(handle))
+	if((op & 1) || test_cq_drain(cq, self, posted, &received) == 0)
+	  sched_yield();
+      lockRelease(handle);
+      handle->node = NULL;
+    }
+    if(op >= TEST_CQ_OPS)
+      continue;
+    start = rand_r(&seed) % 120;
+    while((ret = lockRequestAsync(start, start + rand_r(&seed) % 64, 1, 13, cq,
+				  ((unsigned long long) self->index << 32) | op, handle)) == NODE_FAILED)
+      if(test_cq_drain(cq, self, posted, &received) == 0)
+	sched_yield();
+    if(ret == NODE_QUEUED){
+      posted[op] = 1;
+      queued++;
+    }
+  }
+
+  /*
+   * a grant seen by polling may be posted a moment later
+   */
+  for(tries = 0; received < queued && tries < 100000; tries++){
+    test_cq_drain(cq, self, posted, &received);
+    sched_yield();
+  }
+  self->errors += received != queued;
+  free(posted);
+  lockCqDestroy(cq);
+  return NULL;
+}
+
+/**
+ * @brief: threads requesting write locks across shards with completion
+ * queues, and releasing them as soon as they poll them granted, get every
+ * grant of a queued request posted once to their own queue.
+ */
+void test_cq_shards(){
+  pthread_t threads[TEST_CQ_THREADS];
+  test_cq_worker_t workers[TEST_CQ_THREADS];
+  unsigned int i;
+  int ok = 1;
+
+  treeInitCapacity(TEST_CQ_THREADS * TEST_CQ_WINDOW * 4 + 1024);
+  ok &= lockNamespaceShards(13, 4, 5) == 0;
+  for(i = 0; i < TEST_CQ_THREADS; i++){
+    workers[i].index  = i;
+    workers[i].errors = 0;
+    pthread_create(&threads[i], NULL, test_cq_worker, &workers[i]);
+  }
+  for(i = 0; i < TEST_CQ_THREADS; i++){
+    pthread_join(threads[i], NULL);
+    ok &= workers[i].errors == 0;
+  }
+  ok &= namespaces[13].root == NULL;
+  for(i = 0; i < 3; i++)
+    ok &= namespaces[13].shards[i].root == NULL;
+  ok &= lockNamespaceShards(13, 1, 0) == 0;
+  printf("grants of requests across shards posted once to their own queue? %s\n", ok ? "Y" : "N");
+}
+
+#define TEST_DIRECTORY_OPS 20000
+
+/**
+ * @brief lock and release one write range on an attached namespace until told to stop
+ */
+void *test_directory_worker(void *arg){
+  unsigned int *stop = arg, failed = 0;
+  lock_handle_t handle;
+
+  while(!__atomic_load_n(stop, __ATOMIC_ACQUIRE)){
+    if(lockRange(0, 9, 1, 300, &handle) != NODE_ADDED)
+      failed++;
+    else
+      lockRelease(&handle);
+  }
+  __atomic_store_n(stop, failed, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/**
+ * @brief: namespaces past MAX_NAMESPACE_ID take requests only while
+ * attached, can not be detached while they hold locks, and attaching and
+ * detaching namespaces does not disturb a thread locking another one.
+ */
+void test_namespace_directory(){
+  lock_handle_t w1, w2;
+  lock_range_t ranges[2] = { { 300, 0, 9, 1 }, { 5, 0, 9, 1 } };
+  lock_batch_t batch;
+  pthread_t thread;
+  struct timespec t0, t1;
+  unsigned int id, i, stop = 0;
+  int ok = 1;
+
+  treeInitCapacity(1024);
+  ok &= lockNamespaceGet(5) == &namespaces[5] && lockNamespaceGet(300) == NULL;
+  ok &= lockRequest(0, 9, 1, 1, 300, &w1) == NODE_FAILED && probeRange(0, 9, 1, 300) == -1;
+  ok &= lockRequestBatch(ranges, 2, 1, &batch) == NODE_FAILED;
+  ok &= lockNamespaceAttach(5) == -1 && lockNamespaceAttach(LOCK_NAMESPACE_LIMIT) == -1 && lockNamespaceDetach(5) == -1;
+  ok &= lockNamespaceAttach(300) == 0 && lockNamespaceAttach(300) == -1;
+
+  ok &= lockRequest(0, 9, 1, 1, 300, &w1) == NODE_ADDED;
+  ok &= lockRequest(5, 5, 1, 1, 300, &w2) == NODE_QUEUED;
+  ok &= lockNamespaceGet(300)->root == w1.node && probeRange(0, 0, 0, 300) == 1;
+  ok &= lockNamespaceDetach(300) == -1;
+  lockRelease(&w1);
+  ok &= lockWait(&w2) == 0;
+  lockRelease(&w2);
+  ok &= lockRequestBatch(ranges, 2, 1, &batch) == NODE_ADDED && batch.count == 2;
+  lockReleaseBatch(&batch);
+  ok &= lockNamespaceShards(300, 4, 4) == 0;
+  ok &= lockRequest(0, 40, 1, 1, 300, &w1) == NODE_ADDED;
+  lockRelease(&w1);
+  ok &= lockNamespaceDetach(300) == 0 && lockNamespaceDetach(300) == -1 && lockNamespaceGet(300) == NULL;
+  ok &= lockRequest(0, 9, 1, 1, 300, &w1) == NODE_FAILED;
+
+  /*
+   * churn the leaf of namespace 300 while a thread locks it
+   */
+  ok &= lockNamespaceAttach(300) == 0;
+  pthread_create(&thread, NULL, test_directory_worker, &stop);
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for(i = 0; i < TEST_DIRECTORY_OPS; i++){
+    id = 256 + i % 256;
+    if(id == 300)
+      continue;
+    ok &= lockNamespaceAttach(id) == 0;
+    ok &= lockRequest(id, id, 0, 1, id, &w1) == NODE_ADDED;
+    lockRelease(&w1);
+    ok &= lockNamespaceDetach(id) == 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+  pthread_join(thread, NULL);
+  ok &= stop == 0 && lockNamespaceDetach(300) == 0;
+  fprintf(stderr, "namespace attach+lock+unlock+detach: %.0f ns\n",
+	  ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / TEST_DIRECTORY_OPS);
+  printf("namespaces past %u attach and detach at run time? %s\n", MAX_NAMESPACE_ID, ok ? "Y" : "N");
+}
+
+/**
+ * @brief: counts of one thread locking namespace 7
+ */
+void *test_stats_worker(void *arg){
+  lock_handle_t *handle = arg;
+  lockRequest(100, 199, 0, 1, 7, handle);
+  return NULL;
+}
+
+/**
+ * @brief: counters and histograms add up across threads, including
+ * threads that have exited, and stay apart per namespace. With timing off
+ * the counters still count but the histograms stay empty.
+ */
+void test_lock_stats(){
+  lock_handle_t a, b, c;
+  lock_stats_t stats;
+  pthread_t thread;
+  unsigned int n;
+  unsigned long long holds = 0, waits = 0;
+  int ok = 1;
+
+  treeInit();
+  lockStatsTiming(1);
+  lockRequest(0, 149, 1, 1, 7, &a);
+  pthread_create(&thread, NULL, test_stats_worker, &b);
+  pthread_join(thread, NULL);
+  lockRequest(50, 60, 1, 0, 7, NULL);
+  lockRequest(50, 60, 1, 1, 8, &c);
+  lockRelease(&a);
+  lockRelease(&b);
+  lockRelease(&c);
+
+  lockStatsSnapshot(7, &stats);
+  for(n = 0; n < LOCK_STATS_BUCKETS; n++){
+    holds += stats.holdHist[n];
+    waits += stats.waitHist[n];
+  }
+#if LOCK_STATS
+  ok &= stats.requests == 3 && stats.added == 1 && stats.queued == 1 && stats.collisions == 1;
+  ok &= stats.releases == 2 && stats.promotions == 1 && holds == 2 && waits == 1;
+  ok &= lockStatsPercentile(stats.holdHist, 50) > 0;
+  lockStatsSnapshot(8, &stats);
+  ok &= stats.requests == 1 && stats.added == 1 && stats.releases == 1;
+
+  lockStatsTiming(0);
+  lockRequest(0, 149, 1, 1, 8, &a);
+  lockRelease(&a);
+  lockStatsSnapshot(8, &stats);
+  for(n = 0, holds = 0; n < LOCK_STATS_BUCKETS; n++)
+    holds += stats.holdHist[n];
+  ok &= stats.requests == 2 && stats.releases == 2 && holds == 1;
+#else
+  ok &= stats.requests == 0 && holds == 0;
+#endif
+  printf("lock statistics add up? %s\n", ok ? "Y" : "N");
+}
+
+#ifdef LOCK_TRACE_RING
+/**
+ * @brief trace one request and its release from a short lived thread
+ */
+void *test_trace_worker(void *arg){
+  lock_handle_t handle;
+  lockRequest(100, 109, 1, 1, 5, &handle);
+  lockRelease(&handle);
+  return NULL;
+}
+
+/**
+ * @brief: every request, release and grant lands in the calling thread's
+ * ring of the trace file, in order, and threads that exit give their ring
+ * to the next ones.
+ */
+void test_trace_ring(){
+  lock_trace_file_t *file;
+  lock_handle_t a, b;
+  pthread_t thread;
+  unsigned int i;
+  FILE *fp;
+  int ok = 1;
+
+  treeInit();
+  ok &= lockTraceOpen("lock_trace.bin") == 0;
+  namespaces[5].next_index = UINT_MAX;
+  lockRequest(0, 9, 1, 1, 5, &a);
+  lockRequest(5, 7, 0, 1, 5, &b);
+  lockRelease(&a);
+  lockRelease(&b);
+  for(i = 0; i < LOCK_TRACE_RINGS * 2; i++){
+    pthread_create(&thread, NULL, test_trace_worker, NULL);
+    pthread_join(thread, NULL);
+  }
+  lockTraceClose();
+
+  file = malloc(sizeof(lock_trace_file_t));
+  ok &= (fp = fopen("lock_trace.bin", "rb")) != NULL && fread(file, sizeof(lock_trace_file_t), 1, fp) == 1;
+  if(ok){
+    lock_trace_ring_t *ring = &file->ring[0];
+    ok &= file->magic == LOCK_TRACE_MAGIC && file->claimed == 2 && ring->head == 5;
+    ok &= file->owned == 1 && file->dropped == 0 && file->ring[1].head == LOCK_TRACE_RINGS * 4;
+    ok &= file->ring[1].record[0].tid != ring->record[0].tid;
+    ok &= ring->record[0].op == LOCK_OP_REQUEST && ring->record[0].result == NODE_ADDED;
+    ok &= ring->record[1].op == LOCK_OP_REQUEST && ring->record[1].result == NODE_QUEUED;
+    ok &= ring->record[0].eventIndex == UINT_MAX + 1ull && ring->record[3].eventIndex == UINT_MAX + 2ull;
+    ok &= ring->record[2].op == LOCK_OP_RELEASE && ring->record[2].start_lba == 0;
+    ok &= ring->record[3].op == LOCK_OP_GRANT   && ring->record[3].start_lba == 5;
+    ok &= ring->record[4].op == LOCK_OP_RELEASE && ring->record[4].namespaceID == 5;
+    ok &= ring->record[0].timestamp <= ring->record[4].timestamp;
+  }
+  if(fp)
+    fclose(fp);
+  free(file);
+  printf("trace ring recorded every operation? %s\n", ok ? "Y" : "N");
+}
+#endif
+
 int main(){
   int i = 0;
 
@@ -406,5 +2029,65 @@ int main(){
   //random_test1();
 
   random_test2();
+
+  random_test3();
+
+  test_shared_reads();
+
+  test_lock_handles();
+
+  test_event_order();
+
+  test_release_batch();
+
+  test_lock_batch();
+
+#ifdef LOCK_TRACE_RING
+  test_trace_ring();
+#endif
+
+  test_lock_stats();
+
+  test_probe_range();
+
+  bench_shared_reads();
+
+  bench_request_latency();
+
+  bench_deep_queue();
+
+  bench_release_herd();
+
+  bench_lock_batch();
+
+  test_node_arena();
+
+  test_namespace_threads();
+
+  test_lock_range();
+
+  bench_lock_range();
+
+  test_lock_cq();
+
+  bench_lock_cq();
+
+  test_probe_threads();
+
+  test_skiplist_engine();
+
+  test_bptree_engine();
+
+  test_compact_engine();
+
+  test_flat_engine();
+
+  test_engine_threads();
+
+  test_namespace_shards();
+
+  test_cq_shards();
+
+  test_namespace_directory();
   return 1;
 }
@@ -1,22 +1,123 @@
 #include<stdlib.h>
 #include<string.h>
 #include<stdio.h>
+#include<limits.h>
+#include<unistd.h>
+#include<sched.h>
+#include<sys/syscall.h>
+#include<sys/eventfd.h>
+#include<linux/futex.h>
 #include"lock_manager.h"
+#include"lock_trace.h"
+#include"lock_stats.h"
 
 /**
- * @brief The root node of the trees for each namespace.
+ * @brief The lock state of each namespace.
  */
-tree_node_t *rootArray[MAX_NAMESPACE_ID ] = { NULL };
+lock_namespace_t namespaces[MAX_NAMESPACE_ID];
+
 /**
- * @brief Tree node array.
- * 
- * @note This may need to be dynamic based on the number of flash targets.
+ * @brief Namespace IDs per leaf of the namespace directory, as a shift
+ */
+#define NAMESPACE_LEAF_BITS 8
+#define NAMESPACE_LEAF_SIZE (1u << NAMESPACE_LEAF_BITS)
+
+/**
+ * @brief Directory of the attached namespaces past #MAX_NAMESPACE_ID
+ *
+ * A radix array of two levels: the top level is static, a leaf of
+ * #NAMESPACE_LEAF_SIZE pointers is allocated on the first attach in its
+ * range and kept until #treeInitCapacity. An ID that is not attached
+ * costs its leaf pointer; lookups take two loads and no lock, attach and
+ * detach are serialized by the directory mutex.
+ */
+static lock_namespace_t **namespaceDirectory[LOCK_NAMESPACE_LIMIT / NAMESPACE_LEAF_SIZE] __attribute__((aligned(CACHE_LINE_SIZE)));
+static pthread_mutex_t namespaceDirectoryLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Look up the state of a namespace
+ *
+ * @retval Pointer to the namespace, NULL if the ID is out of range or not attached
+ */
+static inline lock_namespace_t *namespaceGet(unsigned int namespaceID){
+  lock_namespace_t **leaf;
+  if(namespaceID < MAX_NAMESPACE_ID)
+    return &namespaces[namespaceID];
+  if(namespaceID >= LOCK_NAMESPACE_LIMIT ||
+     (leaf = __atomic_load_n(&namespaceDirectory[namespaceID >> NAMESPACE_LEAF_BITS], __ATOMIC_ACQUIRE)) == NULL)
+    return NULL;
+  return __atomic_load_n(&leaf[namespaceID & (NAMESPACE_LEAF_SIZE - 1)], __ATOMIC_ACQUIRE);
+}
+/**
+ * @brief Maximum number of tree nodes the arena may carve, set by #treeInitCapacity.
+ */
+unsigned int  nodeCapacity = MAX_NODES;
+
+/**
+ * @brief Number of tree nodes carved from the heap at a time.
+ */
+#define NODES_PER_CHUNK 256
+
+/**
+ * @brief Number of free nodes moved between a thread and the depot at a time.
+ */
+#define MAGAZINE_SIZE 16
+
+/**
+ * @brief A batch of free tree nodes.
+ */
+typedef struct magazine_s{
+  /*
+   * next magazine in the depot
+   */
+  struct magazine_s *next;
+
+  /*
+   * number of nodes held in round[]
+   */
+  unsigned int rounds;
+
+  tree_node_t *round[MAGAZINE_SIZE];
+}magazine_t;
+
+/**
+ * @brief Per thread node cache.
+ *
+ * Allocation and free only touch the loaded magazine; the previous one is
+ * always full or empty and is swapped in before going to the depot, so a
+ * thread alternating between alloc and free stays off the depot mutex.
  */
-tree_node_t   nodes[MAX_NODES];
-unsigned int  tree_array[MAX_NODES + 1];
-unsigned int  next_index[MAX_NAMESPACE_ID];
-list_head_t   freeNodes;
-unsigned int  allocated;
+typedef struct node_cache_s{
+  magazine_t *loaded;
+  magazine_t *previous;
+  /*
+   * arena generation the magazines belong to
+   */
+  unsigned int generation;
+}node_cache_t;
+
+/**
+ * @brief The node arena and the depot of magazines shared by all threads.
+ */
+static struct{
+  pthread_mutex_t mutex;
+  /*
+   * chunk directory, nodeCapacity/NODES_PER_CHUNK entries rounded up
+   */
+  tree_node_t **chunks;
+  unsigned int carved;
+  magazine_t *full;
+  magazine_t *empty;
+  /*
+   * free nodes no magazine could be found for, linked through child[LEFT]
+   */
+  tree_node_t *loose;
+  unsigned int generation;
+}nodeArena = { PTHREAD_MUTEX_INITIALIZER };
+
+static __thread node_cache_t nodeCache;
+static pthread_key_t nodeCacheKey;
+static pthread_once_t nodeCacheOnce = PTHREAD_ONCE_INIT;
 
 static inline void listInsert(list_head_t *old, list_head_t *new)
 {
@@ -31,7 +132,6 @@ static inline void listInsert(list_head_t *old, list_head_t *new)
 #define listAddTail(list, new)      listInsert(list, new)
 #define listEmpty(list)             ((list)->next == (list))
 #define listGetHead(list, type)     ((type *) ((list)->next))
-#define lowbit(i)                   ((i)&(-i))
 
 static inline void listDel(list_head_t * entry) 
 {
@@ -41,72 +141,265 @@ static inline void listDel(list_head_t * entry)
 }
 
 /**
- * @brief Initialize the tree data structures.
- * zero out the tree node structure and add them 
+ * @brief Return a magazine to the depot, full ones first in line for refills.
+ *
+ * @param[in] mag -- the magazine, may be NULL
  *
  * @retval N/A
  **/
-void treeInit(void){
-  unsigned int n;
-  /*
-   * Clear the memory used for the tree nodes, root array and namespace lock activation.
-   */
-  memset(nodes, 0, sizeof(nodes));
-  memset(rootArray, 0, sizeof(rootArray));
-  memset(next_index, 0, sizeof(next_index));
+static void depotPut(magazine_t *mag){
+  if(mag == NULL)
+    return;
+  pthread_mutex_lock(&nodeArena.mutex);
+  if(mag->rounds){
+    mag->next = nodeArena.full;
+    nodeArena.full = mag;
+  }
+  else{
+    mag->next = nodeArena.empty;
+    nodeArena.empty = mag;
+  }
+  pthread_mutex_unlock(&nodeArena.mutex);
+}
+
+/**
+ * @brief Thread exit hook, hands the cached nodes back to the depot.
+ **/
+static void nodeCacheExit(void *unused){
+  if(nodeCache.generation == nodeArena.generation){
+    depotPut(nodeCache.loaded);
+    depotPut(nodeCache.previous);
+  }
+  nodeCache.loaded = nodeCache.previous = NULL;
+}
+
+static void nodeCacheKeyCreate(void){
+  pthread_key_create(&nodeCacheKey, nodeCacheExit);
+}
+
+/**
+ * @brief Get the node cache of the calling thread.
+ *
+ * Magazines left over from before the last #treeInitCapacity are dropped.
+ *
+ * @retval Pointer to the thread's cache
+ **/
+static node_cache_t *nodeCacheGet(void){
+  node_cache_t *cache = &nodeCache;
+  if(cache->generation != nodeArena.generation){
+    pthread_once(&nodeCacheOnce, nodeCacheKeyCreate);
+    pthread_setspecific(nodeCacheKey, cache);
+    free(cache->loaded);
+    free(cache->previous);
+    cache->loaded = cache->previous = NULL;
+    cache->generation = nodeArena.generation;
+  }
+  return cache;
+}
+
+/**
+ * @brief Take a magazine from the depot, carving a new chunk of nodes if needed.
+ *
+ * @param[in] full -- set to take a magazine with nodes in it, clear for an empty one
+ *
+ * @retval Pointer to the magazine, NULL if the capacity is exhausted or out of memory
+ **/
+static magazine_t *depotGet(int full){
+  magazine_t *mag = NULL;
+  pthread_mutex_lock(&nodeArena.mutex);
+  if(!full){
+    if((mag = nodeArena.empty) != NULL)
+      nodeArena.empty = mag->next;
+    else if((mag = malloc(sizeof(magazine_t))) != NULL)
+      mag->rounds = 0;
+  }
+  else{
+    if(nodeArena.full == NULL && nodeArena.carved < nodeCapacity){
+      /*
+       * carve the next chunk into full magazines, only once there are
+       * magazines for all of it: the chunk is carved whole or not at all
+       */
+      unsigned int n, count = MIN(NODES_PER_CHUNK, nodeCapacity - nodeArena.carved);
+      magazine_t *mags = NULL;
+      tree_node_t *chunk = NULL;
+      for(n = 0; n < count; n += MAGAZINE_SIZE){
+	if((mag = nodeArena.empty) != NULL)
+	  nodeArena.empty = mag->next;
+	else if((mag = malloc(sizeof(magazine_t))) == NULL)
+	  break;
+	mag->rounds = 0;
+	mag->next = mags;
+	mags = mag;
+      }
+      if(n >= count)
+	chunk = aligned_alloc(CACHE_LINE_SIZE, NODES_PER_CHUNK * sizeof(tree_node_t));
+      if(chunk != NULL){
+	memset(chunk, 0, NODES_PER_CHUNK * sizeof(tree_node_t));
+	nodeArena.chunks[nodeArena.carved / NODES_PER_CHUNK] = chunk;
+	for(n = count; n > 0; n--){
+	  if(mags->rounds == MAGAZINE_SIZE){
+	    mag = mags;
+	    mags = mag->next;
+	    mag->next = nodeArena.full;
+	    nodeArena.full = mag;
+	  }
+	  listInit(&chunk[n - 1].list);
+	  mags->round[mags->rounds++] = &chunk[n - 1];
+	}
+	mags->next = nodeArena.full;
+	nodeArena.full = mags;
+	nodeArena.carved += count;
+      }
+      else
+	while((mag = mags) != NULL){
+	  mags = mag->next;
+	  mag->next = nodeArena.empty;
+	  nodeArena.empty = mag;
+	}
+    }
+    if((mag = nodeArena.full) != NULL)
+      nodeArena.full = mag->next;
+  }
+  pthread_mutex_unlock(&nodeArena.mutex);
+  return mag;
+}
+
+/**
+ * @brief Initialize the tree data structures with a node capacity.
+ *
+ * Releases the node arena, every magazine in the depot and the namespace
+ * state, shards and attached namespaces included. Nodes are carved from
+ * the heap on demand, up to capacity.
+ *
+ * @param[in] capacity -- the maximum number of tree nodes
+ *
+ * @retval N/A
+ **/
+void treeInitCapacity(unsigned int capacity){
+  unsigned int n, i;
+  magazine_t *mag;
+
+  pthread_mutex_lock(&nodeArena.mutex);
+  for(n = 0; nodeArena.chunks && n < (nodeArena.carved + NODES_PER_CHUNK - 1) / NODES_PER_CHUNK; n++)
+    free(nodeArena.chunks[n]);
+  free(nodeArena.chunks);
+  while((mag = nodeArena.full) != NULL){
+    nodeArena.full = mag->next;
+    free(mag);
+  }
+  while((mag = nodeArena.empty) != NULL){
+    nodeArena.empty = mag->next;
+    free(mag);
+  }
+  nodeCapacity = capacity;
+  nodeArena.carved = 0;
+  nodeArena.loose  = NULL;
+  nodeArena.chunks = calloc((capacity + NODES_PER_CHUNK - 1) / NODES_PER_CHUNK, sizeof(tree_node_t *));
+  nodeArena.generation++;
+  pthread_mutex_unlock(&nodeArena.mutex);
+
   /*
-   * Initialize the list of free tree nodes.
+   * Clear the namespace lock state.
    */
-  listInit(&freeNodes);
-  for (n=0; n<MAX_NODES; n++)
-    listAddHead(&freeNodes, &nodes[n].list);
+  for (n=0; n<MAX_NAMESPACE_ID; n++)
+    free(namespaces[n].shards);
+  memset(namespaces, 0, sizeof(namespaces));
+  for (n=0; n<LOCK_NAMESPACE_LIMIT / NAMESPACE_LEAF_SIZE; n++){
+    if(namespaceDirectory[n] == NULL)
+      continue;
+    for (i=0; i<NAMESPACE_LEAF_SIZE; i++){
+      if(namespaceDirectory[n][i] != NULL)
+	free(namespaceDirectory[n][i]->shards);
+      free(namespaceDirectory[n][i]);
+    }
+    free(namespaceDirectory[n]);
+    namespaceDirectory[n] = NULL;
+  }
+  for (n=0; n<MAX_NAMESPACE_ID; n++)
+    pthread_mutex_init(&namespaces[n].mutex, NULL);
+  lockStatsReset();
+}
+
+/**
+ * @brief Initialize the tree data structures with the default capacity of #MAX_NODES.
+ *
+ * @retval N/A
+ **/
+void treeInit(void){
+  treeInitCapacity(MAX_NODES);
 }
 
+/**
+ * @brief Look up a node of the arena by its position
+ *
+ * @param[in] index -- position of the node, 0 to #nodeCapacity - 1
+ *
+ * @retval Pointer to the node, NULL if it has not been carved yet
+ **/
+tree_node_t *lockNodeAt(unsigned int index){
+  tree_node_t *node = NULL;
+  pthread_mutex_lock(&nodeArena.mutex);
+  if(index < nodeArena.carved)
+    node = &nodeArena.chunks[index / NODES_PER_CHUNK][index % NODES_PER_CHUNK];
+  pthread_mutex_unlock(&nodeArena.mutex);
+  return node;
+}
 
 /*
  * @brief Allocate a new tree node
  *
- * This function removes an entry from the head of the freeNodes list.
+ * This function pops a node from the calling thread's loaded magazine,
+ * going to the depot for a full magazine only when both of its magazines
+ * are empty, and for a node #freeNode had no magazine for when the depot
+ * has none.
  *
  * @retval Pointer to a new node if the allocation was successful, NULL if 
- * there are no nodes on the free list
+ * the node capacity is exhausted
  */
 tree_node_t *allocNodes(void){
-  tree_node_t *node = NULL;
-  /*
-   * If the list is not empty we should remove the head item.
-  */
-  if (!listEmpty(&freeNodes))
-    {
-     /*
-      * Get the entry from the head of this list.
-      */
-      node = listGetHead(&freeNodes, tree_node_t);
-
-      /*
-       * Removed it from the list.
-       */
-      listDel(&node->list);
+  node_cache_t *cache = nodeCacheGet();
+  magazine_t *mag;
 
-      allocated++;
-      //printf("%d allocated \n", allocated);
+  if(cache->loaded == NULL || cache->loaded->rounds == 0){
+    if(cache->previous && cache->previous->rounds){
+      mag = cache->loaded;
+      cache->loaded = cache->previous;
+      cache->previous = mag;
     }
-    else
-      printf("Out of nodes!\n");
-
-    return (node);
+    else if((mag = depotGet(1)) != NULL){
+      depotPut(cache->previous);
+      cache->previous = cache->loaded;
+      cache->loaded = mag;
+    }
+    else{
+      tree_node_t *node;
+      pthread_mutex_lock(&nodeArena.mutex);
+      if((node = nodeArena.loose) != NULL){
+	nodeArena.loose = node->child[LEFT];
+	node->child[LEFT] = NULL;
+      }
+      pthread_mutex_unlock(&nodeArena.mutex);
+      if(node == NULL)
+	TRACE_ERROR("Out of nodes!\n");
+      return node;
+    }
+  }
+  return cache->loaded->round[--cache->loaded->rounds];
 }
 
 /**
  * @brief Free a node previously allocated with #allocNode
  * 
- * Add the specified node to the head of #freeNodes list
+ * Push the specified node on the calling thread's loaded magazine, handing
+ * a full magazine to the depot only when both of its magazines are full.
  *
  * @param[in] node Pointer to the tree node to be freed.
  *
  * @retval N/A
  **/
 void freeNode(tree_node_t *node){
+  node_cache_t *cache = nodeCacheGet();
+  magazine_t *mag;
   /**
    * Empty out the fields that we want to free
    *
@@ -115,11 +408,88 @@ void freeNode(tree_node_t *node){
   node->height = 0;
   node->start_lba = -1;
   node->end_lba   = -1;
+  node->state     = LOCK_FREE;
+  node->notify    = LOCK_NOTIFY_WAKE;
+  node->shardHead = node->shardNext = NULL;
+  __atomic_store_n(&node->generation, node->generation + 1, __ATOMIC_RELEASE);
   listInit(&node->list);
-  listAddTail(&freeNodes, &node->list);
-  allocated--;
-  //printf("%d allocated \n", allocated);
+
+  if(cache->loaded == NULL || cache->loaded->rounds == MAGAZINE_SIZE){
+    if(cache->previous && cache->previous->rounds == 0){
+      mag = cache->loaded;
+      cache->loaded = cache->previous;
+      cache->previous = mag;
+    }
+    else if((mag = depotGet(0)) != NULL){
+      depotPut(cache->previous);
+      cache->previous = cache->loaded;
+      cache->loaded = mag;
+    }
+    else{
+      /*
+       * no magazine to put it in: park it in the depot for #allocNodes
+       */
+      pthread_mutex_lock(&nodeArena.mutex);
+      node->child[LEFT] = nodeArena.loose;
+      nodeArena.loose = node;
+      pthread_mutex_unlock(&nodeArena.mutex);
+      return;
+    }
+  }
+  cache->loaded->round[cache->loaded->rounds++] = node;
+}
+/**
+ * @brief Recompute the subtree span of a node from its own group and children
+ *
+ * The group of a tree node is the node itself plus every lock queued on its
+ * pending list; the span is the hull of the group and both child spans.
+ * The pending list is summed up by its cached hull, so this is O(1).
+ *
+ * @param[in] node -- the node whose span is recomputed
+ *
+ * @retval N/A
+ **/
+static void updateSpan(tree_node_t *node){
+  unsigned int lo = node->start_lba;
+  unsigned int hi = node->end_lba;
+
+  if(!listEmpty(&node->pendingList)){
+    lo = MIN(lo, node->pending_start_lba);
+    hi = MAX(hi, node->pending_end_lba);
+  }
+  if(node->child[LEFT]){
+    lo = MIN(lo, node->child[LEFT]->min_start_lba);
+    hi = MAX(hi, node->child[LEFT]->max_end_lba);
+  }
+  if(node->child[RIGHT]){
+    lo = MIN(lo, node->child[RIGHT]->min_start_lba);
+    hi = MAX(hi, node->child[RIGHT]->max_end_lba);
+  }
+  node->min_start_lba = lo;
+  node->max_end_lba   = hi;
+}
+
+/**
+ * @brief Widen the spans from node up to the root to cover [start, end]
+ *
+ * Used when a lock is queued on node's pending list; unlike #updateSpan it
+ * never has to look at the pending lists on the way up.
+ *
+ * @param[in] node  -- the tree node that gained a pending lock
+ * @param[in] start -- start LBA of the queued lock
+ * @param[in] end   -- end LBA of the queued lock
+ *
+ * @retval N/A
+ **/
+static void widenSpan(tree_node_t *node, unsigned int start, unsigned int end){
+  for(; node; node = node->parent){
+    if(node->min_start_lba <= start && node->max_end_lba >= end)
+      break;
+    node->min_start_lba = MIN(node->min_start_lba, start);
+    node->max_end_lba   = MAX(node->max_end_lba, end);
+  }
 }
+
 /**
  * @brief Perform a rotation
  *
@@ -160,6 +530,12 @@ tree_node_t *rotateNode(tree_node_t **treeRoot, tree_node_t *subTreeRoot, int di
      **/
     subTreeRoot->height = MAX(height(subTreeRoot->child[LEFT]), height(subTreeRoot->child[RIGHT])) + 1;
     pivot->height = MAX(height(pivot->child[LEFT]), height(pivot->child[RIGHT])) + 1;
+
+    /**
+     * the pivot now covers what the old subtree root covered
+     **/
+    updateSpan(subTreeRoot);
+    updateSpan(pivot);
     
     /*
      * check for a new tree root
@@ -187,24 +563,18 @@ tree_node_t *rotateDouble(tree_node_t **treeRoot, tree_node_t *subTreeRoot, int
 /**
  *
  * This function traverses the tree from newNode to the root updating the
- * height factors for each node along the way. If the height of the left and
- * the right branches of the nodes are different by 2 or more, a rotation takes 
- * place to rebalance the tree
+ * height factors and the subtree spans for each node along the way. If the
+ * height of the left and the right branches of the nodes are different by 2
+ * or more, a rotation takes place to rebalance the tree. The walk always
+ * reaches the root since removals may need more than one rotation and the
+ * spans of every ancestor may have changed.
  **/
 void rebalance(tree_node_t **root, tree_node_t *newNode){
-  int val;
-  
   /*
    * Update the height factor ...
    */
   for(; newNode; newNode = newNode->parent){
-    /*
-     * If the balance has not changed from this point we can stop
-     */
-    if( (val = MAX(height(newNode->child[LEFT]), height(newNode->child[RIGHT])) + 1) == newNode->height)
-      break;
-   
-    newNode->height = val;
+    newNode->height = MAX(height(newNode->child[LEFT]), height(newNode->child[RIGHT])) + 1;
     
     /*
      * Right path is longer than the left path
@@ -217,59 +587,212 @@ void rebalance(tree_node_t **root, tree_node_t *newNode){
 	newNode = rotateNode(root, newNode, LEFT);
       else
 	newNode = rotateDouble(root, newNode, LEFT);
-      
-      break;
     }
     else if((height(newNode->child[RIGHT])) - height(newNode->child[LEFT]) <= -2){
       if(height(newNode->child[LEFT]->child[RIGHT]) <= height(newNode->child[LEFT]->child[LEFT]))
 	newNode = rotateNode(root, newNode, RIGHT);
       else
 	newNode = rotateDouble(root, newNode, RIGHT);
-      break;
     }
+    else
+      updateSpan(newNode);
   }
 }
 
 /**
- * @brief  insert elem into the head in the order of event index
+ * @brief Rebalance after newNode was linked in as a leaf
  *
- * @param[in] head -- the link list head 
- * @param[in] elem -- the elem to insert
+ * Unlike #rebalance the walk stops as soon as a subtree keeps its height:
+ * an AVL insertion needs at most one (double) rotation, and above that
+ * point the spans only have to grow to cover the new leaf.
+ *
+ * @param[in] root    -- Pointer to the root pointer
+ * @param[in] newNode -- the new leaf
  *
  * @retval N/A
  **/
+static void rebalanceInsert(tree_node_t **root, tree_node_t *newNode){
+  tree_node_t *iter;
 
-static inline void listAddInorder(tree_node_t *head, tree_node_t *elem){
-  tree_node_t *iter = head;
-  tree_node_t *prev = NULL;
-  if(listEmpty(&head->pendingList)){
-    head->pendingList.next = &elem->list;
-    elem->list.prev        = &head->pendingList;
+  for(iter = newNode->parent; iter; iter = iter->parent){
+    signed char oldHeight = iter->height;
+    int balance = height(iter->child[RIGHT]) - height(iter->child[LEFT]);
 
-    elem->list.next        = &head->pendingList;
-    head->pendingList.prev = &elem->list;
-    return;
+    if(balance >= 2 || balance <= -2){
+      int direction = balance >= 2 ? LEFT : RIGHT;
+      tree_node_t *child = iter->child[!direction];
+      if(height(child->child[!direction]) >= height(child->child[direction]))
+	iter = rotateNode(root, iter, direction);
+      else
+	iter = rotateDouble(root, iter, direction);
+      break;
+    }
+    iter->height        = MAX(height(iter->child[LEFT]), height(iter->child[RIGHT])) + 1;
+    iter->min_start_lba = MIN(iter->min_start_lba, newNode->start_lba);
+    iter->max_end_lba   = MAX(iter->max_end_lba, newNode->end_lba);
+    if(iter->height == oldHeight)
+      break;
+  }
+  if(iter)
+    widenSpan(iter->parent, newNode->start_lba, newNode->end_lba);
+}
+
+/**
+ * @brief Grow the cached hull of the pending list of head to cover elem
+ **/
+static inline void pendingHull(tree_node_t *head, tree_node_t *elem){
+  if(listEmpty(&head->pendingList)){
+    head->pending_start_lba = elem->start_lba;
+    head->pending_end_lba   = elem->end_lba;
+    head->pending_writes    = 0;
   }
   else{
-      prev = iter;
-      iter = listGetHead(&iter->list, tree_node_t);
-      
-      if(iter->eventIndex > elem->eventIndex){
-	listAddTail(&iter->list, &elem->list);
-	return;
-      }
+    head->pending_start_lba = MIN(head->pending_start_lba, elem->start_lba);
+    head->pending_end_lba   = MAX(head->pending_end_lba, elem->end_lba);
+  }
+  head->pending_writes |= elem->type;
+}
+
+/**
+ * @brief Queue elem on the pending list of head in the order of event index
+ *
+ * Event indices are handed out in arrival order under the namespace mutex,
+ * so a new request always goes to the tail in O(1). Only a lock moved off
+ * the list of a released node can be older than the tail; it is placed by
+ * walking back from the tail. The cached hull of the list grows to cover elem.
+ *
+ * @param[in] head -- the granted node owning the pending list
+ * @param[in] elem -- the elem to insert
+ *
+ * @retval N/A
+ **/
+static inline void listAddInorder(tree_node_t *head, tree_node_t *elem){
+  tree_node_t *iter = (tree_node_t *) head->pendingList.prev;
+
+  pendingHull(head, elem);
+  while(iter != head && iter->eventIndex > elem->eventIndex)
+    iter = (tree_node_t *) iter->list.prev;
+  listAddHead(&iter->list, &elem->list);
+}
+
+/**
+ * @brief Queue elem on the pending list of head, searching forward from a node known to be older
+ *
+ * @param[in] head  -- the granted node owning the pending list
+ * @param[in] after -- head or a node on its list that arrived before elem
+ * @param[in] elem  -- the elem to insert
+ *
+ * @retval N/A
+ **/
+static inline void listAddAfter(tree_node_t *head, tree_node_t *after, tree_node_t *elem){
+  tree_node_t *next;
+
+  pendingHull(head, elem);
+  while((next = listGetHead(&after->list, tree_node_t)) != head && next->eventIndex < elem->eventIndex)
+    after = next;
+  listAddHead(&after->list, &elem->list);
+}
+
+/**
+ * @brief Test whether a lock range overlaps a subtree span
+ **/
+#define spanOverlap(node, lock) ((lock)->start_lba <= (node)->max_end_lba && (lock)->end_lba >= (node)->min_start_lba)
+
+/**
+ * @brief Test whether a held or queued lock blocks a new request
+ *
+ * Overlapping locks are compatible when both are reads. A queued lock only
+ * blocks requests that arrived after it, so a lock moved out of a pending
+ * list never waits behind younger requests.
+ *
+ * @param[in] lock    -- the held or queued lock
+ * @param[in] queued  -- set if lock is on a pending list
+ * @param[in] newNode -- the lock being requested
+ *
+ * @retval 1 -- the request has to wait for lock
+ * @retval 0 -- the request can be granted alongside lock
+ **/
+static inline int lockBlocks(tree_node_t *lock, int queued, tree_node_t *newNode){
+  if(newNode->start_lba > lock->end_lba || newNode->end_lba < lock->start_lba)
+    return 0;
+  if(!lock->type && !newNode->type)
+    return 0;
+  return !queued || lock->eventIndex < newNode->eventIndex;
+}
 
-      while(iter != head && iter->eventIndex < elem->eventIndex){
-	prev = iter;
-	iter = listGetHead(&iter->list, tree_node_t);	
+/**
+ * @brief Test whether any lock on the pending list of node could block a request
+ *
+ * Checks the cached hull of the list instead of its members: a request
+ * outside the hull, or a read when only reads are queued, skips the list.
+ **/
+#define pendingMayBlock(node, lock) (!listEmpty(&(node)->pendingList) &&	\
+				     (lock)->start_lba <= (node)->pending_end_lba && \
+				     (lock)->end_lba >= (node)->pending_start_lba && \
+				     ((lock)->type || (node)->pending_writes))
+
+/**
+ * @brief Find a tree node whose group collides with the new lock
+ *
+ * Walks the interval tree in order and skips every subtree whose span can not
+ * overlap the request, so the search costs O(log n + k) for k candidates.
+ *
+ * @param[in] iter    -- root of the subtree to search
+ * @param[in] newNode -- the lock being requested
+ *
+ * @retval Pointer to the tree node owning the colliding group, NULL if the range can be granted
+ **/
+static tree_node_t *findCollision(tree_node_t *iter, tree_node_t *newNode){
+  tree_node_t *pnode;
+  
+  while(iter != NULL && spanOverlap(iter, newNode)){
+    if(iter->child[LEFT] && spanOverlap(iter->child[LEFT], newNode)){
+      if((pnode = findCollision(iter->child[LEFT], newNode)) != NULL)
+	return pnode;
+    }
+    /*
+     * Check the node in the tree and all of its pending list
+     */
+    if(iter->state == LOCK_GRANTED && lockBlocks(iter, 0, newNode))
+      return iter;
+    if(pendingMayBlock(iter, newNode)){
+      for(pnode = listGetHead(&iter->pendingList, tree_node_t); pnode != iter; pnode = listGetHead(&pnode->list, tree_node_t)){
+	if(lockBlocks(pnode, 1, newNode))
+	  return iter;
       }
-      
-      prev->list.next = &elem->list;
-      elem->list.prev = &prev->list;
-      
-      iter->list.prev = &elem->list;
-      elem->list.next = &iter->list;
-  }  
+    }
+    iter = iter->child[RIGHT];
+  }
+  return NULL;
+}
+
+/**
+ * @brief Link a granted node into the tree at its key and rebalance
+ *
+ * The caller has made sure nothing in the tree collides with the node.
+ *
+ * @param[in] root    -- Pointer to the root pointer
+ * @param[in] newNode -- the node, its children, height and span already reset
+ *
+ * @retval N/A
+ **/
+static void treeAdd(tree_node_t **root, tree_node_t *newNode){
+  unsigned int direction = LEFT;
+  tree_node_t *prev = NULL;
+  tree_node_t *iter;
+
+  for(iter = *root; iter != NULL; iter = iter->child[direction]){
+    prev = iter;
+    direction = (newNode->start_lba > iter->start_lba) ? RIGHT : LEFT;
+  }
+  newNode->parent = prev;
+  if(prev){
+    prev->child[direction] = newNode;
+    rebalanceInsert(root, newNode);
+  }
+  else
+    *root = newNode;
+  newNode->state = LOCK_GRANTED;
 }
 
 /**
@@ -288,63 +811,40 @@ static inline void listAddInorder(tree_node_t *head, tree_node_t *elem){
  */
 
 enum NODE_INSERT_RESULT insertNode(tree_node_t **root, tree_node_t *newNode, unsigned int canQueue){ 
+  newNode->child[LEFT] = newNode->child[RIGHT] = NULL;
+  newNode->height        = 0;
+  newNode->min_start_lba = newNode->start_lba;
+  newNode->max_end_lba   = newNode->end_lba;
+
   if(*root != NULL){
-    unsigned int direction;
     tree_node_t *prev = NULL;
-    tree_node_t *iter = *root;
-    while(iter != NULL){
-      prev = iter;
-      /*
-       * Range check against the node in the tree and all of its pending list
-       */
-      do{
-	/*
-	 * check for collision
-	 */
-	if(newNode->start_lba <= iter->end_lba && newNode->end_lba >= iter->start_lba){
-	  if(canQueue){
-	    /*
-	     * insert the node to the pending list in the order of event index
-	     */	 
-	    listAddInorder(prev, newNode);
-	    printf("NODE_QUEUED\n");
-	    return (NODE_QUEUED);
-	  }
-	  else{
-	    /*
-	     * If there is a collision and we can not queue, we return NODE_COLISION
-	     */
-	    printf("NODE_COLLISION\n");
-	    return (NODE_COLLISION);
-	  }
-	}
-      }while((iter = listGetHead(&iter->list, tree_node_t)) != prev);
-      /*
-       * If we got there, there were no collisions, just need to
-       * to decide which branch of the tree to take.
-       */
-      if(newNode->start_lba > iter->start_lba){
-	iter = iter->child[RIGHT];
-	direction = RIGHT;
+
+    /*
+     * check for collision anywhere in the tree, not just on the insertion path
+     */
+    if((prev = findCollision(*root, newNode)) != NULL){
+      if(canQueue){
+	/*
+	 * insert the node to the pending list in the order of event index
+	 */
+	listAddInorder(prev, newNode);
+	widenSpan(prev, newNode->start_lba, newNode->end_lba);
+	newNode->state = LOCK_QUEUED;
+	TRACE_DEBUG("NODE_QUEUED\n");
+	return (NODE_QUEUED);
       }
       else{
-	iter = iter->child[LEFT];
-	direction = LEFT;
+	/*
+	 * If there is a collision and we can not queue, we return NODE_COLISION
+	 */
+	TRACE_DEBUG("NODE_COLLISION\n");
+	return (NODE_COLLISION);
       }
     }
-    /*
-     *Add the new node to the tree
-     */
-    prev->child[direction] = newNode;
-    newNode->parent = prev;
-    
-    /*see if the tree needs to be rebalanced.*/
-    rebalance(root, prev);
   }
-  else
-    *root = newNode;
-  
-  printf("NODE_ADDED \n");
+  treeAdd(root, newNode);
+
+  TRACE_DEBUG("NODE_ADDED \n");
   return NODE_ADDED;
 }
 
@@ -364,19 +864,43 @@ static tree_node_t *predecessor(tree_node_t *node){
 }
 
 
+/**
+ * @brief Point the parent of node (or the root) at a replacement subtree
+ *
+ * @param[in] root    -- Pointer to the root node pointer
+ * @param[in] node    -- the node being unlinked
+ * @param[in] replace -- the subtree taking its place, may be NULL
+ *
+ * @retval N/A
+ **/
+static void replaceChild(tree_node_t **root, tree_node_t *node, tree_node_t *replace){
+  int side;
+  if(node->parent){
+    side = (node->parent->child[RIGHT] == node);
+    node->parent->child[side] = replace;
+  }
+  else
+    *root = replace;
+  if(replace)
+    replace->parent = node->parent;
+}
+
 /**
  * @brief Remove a node from the tree
  * 
+ * The heights and spans are repaired from the lowest changed node up to the
+ * root, rotating where the removal left a subtree out of balance.
+ *
  * @param[in] root -- Pointer to the root node pointer
  * @param[in] node -- Pointer to the node to be removed
  * 
  * @retval N/A
  */
 void removeNode(tree_node_t **root, tree_node_t *node){
-  int side;
+  tree_node_t *fix;
   if(node->child[LEFT] && node->child[RIGHT]) //both children
     {
-      printf("delete case 1 with both children\n");
+      TRACE_DEBUG("delete case 1 with both children\n");
       tree_node_t *replace;
       
       /*
@@ -385,70 +909,53 @@ void removeNode(tree_node_t **root, tree_node_t *node){
       replace = predecessor(node);
       
       /*
-      * remove the predecessor from the tree
+      * unlink the predecessor, it has no right child
       */
-      removeNode(root, replace);
+      if(replace->parent != node){
+	fix = replace->parent;
+	if((fix->child[RIGHT] = replace->child[LEFT]) != NULL)
+	  fix->child[RIGHT]->parent = fix;
+	replace->child[LEFT] = node->child[LEFT];
+	replace->child[LEFT]->parent = replace;
+      }
+      else
+	fix = replace;
       
       /*
-       * update children and parent
+       * the predecessor takes over the children and parent of node
        */
-      if(replace->child[LEFT] = node->child[LEFT])
-	replace->child[LEFT]->parent = replace;
-     
       replace->child[RIGHT] = node->child[RIGHT];
       replace->child[RIGHT]->parent = replace;
-      
-      /*
-       * If we have a parent, point it to the replacement node.
-       * If we do not have a parent we must be the root
-       */
-      if(replace->parent = node->parent){
-	side = (node->parent->child[RIGHT] == node);
-	node->parent->child[side] = replace;
-      }
-      *root = replace;
-      
+      replaceChild(root, node, replace);
       replace->height = node->height;
     }
   else if(node->child[LEFT]) //only a left child
     {
-      printf("delete case 2 with left child\n");
-      if(node != *root){
-	side = (node->parent->child[RIGHT] == node);
-	node->parent->child[side] = node->child[LEFT];
-	node->child[LEFT]->parent = node->parent;
-      }
-      else{
-	*root = node->child[LEFT];
-	(*root)->parent = NULL;
-      }
+      TRACE_DEBUG("delete case 2 with left child\n");
+      fix = node->parent;
+      replaceChild(root, node, node->child[LEFT]);
     }
   else if(node->child[RIGHT]) //only a right child
     {
-      printf("delete case 3 with right child\n");
-      if(node != *root){
-	side = (node->parent->child[RIGHT] == node);
-	node->parent->child[side] = node->child[RIGHT];
-	node->child[RIGHT]->parent = node->parent;
-      }
-      else{
-	*root = node->child[RIGHT];
-	(*root)->parent = NULL;
-      }
+      TRACE_DEBUG("delete case 3 with right child\n");
+      fix = node->parent;
+      replaceChild(root, node, node->child[RIGHT]);
     }
   else
     {
-      printf("delete case 4 no children ");
+      TRACE_DEBUG("delete case 4 no children ");
       if(node != *root){
-	printf("not root\n");
-	side = (node->parent->child[RIGHT] == node);
-	node->parent->child[side] = NULL;
+	TRACE_DEBUG("not root\n");
       }
       else{
-	printf("  root\n");
-	*root = NULL;
+	TRACE_DEBUG("  root\n");
       }
+      fix = node->parent;
+      replaceChild(root, node, NULL);
     }
+
+  node->child[LEFT] = node->child[RIGHT] = node->parent = NULL;
+  rebalance(root, fix);
 }
 
 
@@ -461,7 +968,7 @@ void treeDump(tree_node_t *root){
   if(root == NULL)
     return;
   else{
-    printf("Index %d, range[ %d -- %d ], height %d, W(%d) \n", root->eventIndex, root->start_lba, root->end_lba, root->height, root->type); 
+    printf("Index %llu, range[ %d -- %d ], span[ %d -- %d ], height %d, W(%d) \n", root->eventIndex, root->start_lba, root->end_lba, root->min_start_lba, root->max_end_lba, root->height, root->type); 
     
     // each pending
     if (!listEmpty(&root->pendingList)) {
@@ -469,7 +976,7 @@ void treeDump(tree_node_t *root){
         tree_node_t *snode = root;
 	printf("Pending list\n");
         do{
-	  printf("Index %2d, range[ %2d -- %2d ], height %d, W(%2d) \n", pnode->eventIndex, pnode->start_lba, pnode->end_lba, pnode->height, pnode->type); 
+	  printf("Index %2llu, range[ %2d -- %2d ], height %d, W(%2d) \n", pnode->eventIndex, pnode->start_lba, pnode->end_lba, pnode->height, pnode->type); 
             pnode = (tree_node_t *) pnode->pendingList.next;
         }while (snode != pnode);
 	printf("\n");
@@ -486,102 +993,190 @@ void treeDump(tree_node_t *root){
 }
 
 /**
- * @rief update and sum are two routines of binary index tree.
- *        More details of it can be found in https://en.wikipedia.org/wiki/Fenwick_tree
+ * @brief Take the mutex of a namespace, counting contended acquisitions
  *
- * @param[in]: l -- the location we want to upate value
- * @param[in]: v -- the value we want to add
- * 
- * @retval: N/A
- */
-void update(unsigned int l, unsigned int v){
-  while(l <= MAX_NODES){
-    tree_array[l] += v;
-    
-    l             += lowbit(l);
+ * @param[in] ns -- the namespace to lock
+ *
+ * @retval N/A
+ **/
+static inline void namespaceLock(lock_namespace_t *ns){
+  if(pthread_mutex_trylock(&ns->mutex) != 0){
+    __atomic_fetch_add(&ns->contended, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&ns->mutex);
   }
 }
 
-/** 
- * @brief: the sum routine of binary index tree.
+/**
+ * @brief Drop the mutex of a namespace
  *
- * @paran[in]: l -- indicates the s
- * 
- * @retval: return sum of array[1.... l]
- */
-unsigned int sum(unsigned int l){
-  unsigned int ret = 0;
-  while(l>0){
-    ret += tree_array[l];
-    l   -= lowbit(l);
-  }
-  return ret;
+ * @param[in] ns -- the namespace locked by #namespaceLock
+ *
+ * @retval N/A
+ **/
+static inline void namespaceUnlock(lock_namespace_t *ns){
+  pthread_mutex_unlock(&ns->mutex);
+}
+
+/**
+ * @brief Start a rewrite of the tree of a locked namespace, making its sequence count odd
+ *
+ * Only what changes the granted locks a #probeRange can see goes between
+ * #treeWriteBegin and #treeWriteEnd: adding, removing and replacing tree
+ * nodes. Searching the tree and queueing a request behind a held lock
+ * leave the count alone, so probes are not spoiled for the whole time the
+ * mutex is held.
+ *
+ * @param[in] ns -- the namespace, its mutex held
+ **/
+static inline void treeWriteBegin(lock_namespace_t *ns){
+  __atomic_store_n(&ns->seq, ns->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * @brief End a rewrite started by #treeWriteBegin
+ **/
+static inline void treeWriteEnd(lock_namespace_t *ns){
+  __atomic_store_n(&ns->seq, ns->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Shard of a namespace holding an LBA, the last shard runs to the end of the LBA space
+ **/
+static inline unsigned int shardIndex(const lock_namespace_t *ns, unsigned int lba){
+  return ns->shardCount > 1 ? MIN(lba >> ns->shardShift, ns->shardCount - 1) : 0;
+}
+
+/**
+ * @brief Look up a shard of a namespace, shard 0 is the namespace itself
+ **/
+static inline lock_namespace_t *shardAt(lock_namespace_t *ns, unsigned int shard){
+  return shard ? &ns->shards[shard - 1] : ns;
 }
 
+/**
+ * @brief Test whether no shard of a namespace holds or queues a lock
+ **/
+static int namespaceIdle(lock_namespace_t *ns){
+  unsigned int n;
+  for(n = 0; n < MAX(ns->shardCount, 1); n++)
+    if(shardAt(ns, n)->root != NULL)
+      return 0;
+  return 1;
+}
 
 /**
- * @brief process the event index overflow problem by updating event index of the AVL tree
+ * @brief Split the LBA space of a namespace into shards
  *
- * @param[in]  root        --- root node of AVL tree
+ * Shard k covers the LBAs from k << shardShift on, the last one everything
+ * up to the end of the LBA space. Each shard has its own tree, pending
+ * lists, event index and mutex, so requests within different shards of one
+ * namespace lock in parallel; a request across shards is split into a
+ * piece per shard, see #requestSplit. Statistics and traces stay per
+ * namespace.
  *
+ * Only call it while the namespace holds no locks and no other thread uses
+ * it. #treeInitCapacity drops the shards again.
  *
- * @retval    N/A
+ * @param[in] namespaceID -- the namespace
+ * @param[in] shardCount  -- number of shards, 1 to #LOCK_SHARDS_MAX, 1 merges the namespace again
+ * @param[in] shardShift  -- log2 of the LBAs a shard covers
+ *
+ * @retval 0  -- the namespace is split
+ * @retval -1 -- a bad namespace or shard layout, locks are held, or out of memory
  **/
-void updateIndex(tree_node_t *root){
-  if(root == NULL)
-    return;
+int lockNamespaceShards(unsigned int namespaceID, unsigned int shardCount, unsigned int shardShift){
+  lock_namespace_t *ns, *shards = NULL;
+  unsigned int n;
 
-  /*update the event index of the root*/
-  root->eventIndex = sum(root->eventIndex) ;
-  
-  /*update the event indices of root pending list*/
-  if(!listEmpty(&root->pendingList)){
-    tree_node_t *pnode = listGetHead(&root->pendingList, tree_node_t);
-    tree_node_t *snode = root;
-    do{
-      pnode->eventIndex = sum(pnode->eventIndex) ;
-      pnode = (tree_node_t *)pnode->pendingList.next;
-    }while(snode != pnode);
+  if((ns = namespaceGet(namespaceID)) == NULL || shardCount == 0 || shardCount > LOCK_SHARDS_MAX || shardShift >= 32 ||
+     ((unsigned long long) (shardCount - 1) << shardShift) > UINT_MAX || !namespaceIdle(ns))
+    return -1;
+  if(shardCount > 1){
+    if((shards = aligned_alloc(CACHE_LINE_SIZE, (shardCount - 1) * sizeof(lock_namespace_t))) == NULL)
+      return -1;
+    memset(shards, 0, (shardCount - 1) * sizeof(lock_namespace_t));
+    for(n = 0; n < shardCount - 1; n++)
+      pthread_mutex_init(&shards[n].mutex, NULL);
   }
-  
-  /*left children*/
-  if(root->child[LEFT])
-    updateIndex(root->child[LEFT]);
-  /*right children*/
-  if(root->child[RIGHT])
-    updateIndex(root->child[RIGHT]);
+  free(ns->shards);
+  ns->shards     = shards;
+  ns->shardCount = shardCount;
+  ns->shardShift = shardShift;
+  return 0;
 }
 
 /**
- * @brief: from the AVL tree, obtain the event index maker in tree_array
+ * @brief Create a namespace past #MAX_NAMESPACE_ID at run time
  *
- * @param[in] root --- AVL tree node
+ * Lookups of other namespaces go on while it is attached.
  *
- * @retval N/A
+ * @param[in] namespaceID -- #MAX_NAMESPACE_ID to #LOCK_NAMESPACE_LIMIT - 1
+ *
+ * @retval 0  -- the namespace takes requests
+ * @retval -1 -- the ID is out of range or attached already, or out of memory
  **/
+int lockNamespaceAttach(unsigned int namespaceID){
+  lock_namespace_t **leaf, *ns;
+  unsigned int top = namespaceID >> NAMESPACE_LEAF_BITS;
+  int ret = -1;
+
+  if(namespaceID < MAX_NAMESPACE_ID || namespaceID >= LOCK_NAMESPACE_LIMIT)
+    return -1;
+  pthread_mutex_lock(&namespaceDirectoryLock);
+  if((leaf = namespaceDirectory[top]) == NULL &&
+     (leaf = aligned_alloc(CACHE_LINE_SIZE, NAMESPACE_LEAF_SIZE * sizeof(lock_namespace_t *))) != NULL){
+    memset(leaf, 0, NAMESPACE_LEAF_SIZE * sizeof(lock_namespace_t *));
+    __atomic_store_n(&namespaceDirectory[top], leaf, __ATOMIC_RELEASE);
+  }
+  if(leaf && leaf[namespaceID & (NAMESPACE_LEAF_SIZE - 1)] == NULL &&
+     (ns = aligned_alloc(CACHE_LINE_SIZE, sizeof(lock_namespace_t))) != NULL){
+    memset(ns, 0, sizeof(lock_namespace_t));
+    pthread_mutex_init(&ns->mutex, NULL);
+    __atomic_store_n(&leaf[namespaceID & (NAMESPACE_LEAF_SIZE - 1)], ns, __ATOMIC_RELEASE);
+    ret = 0;
+  }
+  pthread_mutex_unlock(&namespaceDirectoryLock);
+  return ret;
+}
 
-void obtainEventInexMarker(tree_node_t *root){ 
-  if(root == NULL) {  return;}
-  /*root node*/
-  update(root->eventIndex, 1);
+/**
+ * @brief Delete a namespace attached with #lockNamespaceAttach
+ *
+ * Only call it once no thread uses the namespace any more; other
+ * namespaces are not disturbed.
+ *
+ * @param[in] namespaceID -- the namespace
+ *
+ * @retval 0  -- the namespace is gone, requests to it fail
+ * @retval -1 -- it is not attached, or still holds locks
+ **/
+int lockNamespaceDetach(unsigned int namespaceID){
+  lock_namespace_t *ns;
 
-  /*deal with the pending list*/
-  if(!listEmpty(&root->pendingList)){
-    tree_node_t *pnode = listGetHead(&root->pendingList, tree_node_t);
-    tree_node_t *snode = root;
-    do{
-      update(pnode->eventIndex, 1);
-      pnode = (tree_node_t *)pnode->pendingList.next;
-    }while(snode != pnode);
+  if(namespaceID < MAX_NAMESPACE_ID)
+    return -1;
+  pthread_mutex_lock(&namespaceDirectoryLock);
+  if((ns = namespaceGet(namespaceID)) == NULL || !namespaceIdle(ns)){
+    pthread_mutex_unlock(&namespaceDirectoryLock);
+    return -1;
   }
+  __atomic_store_n(&namespaceDirectory[namespaceID >> NAMESPACE_LEAF_BITS][namespaceID & (NAMESPACE_LEAF_SIZE - 1)], NULL,
+		   __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&namespaceDirectoryLock);
+  pthread_mutex_destroy(&ns->mutex);
+  free(ns->shards);
+  free(ns);
+  return 0;
+}
 
-  /*left children*/
-  if(root->child[LEFT])
-    obtainEventInexMarker(root->child[LEFT]);
-  
-  /*right children*/
-  if(root->child[RIGHT])
-    obtainEventInexMarker(root->child[RIGHT]);
+/**
+ * @brief Look up the lock state of a namespace
+ *
+ * @retval Pointer to the namespace, NULL if it is not attached
+ **/
+lock_namespace_t *lockNamespaceGet(unsigned int namespaceID){
+  return namespaceGet(namespaceID);
 }
 
 /**
@@ -620,6 +1215,12 @@ int isInAVL(tree_node_t *root, tree_node_t *node){
     while(iter != NULL){
       if(comNode(iter, node))
 	 return 1;
+
+      /*
+       * shared locks may share a start LBA and rotations can leave them on either side
+       */
+      if(iter->start_lba == node->start_lba && isInAVL(iter->child[RIGHT], node))
+	return 1;
     
       if(iter->start_lba < node->start_lba)
 	iter = iter->child[RIGHT];
@@ -632,13 +1233,201 @@ int isInAVL(tree_node_t *root, tree_node_t *node){
     return 0;
 }
 
+/**
+ * @brief Insert a request whose range crosses shards, one piece per shard
+ *
+ * node becomes the piece in the first shard, the others come from the
+ * arena. The shard mutexes are taken in ascending order and held until
+ * every piece is in, like the namespaces of #lockRequestBatch, so of two
+ * requests one is older than the other in every shard they share and
+ * neither can hold a piece the other waits for. The first piece counts the
+ * pieces still queued; the request is granted, and its grant announced,
+ * once the count drops to 0.
+ *
+ * @param[in] ns -- the split namespace
+ *
+ * @retval The insertion result, the caller frees node on NODE_COLLISION and NODE_FAILED
+ **/
+static enum NODE_INSERT_RESULT requestSplit(lock_namespace_t *ns, tree_node_t *node, unsigned queue, unsigned int namespaceID, lock_handle_t *handle){
+  unsigned int first = shardIndex(ns, node->start_lba), count = shardIndex(ns, node->end_lba) - first + 1;
+  unsigned int end_lba = node->end_lba, n, queued = 0;
+  tree_node_t *piece[LOCK_SHARDS_MAX], *blocker[LOCK_SHARDS_MAX];
+
+  piece[0] = node;
+  for(n = 1; n < count; n++){
+    if((piece[n] = allocNodes()) == NULL){
+      while(--n > 0)
+	freeNode(piece[n]);
+      STATS_COUNT(namespaceID, failed);
+      return NODE_FAILED;
+    }
+  }
+  for(n = 0; n < count; n++){
+    piece[n]->start_lba     = n ? (first + n) << ns->shardShift : node->start_lba;
+    piece[n]->end_lba       = n < count - 1 ? ((first + n + 1) << ns->shardShift) - 1 : end_lba;
+    piece[n]->min_start_lba = piece[n]->start_lba;
+    piece[n]->max_end_lba   = piece[n]->end_lba;
+    piece[n]->type          = node->type;
+    piece[n]->timestamp     = node->timestamp;
+    piece[n]->height        = 0;
+    piece[n]->child[LEFT]   = piece[n]->child[RIGHT] = NULL;
+    piece[n]->namespaceID   = namespaceID;
+    piece[n]->shardHead     = node;
+    piece[n]->shardNext     = n < count - 1 ? piece[n + 1] : NULL;
+  }
+
+  for(n = 0; n < count; n++){
+    lock_namespace_t *shard = shardAt(ns, first + n);
+    namespaceLock(shard);
+    piece[n]->eventIndex = ++shard->next_index;
+    queued += (blocker[n] = findCollision(shard->root, piece[n])) != NULL;
+  }
+  if(!queued || queue){
+    __atomic_store_n(&node->shardWaits, queued, __ATOMIC_RELAXED);
+    for(n = 0; n < count; n++){
+      if(blocker[n]){
+	listAddInorder(blocker[n], piece[n]);
+	widenSpan(blocker[n], piece[n]->start_lba, piece[n]->end_lba);
+	piece[n]->state = LOCK_QUEUED;
+      }
+      else{
+	lock_namespace_t *shard = shardAt(ns, first + n);
+	treeWriteBegin(shard);
+	treeAdd(&shard->root, piece[n]);
+	treeWriteEnd(shard);
+      }
+    }
+    if(handle){
+      handle->node        = node;
+      handle->generation  = node->generation;
+      handle->namespaceID = namespaceID;
+    }
+  }
+  for(n = 0; n < count; n++)
+    TRACE_RING(LOCK_OP_REQUEST, namespaceID, piece[n]->start_lba, piece[n]->end_lba, piece[n]->eventIndex,
+	       blocker[n] ? (queue ? NODE_QUEUED : NODE_COLLISION) : (queued && !queue ? NODE_COLLISION : NODE_ADDED));
+  for(n = count; n-- > 0; )
+    namespaceUnlock(shardAt(ns, first + n));
+
+  if(queued && !queue){
+    for(n = 1; n < count; n++)
+      freeNode(piece[n]);
+    node->shardHead = node->shardNext = NULL;
+    STATS_COUNT(namespaceID, collisions);
+    return NODE_COLLISION;
+  }
+  if(queued){
+    STATS_COUNT(namespaceID, queued);
+    return NODE_QUEUED;
+  }
+  STATS_COUNT(namespaceID, added);
+  return NODE_ADDED;
+}
+
+/**
+ * @brief Insert a prepared node into its namespace, see #lockRequest
+ *
+ * The handle is filled in and the request traced before the mutex is
+ * dropped, since a release in another thread may grant a queued node and
+ * hand it on at once; for the same reason the node is not read after the
+ * unlock. Only the shard of the range is locked, a range across shards
+ * goes to #requestSplit.
+ *
+ * @retval The insertion result, the caller frees the node of a NODE_COLLISION or NODE_FAILED
+ **/
+static enum NODE_INSERT_RESULT requestNode(tree_node_t *node, unsigned queue, unsigned int namespaceID, lock_handle_t *handle){
+  lock_namespace_t *ns = namespaceGet(namespaceID);
+  enum NODE_INSERT_RESULT ret;
+  tree_node_t *blocker;
+
+  node->timestamp     = STATS_STAMP();
+  node->namespaceID   = namespaceID;
+  node->shardHead     = node->shardNext = NULL;
+  node->child[LEFT]   = node->child[RIGHT] = NULL;
+  node->height        = 0;
+  node->min_start_lba = node->start_lba;
+  node->max_end_lba   = node->end_lba;
+  if(shardIndex(ns, node->start_lba) < shardIndex(ns, node->end_lba))
+    return requestSplit(ns, node, queue, namespaceID, handle);
+  ns = shardAt(ns, shardIndex(ns, node->start_lba));
+  namespaceLock(ns);
+  node->eventIndex = ++ns->next_index;
+  if((blocker = findCollision(ns->root, node)) == NULL){
+    treeWriteBegin(ns);
+    treeAdd(&ns->root, node);
+    treeWriteEnd(ns);
+    ret = NODE_ADDED;
+  }
+  else if(queue){
+    listAddInorder(blocker, node);
+    widenSpan(blocker, node->start_lba, node->end_lba);
+    node->state = LOCK_QUEUED;
+    ret = NODE_QUEUED;
+  }
+  else
+    ret = NODE_COLLISION;
+  TRACE_RING(LOCK_OP_REQUEST, namespaceID, node->start_lba, node->end_lba, node->eventIndex, ret);
+  if(ret != NODE_COLLISION){
+    TRACE_INFO("insert event index %llu  W(%d) [%4d --%4d]\n", node->eventIndex, node->type, node->start_lba, node->end_lba);
+    if(handle){
+      handle->node        = node;
+      handle->generation  = node->generation;
+      handle->namespaceID = namespaceID;
+    }
+  }
+  namespaceUnlock(ns);
+  if(ret == NODE_COLLISION){
+    STATS_COUNT(namespaceID, collisions);
+  }
+  else if(ret == NODE_ADDED){
+    STATS_COUNT(namespaceID, added);
+  }
+  else{
+    STATS_COUNT(namespaceID, queued);
+  }
+  return ret;
+}
+
+/**
+ * @brief Request a lock on a node from the arena, see #lockRequest
+ *
+ * @param[in] cq     -- completion queue to post the grant of a queued lock to, NULL to wake #lockWait
+ * @param[in] cookie -- posted to cq
+ **/
+static enum NODE_INSERT_RESULT requestRange(unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned queue,
+					    unsigned int namespaceID, lock_cq_t *cq, unsigned long long cookie, lock_handle_t *handle){
+  enum NODE_INSERT_RESULT ret;
+  tree_node_t *node;
+  if(namespaceGet(namespaceID) == NULL)
+    return NODE_FAILED;
+  STATS_COUNT(namespaceID, requests);
+  if((node = allocNodes()) == NULL){
+    STATS_COUNT(namespaceID, failed);
+    return NODE_FAILED;
+  }
+  node->start_lba = start_lba;
+  node->end_lba   = end_lba;
+  node->type      = type;
+  node->notify    = cq ? LOCK_NOTIFY_CQ : LOCK_NOTIFY_WAKE;
+  node->cq        = cq;
+  node->cookie    = cookie;
+  if((ret = requestNode(node, queue, namespaceID, handle)) == NODE_COLLISION || ret == NODE_FAILED)
+    freeNode(node);
+  return ret;
+}
+
 /**
  * @brief Process a logical address lock request
  * 
+ * Only the mutex of the requested namespace is taken, so requests to
+ * different namespaces run in parallel.
+ *
  * @param[in] start_lba   -- the start logical block address
  * @param[in] end_lba     -- the end logical block address
  * @param[in] type        -- write event or read event
  * @param[in] queue       -- whether the node can be queued or not. If it can be queued, it is possible that we can put it at the pending list.
+ * @param[in] namespaceID -- The namespace id of the lock being requested.
+ * @param[out] handle     -- set to the handle to pass to #lockRelease once granted, may be NULL
  *
  * @retval The insertion result.
  **/
@@ -646,33 +1435,9 @@ enum NODE_INSERT_RESULT lockRequest(unsigned int start_lba,
 				    unsigned int end_lba, 
 				    unsigned int type, 
 				    unsigned queue, 
-				    unsigned int namespaceID){
-  tree_node_t *node;
-  if( (node = allocNodes()) != NULL){
-    node->start_lba   = start_lba;
-    node->end_lba     = end_lba;
-    node->type        = type;
-
-  
-    /*deal with the next_index overflows problem*/
-    if(next_index[namespaceID]  + 1 >= MAX_NODES){
-      memset(tree_array, 0, sizeof(tree_array));
-      obtainEventInexMarker(rootArray[namespaceID]);
-      updateIndex(rootArray[namespaceID]);
-      next_index[namespaceID] = sum(MAX_NODES);
-    }
-    next_index[namespaceID]++;
-    node->eventIndex = next_index[namespaceID];
-
-    unsigned int ret = insertNode(&rootArray[0], node, queue);
-    if(ret == NODE_COLLISION){
-      freeNode(node);
-      return ret;
-    }
-    printf("insert event index %d  W(%d) [%4d --%4d]\n", node->eventIndex, type, start_lba, end_lba);
-    return ret;
-  }
-  return NODE_FAILED;
+				    unsigned int namespaceID,
+				    lock_handle_t *handle){
+  return requestRange(start_lba, end_lba, type, queue, namespaceID, NULL, 0, handle);
 }
 
 
@@ -702,6 +1467,9 @@ int isInAVLWithPendingList(tree_node_t *root, tree_node_t *node){
 	//else
 	  //printf("P ");
       }while((iter = (tree_node_t *) (&iter->list)->next) != prev);
+
+      if(iter->start_lba == node->start_lba && isInAVLWithPendingList(iter->child[RIGHT], node))
+	return 1;
     
       if(iter->start_lba < node->start_lba){
 	//printf("R ");
@@ -719,50 +1487,1034 @@ int isInAVLWithPendingList(tree_node_t *root, tree_node_t *node){
 }
 
 /**
- * @brief  Process a logical address lock release.
- * 
- * @param[in] node -- a node to be unlocked
- * @param[in] namespaceID -- The namespace id of the lock being released.
+ * @brief Find the in-order neighbour of a tree node
  *
+ * @param[in] node -- the tree node
+ * @param[in] side -- LEFT for the predecessor, RIGHT for the successor
+ *
+ * @retval The neighbour, NULL if node is the first or last node
  **/
-void lockRelease(tree_node_t *node, unsigned int namespaceID){ 
-  /*probably do not need in the real code. The caller has to make sure it is correct*/
-   /*need to check whether the AVL tree with the pending list contains the node or not*/
-  if(!isInAVLWithPendingList(rootArray[namespaceID], node)){
-    printf("Wrong operation: delete a node not in the AVL tree\n");
-    return;
+static tree_node_t *neighbour(tree_node_t *node, int side){
+  if(node->child[side]){
+    for(node = node->child[side]; node->child[!side]; node = node->child[!side])
+      continue;
+    return node;
   }
-  /*probably do not need it in the real code. The caller has to make sure it is correct*/
-  if(!isInAVL(rootArray[namespaceID], node)){
-    printf("Wrong operation: delete a node in the pending list\n");
+  while(node->parent && node->parent->child[side] == node)
+    node = node->parent;
+  return node->parent;
+}
+
+/**
+ * @brief Let a waiter take over the tree position of the node being released
+ *
+ * Only possible if the waiter's key sorts between the neighbours of node;
+ * the waiter then inherits parent, children and height, and just the spans
+ * up to the root need recomputing, with no descent and no rotation.
+ *
+ * @retval 1 -- waiter is in the tree in place of node
+ * @retval 0 -- the key does not fit, nothing changed
+ **/
+static int replaceNode(tree_node_t **root, tree_node_t *node, tree_node_t *waiter){
+  tree_node_t *pred = neighbour(node, LEFT), *succ = neighbour(node, RIGHT), *iter;
+  int side;
+
+  if((pred && pred->start_lba > waiter->start_lba) || (succ && succ->start_lba < waiter->start_lba))
+    return 0;
+  for(side = LEFT; side <= RIGHT; side++)
+    if((waiter->child[side] = node->child[side]) != NULL)
+      waiter->child[side]->parent = waiter;
+  waiter->height = node->height;
+  replaceChild(root, node, waiter);
+  node->child[LEFT] = node->child[RIGHT] = node->parent = NULL;
+  waiter->state = LOCK_GRANTED;
+  for(iter = waiter; iter; iter = iter->parent)
+    updateSpan(iter);
+  return 1;
+}
+
+/**
+ * @brief Post the cookie of a granted asynchronous request
+ *
+ * The request reserved its slot when it was queued, so the ring has room.
+ * The eventfd is written only if the consumer armed it, the store of the
+ * slot and the exchange of armed pairing with #lockCqDrain arming and then
+ * checking the ring again.
+ *
+ * @param[in] cq     -- the completion queue
+ * @param[in] cookie -- the cookie of the request
+ **/
+static void cqPost(lock_cq_t *cq, unsigned long long cookie){
+  unsigned long long tail = __atomic_fetch_add(&cq->tail, 1, __ATOMIC_RELAXED);
+  lock_cq_slot_t *slot = &cq->slot[tail & cq->mask];
+  unsigned long long one = 1;
+
+  slot->cookie = cookie;
+  __atomic_store_n(&slot->sequence, tail + 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&cq->armed, __ATOMIC_SEQ_CST) && __atomic_exchange_n(&cq->armed, 0, __ATOMIC_SEQ_CST)){
+    if(write(cq->fd, &one, sizeof(one)) != sizeof(one))
+      TRACE_ERROR("Completion queue eventfd write failed\n");
+  }
+}
+
+/**
+ * @brief Granted hooks waiting for the calling thread to drop the namespace mutex, in grant order
+ **/
+static __thread tree_node_t *grantedHead, *grantedTail;
+
+/**
+ * @brief Call the granted hooks queued by the releases of the calling thread
+ *
+ * Called with no namespace mutex held, so a hook may request and release
+ * locks itself; the hooks those releases queue are called by the same loop.
+ **/
+static void runGranted(void){
+  tree_node_t *node;
+  while((node = grantedHead) != NULL){
+    if((grantedHead = node->grantedNext) == NULL)
+      grantedTail = NULL;
+    node->granted(node);
+  }
+}
+
+/**
+ * @brief Publish the grant of a queued lock and wake its thread if it sleeps in #lockWait
+ *
+ * The state is stored before parked is read and #lockWait sets parked
+ * before it reads the state again, both sequentially consistent, so a
+ * waiter either sees the grant or is seen parked; only threads that really
+ * sleep cost a system call. The grant of an asynchronous request is posted
+ * to its completion queue instead, and the granted hook of a #lockRequestNode
+ * request is queued for #runGranted. A piece of a request split across
+ * shards only counts down its first piece, the last one announces the
+ * grant of the request.
+ *
+ * Once the grant is published a polling owner may release the request and
+ * its first piece may be handed out again, so how to notify is read before
+ * the store and the count down. Only the futex word is touched after
+ * them: nodes are never unmapped, and a stray wake of the next owner of
+ * the node is absorbed by the loop in #lockWait. A #LOCK_NOTIFY_CALL
+ * owner waits for its hook, so that node stays put for the queue.
+ *
+ * @param[in] waiter -- the node just granted, the namespace mutex held
+ **/
+static inline void grantNotify(tree_node_t *waiter){
+  tree_node_t *head = waiter->shardHead ? waiter->shardHead : waiter;
+  unsigned char notify = head->notify;
+  lock_cq_t *cq = notify == LOCK_NOTIFY_CQ ? head->cq : NULL;
+  unsigned long long cookie = notify == LOCK_NOTIFY_CQ ? head->cookie : 0;
+  unsigned int *parked = &head->parked;
+
+  __atomic_store_n(&waiter->state, LOCK_GRANTED, __ATOMIC_SEQ_CST);
+  if(waiter->shardHead && __atomic_sub_fetch(&head->shardWaits, 1, __ATOMIC_SEQ_CST))
     return;
+  if(notify == LOCK_NOTIFY_CQ)
+    cqPost(cq, cookie);
+  else if(notify == LOCK_NOTIFY_CALL){
+    head->grantedNext = NULL;
+    if(grantedTail)
+      grantedTail->grantedNext = head;
+    else
+      grantedHead = head;
+    grantedTail = head;
   }
-  /**
-  * Remove the node from the tree.
-  **/
-  removeNode(&rootArray[namespaceID], node);
-  
+  else if(__atomic_load_n(parked, __ATOMIC_SEQ_CST) && __atomic_exchange_n(parked, 0, __ATOMIC_SEQ_CST))
+    syscall(SYS_futex, parked, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/**
+ * @brief Grant or requeue the waiters of a node being released
+ *
+ * The waiters are taken in arrival order. The released node stays in the
+ * tree as #LOCK_RELEASING, blocking nothing, until the first grantable
+ * waiter can take over its position; only if none fits is it removed.
+ *
+ * A waiter blocked by one handled just before it, or by the first one
+ * granted, is moved straight onto that group's pending list without a
+ * search: nothing younger than the waiter can be on a list built by this
+ * release, so it goes in at the tail or right after its blocker. Any other
+ * waiter is checked against the whole tree and granted or queued on the
+ * group that blocks it.
+ *
+ * @param[in] ns          -- the namespace, its mutex held
+ * @param[in] node        -- the granted node being released
+ * @param[in] namespaceID -- for the trace and statistics
+ * @param[in] now         -- #STATS_STAMP of the release
+ *
+ * @retval N/A
+ **/
+static void grantWaiters(lock_namespace_t *ns, tree_node_t *node, unsigned int namespaceID, unsigned long long now){
+  tree_node_t *waiter = listGetHead(&node->pendingList, tree_node_t);
+  tree_node_t *first = NULL, *last = NULL, *lastHolder = NULL;
+  int replaced = 0;
+
+  node->state = LOCK_RELEASING;
+  listInit(&node->pendingList);
+  while(waiter != node){
+    tree_node_t *next = listGetHead(&waiter->list, tree_node_t);
+    tree_node_t *holder;
+
+    TRACE_INFO("insert node with index %2llu\n", waiter->eventIndex);
+    listInit(&waiter->pendingList);
+    waiter->child[LEFT] = waiter->child[RIGHT] = NULL;
+    waiter->height        = 0;
+    waiter->min_start_lba = waiter->start_lba;
+    waiter->max_end_lba   = waiter->end_lba;
+
+    if(last && lockBlocks(last, last->state == LOCK_QUEUED, waiter)){
+      holder = lastHolder;
+      listAddAfter(holder, last == holder ? (tree_node_t *) holder->pendingList.prev : last, waiter);
+    }
+    else if(first && first != last && lockBlocks(first, 0, waiter)){
+      holder = first;
+      listAddAfter(holder, (tree_node_t *) holder->pendingList.prev, waiter);
+    }
+    else if((holder = findCollision(ns->root, waiter)) != NULL)
+      listAddInorder(holder, waiter);
+
+    if(holder){
+      widenSpan(holder, waiter->start_lba, waiter->end_lba);
+      waiter->state = LOCK_QUEUED;
+    }
+    else{
+      if(!replaced)
+	replaced = replaceNode(&ns->root, node, waiter);
+      if(waiter->state != LOCK_GRANTED)
+	treeAdd(&ns->root, waiter);
+      if(first == NULL)
+	first = waiter;
+      holder = waiter;
+      TRACE_RING(LOCK_OP_GRANT, namespaceID, waiter->start_lba, waiter->end_lba, waiter->eventIndex, NODE_ADDED);
+      STATS_COUNT(namespaceID, promotions);
+      STATS_TIME_AT(namespaceID, waitHist, waiter->timestamp, now);
+      waiter->timestamp = now;
+      grantNotify(waiter);
+    }
+    last       = waiter;
+    lastHolder = holder;
+    waiter     = next;
+  }
+  if(!replaced)
+    removeNode(&ns->root, node);
+}
+
+/**
+ * @brief Check a handle and take its lock out of the tree
+ *
+ * The handle is checked in O(1): its generation must still match the node,
+ * its namespace the one the node was requested in, and the node must be
+ * granted. Building with LOCK_DEBUG also searches the tree for the node
+ * before removing it. The node is marked free and its generation bumped
+ * before the mutex is dropped, so a second release of the handle racing
+ * this one finds it stale instead of removing it again.
+ *
+ * @param[in] ns     -- the namespace of the handle, its mutex held
+ * @param[in] handle -- the handle filled in by #lockRequest
+ * @param[in] now    -- #STATS_STAMP of the release
+ *
+ * @retval 1 -- the lock was released, its node must be freed once the mutex is dropped
+ * @retval 0 -- the handle is stale or its lock is not granted
+ **/
+static int releaseNode(lock_namespace_t *ns, const lock_handle_t *handle, unsigned long long now){
+  tree_node_t *node = handle->node;
+
+  if(__atomic_load_n(&node->generation, __ATOMIC_ACQUIRE) != handle->generation){
+    TRACE_ERROR("Wrong operation: stale lock handle\n");
+    return 0;
+  }
+  if(node->namespaceID != handle->namespaceID){
+    TRACE_ERROR("Wrong operation: handle of namespace %u for a lock of namespace %u\n", handle->namespaceID, node->namespaceID);
+    return 0;
+  }
+#ifdef LOCK_DEBUG
   /*
-   * check if this node has pending locks associated with it.
-   * And if so, try to add each one to the tree
+   * cross check the node state against a search of the tree
    */
-  tree_node_t *pendingNode = listGetHead(&node->pendingList, tree_node_t);
-  while(pendingNode != node){
-    printf("insert node with index %2d\n", pendingNode->eventIndex);
-    tree_node_t *nextNode = listGetHead(&pendingNode->pendingList, tree_node_t);
-    pendingNode->child[0] = NULL;
-    pendingNode->child[1] = NULL;
-    
+  if((node->state == LOCK_GRANTED) != isInAVL(ns->root, node)){
+    TRACE_ERROR("Wrong operation: lock state %d disagrees with the AVL tree\n", node->state);
+    return 0;
+  }
+#endif
+  if(node->state != LOCK_GRANTED){
+    TRACE_ERROR("Wrong operation: delete a node in the pending list\n");
+    return 0;
+  }
+  TRACE_RING(LOCK_OP_RELEASE, handle->namespaceID, node->start_lba, node->end_lba, node->eventIndex, NODE_ADDED);
+  STATS_COUNT(handle->namespaceID, releases);
+  STATS_TIME_AT(handle->namespaceID, holdHist, node->timestamp, now);
+
+  /*
+   * Remove the node from the tree, granting what waited on it
+   */
+  treeWriteBegin(ns);
+  if(listEmpty(&node->pendingList))
+    removeNode(&ns->root, node);
+  else
+    grantWaiters(ns, node, handle->namespaceID, now);
+  treeWriteEnd(ns);
+  node->state = LOCK_FREE;
+  __atomic_store_n(&node->generation, node->generation + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/**
+ * @brief Test whether the request of a node holds its whole range
+ *
+ * A request split across shards holds it once none of its pieces is queued.
+ *
+ * @param[in] node  -- the node a handle refers to
+ * @param[in] order -- memory order of the load
+ **/
+static inline int requestGranted(tree_node_t *node, int order){
+  if(node->shardHead)
+    return __atomic_load_n(&node->shardWaits, order) == 0;
+  return __atomic_load_n(&node->state, order) == LOCK_GRANTED;
+}
+
+/**
+ * @brief Release the lock of a handle, each piece of a split request in its own shard
+ *
+ * Only a request holding every piece may be released. The pieces are
+ * released one shard at a time, nothing else can touch a granted piece.
+ *
+ * @param[in] handle -- the handle filled in by #lockRequest or #lockRequestNode
+ * @param[in] keep   -- set to leave the node of the handle to the caller, see #lockReleaseNode
+ **/
+static void releaseHandle(const lock_handle_t *handle, int keep){
+  unsigned long long now = STATS_STAMP();
+  tree_node_t *node = handle->node, *next;
+  lock_handle_t piece = *handle;
+  lock_namespace_t *ns, *shard;
+  int released;
+
+  if((ns = namespaceGet(handle->namespaceID)) == NULL){
+    TRACE_ERROR("Wrong operation: namespace %u out of range\n", handle->namespaceID);
+    return;
+  }
+  if(__atomic_load_n(&node->generation, __ATOMIC_ACQUIRE) == handle->generation && node->shardHead &&
+     !requestGranted(node, __ATOMIC_ACQUIRE)){
+    TRACE_ERROR("Wrong operation: release of a request still queued in a shard\n");
+    return;
+  }
+  for(; node; node = next){
+    next       = node->shardNext;
+    piece.node = node;
+    if(node != handle->node)
+      piece.generation = node->generation;
+    shard = shardAt(ns, shardIndex(ns, node->start_lba));
+    namespaceLock(shard);
+    released = releaseNode(shard, &piece, now);
+    if(released && keep && node == handle->node)
+      node->shardHead = node->shardNext = NULL;
+    namespaceUnlock(shard);
+    if(!released)
+      break;
+
+    /*Add the removed node back to the free list*/
+    if(!keep || node != handle->node)
+      freeNode(node);
+  }
+  runGranted();
+}
+
+/**
+ * @brief  Process a logical address lock release.
+ *
+ * The pending locks of the released node are retried in arrival order, so
+ * the run of readers queued behind a released writer is granted together.
+ * 
+ * @param[in] handle -- the handle filled in by #lockRequest
+ *
+ **/
+void lockRelease(const lock_handle_t *handle){ 
+  releaseHandle(handle, 0);
+}
+
+/**
+ * @brief Release a lock requested with #lockRequestNode
+ *
+ * Like #lockRelease, but the node stays with the caller; its generation is
+ * bumped so the handle goes stale.
+ *
+ * @param[in] handle -- the handle filled in by #lockRequestNode
+ **/
+void lockReleaseNode(const lock_handle_t *handle){
+  releaseHandle(handle, 1);
+}
+
+/**
+ * @brief Most pause iterations a waiter spins before sleeping, and the least
+ **/
+#define LOCK_SPIN_MAX 4096
+#define LOCK_SPIN_MIN 64
+
+/**
+ * @brief Spin budget of the calling thread, see #lockWait
+ **/
+static __thread unsigned int spinBudget = LOCK_SPIN_MAX / 4;
+
+/**
+ * @brief Online CPUs, 0 until the first #lockWait; on one CPU the holder can
+ * not run while the waiter spins, so waiters sleep at once
+ **/
+static long spinCpus;
+
+static inline void cpuRelax(void){
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#else
+  __asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/**
+ * @brief Wait until a queued lock is granted
+ *
+ * The waiter first spins on the node state, a grant made within the spin
+ * is picked up without a system call; past the spin it sleeps on the futex
+ * word of the node until #lockRelease grants it. The spin budget adapts
+ * per thread: it doubles when a grant arrives while spinning and halves
+ * when the thread has to sleep, so short hand-offs stay in user space and
+ * long waits stop burning CPU. A single CPU machine never spins.
+ *
+ * @param[in] handle -- the handle filled in by #lockRequest
+ *
+ * @retval 0  -- the lock is granted
+ * @retval -1 -- the handle is stale
+ **/
+int lockWait(const lock_handle_t *handle){
+  tree_node_t *node = handle->node;
+  unsigned int spin, budget;
+  long cpus = __atomic_load_n(&spinCpus, __ATOMIC_RELAXED);
+
+  if(__atomic_load_n(&node->generation, __ATOMIC_ACQUIRE) != handle->generation){
+    TRACE_ERROR("Wrong operation: wait on a stale lock handle\n");
+    return -1;
+  }
+  if(cpus == 0)
+    __atomic_store_n(&spinCpus, cpus = sysconf(_SC_NPROCESSORS_ONLN), __ATOMIC_RELAXED);
+  budget = cpus > 1 ? spinBudget : 0;
+  for(spin = 0; spin < budget; spin++){
+    if(requestGranted(node, __ATOMIC_ACQUIRE)){
+      if(spin && spinBudget < LOCK_SPIN_MAX)
+	spinBudget *= 2;
+      return 0;
+    }
+    cpuRelax();
+  }
+  if(budget && spinBudget > LOCK_SPIN_MIN)
+    spinBudget /= 2;
+  if(requestGranted(node, __ATOMIC_ACQUIRE))
+    return 0;
+  STATS_COUNT(handle->namespaceID, parks);
+  for(;;){
+    __atomic_store_n(&node->parked, 1, __ATOMIC_SEQ_CST);
+    if(requestGranted(node, __ATOMIC_SEQ_CST))
+      break;
+    syscall(SYS_futex, &node->parked, FUTEX_WAIT_PRIVATE, 1, NULL, NULL, 0);
+    if(requestGranted(node, __ATOMIC_ACQUIRE))
+      break;
+  }
+  __atomic_store_n(&node->parked, 0, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/**
+ * @brief Test whether a requested lock is held, without waiting
+ *
+ * @param[in] handle -- the handle filled in by #lockRequest
+ *
+ * @retval 1 -- the lock is granted
+ * @retval 0 -- it is still queued, or some piece of it is
+ **/
+int lockGranted(const lock_handle_t *handle){
+  return requestGranted(handle->node, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Request a lock and block until it is granted
+ *
+ * @param[in]  start_lba   -- first LBA of the range
+ * @param[in]  end_lba     -- last LBA of the range
+ * @param[in]  type        -- set to 1 for a write lock
+ * @param[in]  namespaceID -- the namespace
+ * @param[out] handle      -- filled in for #lockRelease
+ *
+ * @retval NODE_ADDED  -- the lock is held, granted at once or after waiting
+ * @retval NODE_FAILED -- no free node or a bad namespace
+ **/
+enum NODE_INSERT_RESULT lockRange(unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned int namespaceID, lock_handle_t *handle){
+  enum NODE_INSERT_RESULT ret = lockRequest(start_lba, end_lba, type, 1, namespaceID, handle);
+  if(ret == NODE_QUEUED && lockWait(handle) == 0)
+    ret = NODE_ADDED;
+  return ret;
+}
+
+/**
+ * @brief Times #probeRange retries a walk the writers changed before it takes the mutex
+ *
+ * Retry n first waits 2^n pause iterations, so with the short tree
+ * rewrites a probe outlasts a writer by backing off rather than queueing
+ * on its mutex; past #PROBE_YIELD tries it yields the CPU instead, the
+ * writer may be preempted in its rewrite.
+ **/
+#define PROBE_RETRIES 16
+#define PROBE_YIELD   10
+
+/**
+ * @brief Depth of the #probeWalk stack, well past the height of any AVL tree that fits in memory
+ **/
+#define PROBE_STACK 64
+
+/**
+ * @brief Search a tree for a granted lock blocking a request, without the mutex
+ *
+ * Every field is loaded once with a relaxed atomic load; the caller only
+ * trusts the result if the sequence count did not move. Nodes come from an
+ * arena that is not unmapped while the tree is live, so a node freed and
+ * reused under the walk is still readable, and the walk is bounded so a
+ * torn read can not make it loop.
+ *
+ * @retval 1  -- a granted lock blocks the request
+ * @retval 0  -- nothing granted blocks it
+ * @retval -1 -- the walk ran out of stack or steps, retry
+ **/
+static int probeWalk(tree_node_t *root, unsigned int start_lba, unsigned int end_lba, unsigned int type){
+  tree_node_t *stack[PROBE_STACK], *node, *child;
+  unsigned int sp = 0, steps = 0, side;
+
+  if(root)
+    stack[sp++] = root;
+  while(sp){
+    node = stack[--sp];
+    if(++steps > nodeCapacity)
+      return -1;
+    if(start_lba > __atomic_load_n(&node->max_end_lba, __ATOMIC_RELAXED) ||
+       end_lba < __atomic_load_n(&node->min_start_lba, __ATOMIC_RELAXED))
+      continue;
+    if(__atomic_load_n(&node->state, __ATOMIC_RELAXED) == LOCK_GRANTED &&
+       start_lba <= __atomic_load_n(&node->end_lba, __ATOMIC_RELAXED) &&
+       end_lba >= __atomic_load_n(&node->start_lba, __ATOMIC_RELAXED) &&
+       (type || __atomic_load_n(&node->type, __ATOMIC_RELAXED)))
+      return 1;
+    for(side = LEFT; side <= RIGHT; side++){
+      if((child = __atomic_load_n(&node->child[side], __ATOMIC_RELAXED)) == NULL)
+	continue;
+      if(sp == PROBE_STACK)
+	return -1;
+      stack[sp++] = child;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Probe one shard of a namespace, see #probeRange
+ **/
+static int probeShard(lock_namespace_t *ns, unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned int namespaceID){
+  unsigned int seq, tries, spin;
+  int ret;
+
+  for(tries = 0; tries < PROBE_RETRIES; tries++){
+    if(tries >= PROBE_YIELD)
+      sched_yield();
+    else
+      for(spin = tries ? 1u << tries : 0; spin > 0; spin--)
+	cpuRelax();
+    if((seq = __atomic_load_n(&ns->seq, __ATOMIC_ACQUIRE)) & 1)
+      continue;
+    ret = probeWalk(__atomic_load_n(&ns->root, __ATOMIC_RELAXED), start_lba, end_lba, type);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if(ret >= 0 && __atomic_load_n(&ns->seq, __ATOMIC_RELAXED) == seq)
+      return ret;
+  }
+  STATS_COUNT(namespaceID, probesLocked);
+  pthread_mutex_lock(&ns->mutex);
+  ret = probeWalk(ns->root, start_lba, end_lba, type);
+  pthread_mutex_unlock(&ns->mutex);
+  return ret;
+}
+
+/**
+ * @brief Test whether a granted lock blocks a range, without taking the namespace mutex
+ *
+ * The walk of the tree is validated by the sequence count of the namespace,
+ * which the mutex holder makes odd only while it adds, removes or replaces
+ * tree nodes: a walk that started on an even count that has not moved saw
+ * a consistent tree. A probe only reads shared memory, so probes never
+ * slow down each other or the requests; a spoiled walk is retried with
+ * backoff, and only after #PROBE_RETRIES of them does the probe take the
+ * mutex rather than starve. A range across shards probes each of them.
+ *
+ * Queued locks are not held and do not count.
+ *
+ * @param[in] start_lba   -- first LBA of the range
+ * @param[in] end_lba     -- last LBA of the range
+ * @param[in] type        -- 0 to look for held write locks, 1 for any held lock
+ * @param[in] namespaceID -- the namespace
+ *
+ * @retval 1  -- a held lock blocks a request of this type on the range
+ * @retval 0  -- nothing held blocks it
+ * @retval -1 -- a bad namespace
+ **/
+int probeRange(unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned int namespaceID){
+  lock_namespace_t *ns;
+  unsigned int shard;
+  int ret = 0;
+
+  if((ns = namespaceGet(namespaceID)) == NULL)
+    return -1;
+  STATS_COUNT(namespaceID, probes);
+  for(shard = shardIndex(ns, start_lba); ret == 0 && shard <= shardIndex(ns, end_lba); shard++)
+    ret = probeShard(shardAt(ns, shard), start_lba, end_lba, type, namespaceID);
+  return ret;
+}
+
+/**
+ * @brief Create a completion queue for #lockRequestAsync
+ *
+ * @param[in] capacity -- most asynchronous requests queued at once, rounded up to a power of 2
+ *
+ * @retval The queue, NULL if it could not be allocated
+ **/
+lock_cq_t *lockCqCreate(unsigned int capacity){
+  lock_cq_t *cq;
+  unsigned int size = 1;
+
+  while(size < capacity)
+    size <<= 1;
+  if((cq = aligned_alloc(CACHE_LINE_SIZE, sizeof(lock_cq_t))) == NULL)
+    return NULL;
+  memset(cq, 0, sizeof(lock_cq_t));
+  cq->mask  = size - 1;
+  cq->armed = 1;
+  if((cq->slot = calloc(size, sizeof(lock_cq_slot_t))) == NULL ||
+     (cq->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0){
+    free(cq->slot);
+    free(cq);
+    return NULL;
+  }
+  return cq;
+}
+
+/**
+ * @brief Free a completion queue, no request may still post to it
+ **/
+void lockCqDestroy(lock_cq_t *cq){
+  close(cq->fd);
+  free(cq->slot);
+  free(cq);
+}
+
+/**
+ * @brief Take the cookies of granted asynchronous requests off the queue
+ *
+ * Clears the eventfd, then drains. A call returning fewer than max cookies
+ * leaves the queue empty and armed, the eventfd turns readable with the
+ * next grant; a call returning max may leave cookies behind and should be
+ * repeated. Only one thread may drain a queue.
+ *
+ * @param[in]  cq      -- the completion queue
+ * @param[out] cookies -- the cookies, in grant order
+ * @param[in]  max     -- room in cookies
+ *
+ * @retval Number of cookies returned
+ **/
+unsigned int lockCqDrain(lock_cq_t *cq, unsigned long long *cookies, unsigned int max){
+  unsigned long long counter, head = cq->head;
+  unsigned int n = 0;
+
+  if(read(cq->fd, &counter, sizeof(counter)) < 0){
     /*
-     * Reset removed node pending list pointers
+     * EAGAIN, the eventfd was not signalled
      */
-    listInit(&pendingNode->pendingList);
-    
-    insertNode(&rootArray[namespaceID], pendingNode, 1);
-    
-    pendingNode = nextNode;
   }
-  
-  /*Add the removed node back to the free list*/
-  freeNode(node);
+  for(;;){
+    lock_cq_slot_t *slot = &cq->slot[head & cq->mask];
+    if(n < max && __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) == head + 1){
+      cookies[n++] = slot->cookie;
+      head++;
+      continue;
+    }
+    if(n == max)
+      break;
+    __atomic_store_n(&cq->armed, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) != head + 1)
+      break;
+  }
+  cq->head = head;
+  __atomic_sub_fetch(&cq->reserved, n, __ATOMIC_RELEASE);
+  return n;
+}
+
+/**
+ * @brief Request a lock without blocking, the grant of a queued lock is posted to a completion queue
+ *
+ * @param[in]  start_lba   -- first LBA of the range
+ * @param[in]  end_lba     -- last LBA of the range
+ * @param[in]  type        -- set to 1 for a write lock
+ * @param[in]  namespaceID -- the namespace
+ * @param[in]  cq          -- the completion queue of the caller
+ * @param[in]  cookie      -- posted to cq once the lock is granted
+ * @param[out] handle      -- filled in for #lockRelease
+ *
+ * @retval NODE_ADDED  -- the lock is held, nothing is posted
+ * @retval NODE_QUEUED -- cookie is posted to cq when the lock is granted
+ * @retval NODE_FAILED -- no free node, a bad namespace or cq is full
+ **/
+enum NODE_INSERT_RESULT lockRequestAsync(unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned int namespaceID,
+					 lock_cq_t *cq, unsigned long long cookie, lock_handle_t *handle){
+  enum NODE_INSERT_RESULT ret;
+
+  if(__atomic_add_fetch(&cq->reserved, 1, __ATOMIC_ACQUIRE) > cq->mask + 1){
+    __atomic_sub_fetch(&cq->reserved, 1, __ATOMIC_RELAXED);
+    return NODE_FAILED;
+  }
+  ret = requestRange(start_lba, end_lba, type, 1, namespaceID, cq, cookie, handle);
+  if(ret != NODE_QUEUED)
+    __atomic_sub_fetch(&cq->reserved, 1, __ATOMIC_RELAXED);
+  return ret;
+}
+
+/**
+ * @brief Request a lock on a node owned by the caller, a queued lock calls a hook once granted
+ *
+ * For callers that keep the node in their own request state, a coroutine
+ * frame for instance, so a request costs no allocation. The request always
+ * queues; the hook of a queued lock is called by the thread whose release
+ * granted it, after that thread dropped the namespace mutex. Release the
+ * lock with #lockReleaseNode.
+ *
+ * @param[in]  node        -- the node, not in use by another request
+ * @param[in]  start_lba   -- first LBA of the range
+ * @param[in]  end_lba     -- last LBA of the range
+ * @param[in]  type        -- set to 1 for a write lock
+ * @param[in]  namespaceID -- the namespace
+ * @param[in]  granted     -- called with node once a queued lock is granted
+ * @param[out] handle      -- filled in for #lockReleaseNode
+ *
+ * @retval NODE_ADDED  -- the lock is held, the hook is not called
+ * @retval NODE_QUEUED -- the hook is called when the lock is granted
+ * @retval NODE_FAILED -- a bad namespace
+ **/
+enum NODE_INSERT_RESULT lockRequestNode(tree_node_t *node, unsigned int start_lba, unsigned int end_lba, unsigned int type,
+					unsigned int namespaceID, void (*granted)(tree_node_t *node), lock_handle_t *handle){
+  if(namespaceGet(namespaceID) == NULL)
+    return NODE_FAILED;
+  STATS_COUNT(namespaceID, requests);
+  node->child[LEFT] = node->child[RIGHT] = node->parent = NULL;
+  listInit(&node->pendingList);
+  node->start_lba = start_lba;
+  node->end_lba   = end_lba;
+  node->type      = type;
+  node->parked    = 0;
+  node->notify    = LOCK_NOTIFY_CALL;
+  node->granted   = granted;
+  return requestNode(node, 1, namespaceID, handle);
+}
+
+/**
+ * @brief Order batch ranges by namespace, then by start LBA
+ **/
+static inline int rangeBefore(const lock_range_t *a, const lock_range_t *b){
+  return a->namespaceID < b->namespaceID || (a->namespaceID == b->namespaceID && a->start_lba < b->start_lba);
+}
+
+/**
+ * @brief First of the sorted, disjoint nodes[lo..hi) that ends at or after lba
+ **/
+static unsigned int firstEndingFrom(tree_node_t **nodes, unsigned int lo, unsigned int hi, unsigned int lba){
+  while(lo < hi){
+    unsigned int mid = (lo + hi) / 2;
+    if(nodes[mid]->end_lba < lba)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * @brief First of the sorted, disjoint nodes[lo..hi) that starts after lba
+ **/
+static unsigned int firstStartingAfter(tree_node_t **nodes, unsigned int lo, unsigned int hi, unsigned int lba){
+  while(lo < hi){
+    unsigned int mid = (lo + hi) / 2;
+    if(nodes[mid]->start_lba <= lba)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/**
+ * @brief Find a blocking group for each range of a batch in one sweep of the tree
+ *
+ * The counterpart of #findCollision for sorted, disjoint ranges: the tree
+ * is walked in order once, and at every node only the ranges overlapping
+ * its span are carried on, found by binary search since both the starts
+ * and the ends of the ranges ascend.
+ *
+ * @param[in]  iter    -- root of the subtree to search
+ * @param[in]  nodes   -- the ranges, sorted by start LBA and disjoint
+ * @param[out] blocker -- set for every range some group blocks, entries already set are kept
+ * @param[in]  lo, hi  -- the ranges nodes[lo..hi) to look for
+ *
+ * @retval N/A
+ **/
+static void findCollisions(tree_node_t *iter, tree_node_t **nodes, tree_node_t **blocker, unsigned int lo, unsigned int hi){
+  tree_node_t *pnode;
+  unsigned int i, last, groupStart, groupEnd;
+
+  while(iter != NULL){
+    lo = firstEndingFrom(nodes, lo, hi, iter->min_start_lba);
+    hi = firstStartingAfter(nodes, lo, hi, iter->max_end_lba);
+    if(lo == hi)
+      return;
+    if(iter->child[LEFT])
+      findCollisions(iter->child[LEFT], nodes, blocker, lo, hi);
+
+    /*
+     * check the ranges overlapping the group of this node
+     */
+    groupStart = iter->start_lba;
+    groupEnd   = iter->end_lba;
+    if(!listEmpty(&iter->pendingList)){
+      groupStart = MIN(groupStart, iter->pending_start_lba);
+      groupEnd   = MAX(groupEnd, iter->pending_end_lba);
+    }
+    i    = firstEndingFrom(nodes, lo, hi, groupStart);
+    last = firstStartingAfter(nodes, i, hi, groupEnd);
+    for(; i < last; i++){
+      if(blocker[i])
+	continue;
+      if(iter->state == LOCK_GRANTED && lockBlocks(iter, 0, nodes[i]))
+	blocker[i] = iter;
+      else if(pendingMayBlock(iter, nodes[i])){
+	for(pnode = listGetHead(&iter->pendingList, tree_node_t); pnode != iter; pnode = listGetHead(&pnode->list, tree_node_t)){
+	  if(lockBlocks(pnode, 1, nodes[i])){
+	    blocker[i] = iter;
+	    break;
+	  }
+	}
+      }
+    }
+    iter = iter->child[RIGHT];
+  }
+}
+
+/**
+ * @brief Request the locks of a vector of extents all at once
+ *
+ * The ranges are sorted and overlapping ones merged, a merged range is a
+ * write if any part of it is, then cut at the shard boundaries of split
+ * namespaces. Every shard of the batch hands out a single event index to
+ * all of its ranges, and the shard mutexes are taken in ascending order
+ * and held across the whole insertion, so of two batches one is older
+ * than the other in every shard they share.
+ * A range then only ever waits on locks older than its batch, and two
+ * batches can not end up each holding what the other waits for.
+ *
+ * Without queue, nothing is locked unless every range can be granted.
+ * With queue, free ranges are granted and the others queued; the batch
+ * holds its ranges once #lockBatchGranted says so.
+ *
+ * @param[in]  ranges -- the extents, in any order
+ * @param[in]  count  -- number of extents, 1 to #LOCK_BATCH_MAX
+ * @param[in]  queue  -- whether blocked ranges may be queued
+ * @param[out] batch  -- the locks of the merged ranges
+ *
+ * @retval #NODE_ADDED     -- every range is granted
+ * @retval #NODE_QUEUED    -- some ranges are queued
+ * @retval #NODE_COLLISION -- a range is blocked and queue is not set, nothing is locked
+ * @retval #NODE_FAILED    -- an invalid range, more than #LOCK_BATCH_MAX locks once cut at shards, or not enough free nodes
+ **/
+enum NODE_INSERT_RESULT lockRequestBatch(const lock_range_t *ranges, unsigned int count, unsigned queue, lock_batch_t *batch){
+  lock_range_t sorted[LOCK_BATCH_MAX], cut[LOCK_BATCH_MAX];
+  tree_node_t *nodes[LOCK_BATCH_MAX], *blocker[LOCK_BATCH_MAX];
+  lock_namespace_t *shards[LOCK_BATCH_MAX];
+  unsigned long long now = STATS_STAMP();
+  unsigned int n, i, merged, first, last, shard, blocked = 0;
+
+  if(count == 0 || count > LOCK_BATCH_MAX)
+    return NODE_FAILED;
+  for(n = 0; n < count; n++){
+    if(namespaceGet(ranges[n].namespaceID) == NULL || ranges[n].start_lba > ranges[n].end_lba)
+      return NODE_FAILED;
+    for(i = n; i > 0 && rangeBefore(&ranges[n], &sorted[i - 1]); i--)
+      sorted[i] = sorted[i - 1];
+    sorted[i] = ranges[n];
+  }
+
+  /*
+   * merge overlapping ranges, and adjacent ones of the same type
+   */
+  for(merged = 0, n = 1; n < count; n++){
+    lock_range_t *prev = &sorted[merged];
+    if(sorted[n].namespaceID == prev->namespaceID &&
+       (sorted[n].start_lba <= prev->end_lba || (sorted[n].start_lba == prev->end_lba + 1 && sorted[n].type == prev->type))){
+      prev->end_lba = MAX(prev->end_lba, sorted[n].end_lba);
+      prev->type   |= sorted[n].type;
+    }
+    else
+      sorted[++merged] = sorted[n];
+  }
+
+  /*
+   * cut the merged ranges at shard boundaries, every lock sits in one shard
+   */
+  for(i = 0, n = 0; n <= merged; n++){
+    lock_namespace_t *ns = namespaceGet(sorted[n].namespaceID);
+    for(shard = shardIndex(ns, sorted[n].start_lba); ; shard++){
+      if(i == LOCK_BATCH_MAX)
+	return NODE_FAILED;
+      cut[i] = sorted[n];
+      shards[i] = shardAt(ns, shard);
+      if(shard > shardIndex(ns, sorted[n].start_lba))
+	cut[i].start_lba = shard << ns->shardShift;
+      if(shard == shardIndex(ns, sorted[n].end_lba)){
+	i++;
+	break;
+      }
+      cut[i++].end_lba = ((shard + 1) << ns->shardShift) - 1;
+    }
+  }
+  count = i;
+
+  for(n = 0; n < count; n++){
+    if((nodes[n] = allocNodes()) == NULL){
+      while(n > 0)
+	freeNode(nodes[--n]);
+      STATS_COUNT(cut[0].namespaceID, failed);
+      return NODE_FAILED;
+    }
+    nodes[n]->start_lba     = nodes[n]->min_start_lba = cut[n].start_lba;
+    nodes[n]->end_lba       = nodes[n]->max_end_lba   = cut[n].end_lba;
+    nodes[n]->type          = cut[n].type;
+    nodes[n]->namespaceID   = cut[n].namespaceID;
+    nodes[n]->timestamp     = now;
+    nodes[n]->height        = 0;
+    nodes[n]->child[LEFT]   = nodes[n]->child[RIGHT] = NULL;
+    blocker[n] = NULL;
+  }
+
+  /*
+   * lock the shards in ascending order and sweep each tree once
+   */
+  for(first = 0; first < count; first = last){
+    lock_namespace_t *ns = shards[first];
+    namespaceLock(ns);
+    ns->next_index++;
+    for(last = first; last < count && shards[last] == ns; last++)
+      nodes[last]->eventIndex = ns->next_index;
+    findCollisions(ns->root, nodes, blocker, first, last);
+    for(i = first; i < last; i++)
+      blocked |= blocker[i] != NULL;
+  }
+
+  if(!blocked || queue){
+    for(n = 0; n < count; n++){
+      if(blocker[n]){
+	listAddInorder(blocker[n], nodes[n]);
+	widenSpan(blocker[n], nodes[n]->start_lba, nodes[n]->end_lba);
+	nodes[n]->state = LOCK_QUEUED;
+      }
+      else{
+	treeWriteBegin(shards[n]);
+	treeAdd(&shards[n]->root, nodes[n]);
+	treeWriteEnd(shards[n]);
+      }
+    }
+  }
+  for(n = 0; n < count; n++)
+    if(n == count - 1 || shards[n + 1] != shards[n])
+      namespaceUnlock(shards[n]);
+
+  for(first = 0; first < count; first = last){
+    unsigned int namespaceID = cut[first].namespaceID, queued = 0;
+    for(last = first; last < count && cut[last].namespaceID == namespaceID; last++){
+      queued |= blocker[last] != NULL;
+      TRACE_RING(LOCK_OP_REQUEST, namespaceID, nodes[last]->start_lba, nodes[last]->end_lba, nodes[last]->eventIndex,
+		 blocker[last] ? (queue ? NODE_QUEUED : NODE_COLLISION) : (blocked && !queue ? NODE_COLLISION : NODE_ADDED));
+    }
+    STATS_COUNT(namespaceID, requests);
+    if(blocked && !queue){
+      STATS_COUNT(namespaceID, collisions);
+    }
+    else if(queued){
+      STATS_COUNT(namespaceID, queued);
+    }
+    else{
+      STATS_COUNT(namespaceID, added);
+    }
+  }
+
+  if(blocked && !queue){
+    for(n = 0; n < count; n++)
+      freeNode(nodes[n]);
+    return NODE_COLLISION;
+  }
+  batch->count = count;
+  for(n = 0; n < count; n++){
+    batch->handle[n].node        = nodes[n];
+    batch->handle[n].generation  = nodes[n]->generation;
+    batch->handle[n].namespaceID = cut[n].namespaceID;
+  }
+  return blocked ? NODE_QUEUED : NODE_ADDED;
+}
+
+/**
+ * @brief Test whether every lock of a batch is granted
+ *
+ * @retval 1 -- the batch holds all of its ranges
+ * @retval 0 -- some range is still queued
+ **/
+int lockBatchGranted(const lock_batch_t *batch){
+  unsigned int n;
+  for(n = 0; n < batch->count; n++)
+    if(__atomic_load_n(&batch->handle[n].node->state, __ATOMIC_ACQUIRE) != LOCK_GRANTED)
+      return 0;
+  return 1;
+}
+
+/**
+ * @brief Release every lock of a batch
+ *
+ * Only a batch holding all of its ranges may be released; releasing part
+ * of a batch would leave its queued ranges waiting with nobody to release
+ * them. Each shard of the batch is locked once for all of its ranges.
+ *
+ * @param[in] batch -- the batch filled in by #lockRequestBatch
+ **/
+void lockReleaseBatch(const lock_batch_t *batch){
+  unsigned long long now = STATS_STAMP();
+  unsigned int first, last, n, shard;
+  int released[LOCK_BATCH_MAX];
+
+  if(!lockBatchGranted(batch)){
+    TRACE_ERROR("Wrong operation: release of a batch still queued\n");
+    return;
+  }
+  for(first = 0; first < batch->count; first = last){
+    unsigned int namespaceID = batch->handle[first].namespaceID;
+    lock_namespace_t *base, *ns;
+    if((base = namespaceGet(namespaceID)) == NULL){
+      TRACE_ERROR("Wrong operation: namespace %u out of range\n", namespaceID);
+      return;
+    }
+    shard = shardIndex(base, batch->handle[first].node->start_lba);
+    ns = shardAt(base, shard);
+    namespaceLock(ns);
+    for(last = first; last < batch->count && batch->handle[last].namespaceID == namespaceID &&
+	  shardIndex(base, batch->handle[last].node->start_lba) == shard; last++)
+      released[last] = releaseNode(ns, &batch->handle[last], now);
+    namespaceUnlock(ns);
+    for(n = first; n < last; n++)
+      if(released[n])
+	freeNode(batch->handle[n].node);
+  }
+  runGranted();
 }
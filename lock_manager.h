@@ -1,6 +1,10 @@
 #ifndef LOCK_MANAGER_H
 #define LOCK_MANAGER_H
+#include <pthread.h>
 #define MAX_NAMESPACE_ID  32
+#ifdef __cplusplus
+extern "C" {
+#endif
 /**
  * @file
  * @brief Lock Manager structures, macros and defines
@@ -59,20 +63,157 @@ typedef struct tree_node_s{
    */
   unsigned int end_lba;
 
+  /*
+   * @brief smallest start LBA held or queued anywhere in this node's subtree
+   *
+   * Queued nodes may start below the node they wait on, so the tree key
+   * alone can not bound a subtree from the left.
+   */
+  unsigned int min_start_lba;
+
+  /*
+   * @brief largest end LBA held or queued anywhere in this node's subtree
+   */
+  unsigned int max_end_lba;
+
+  /*
+   * @brief hull of the locks queued on this node's pending list, valid while it is not empty
+   *
+   * Queued locks leave the list only when the node is released, so the
+   * hull never has to shrink and lets a search skip the whole list.
+   */
+  unsigned int pending_start_lba;
+  unsigned int pending_end_lba;
+
   /*
    *@brief the height of this node
    */
   signed char height;
-  /*
-  * @brief ID of eventIndex
-  */
-  unsigned int eventIndex;
+
   /*
    * @brief Lock type, set to 1 if this is a write lock
    */
   unsigned char type;
+
+  /*
+   * @brief Where the node is, one of #LOCK_STATE
+   */
+  unsigned char state;
+
+  /*
+   * @brief Set if a write lock is queued on this node's pending list
+   */
+  unsigned char pending_writes;
+
+  /*
+   * @brief How the grant of a queued lock is announced, one of #LOCK_NOTIFY
+   */
+  unsigned char notify;
+
+  /*
+   * @brief Bumped every time the node is freed, so stale handles can be told apart
+   */
+  unsigned int generation;
+
+  /*
+   * @brief Futex word of a thread sleeping in #lockWait until the lock is granted
+   */
+  unsigned int parked;
+
+  /*
+   * @brief First piece of a request split across shards: pieces not granted yet
+   */
+  unsigned int shardWaits;
+
+  /*
+   * @brief Namespace the lock was requested in, checked against the handle on release
+   */
+  unsigned int namespaceID;
+
+  union{
+    struct{
+      /*
+       * @brief #LOCK_NOTIFY_CQ: completion queue the grant is posted to, and the caller's cookie
+       */
+      struct lock_cq_s *cq;
+      unsigned long long cookie;
+    };
+    struct{
+      /*
+       * @brief #LOCK_NOTIFY_CALL: called once the namespace mutex is dropped,
+       * and the next call pending in the releasing thread
+       */
+      void (*granted)(struct tree_node_s *node);
+      struct tree_node_s *grantedNext;
+    };
+  };
+
+  /*
+   * @brief A request split across shards, see #lockNamespaceShards: the
+   * first piece, which the handle refers to, and the piece in the next shard
+   *
+   * NULL for a request within one shard.
+   */
+  struct tree_node_s *shardHead;
+  struct tree_node_s *shardNext;
+
+  /*
+   * @brief Arrival order of the request in its shard
+   *
+   * 64 bits never wrap in practice, a namespace would need centuries at
+   * billions of requests a second, so indices are compared directly and
+   * never have to be renumbered.
+   */
+  unsigned long long eventIndex;
+
+  /*
+   * @brief When the lock was queued or granted, for the wait and hold time statistics
+   */
+  unsigned long long timestamp;
 }tree_node_t;
 
+/**
+ * @brief Opaque reference to a requested lock, filled in by #lockRequest
+ *
+ * The handle is valid until the lock is released; the generation lets
+ * #lockRelease reject a handle whose node was freed and reused.
+ **/
+typedef struct lock_handle_s{
+  tree_node_t *node;
+  unsigned int generation;
+  unsigned int namespaceID;
+}lock_handle_t;
+
+/**
+ * @brief Most ranges a #lockRequestBatch call takes
+ **/
+#define LOCK_BATCH_MAX 64
+
+/**
+ * @brief One extent of a batched request
+ **/
+typedef struct lock_range_s{
+  unsigned int namespaceID;
+  unsigned int start_lba;
+  unsigned int end_lba;
+  /*
+   * set to 1 for a write lock
+   */
+  unsigned int type;
+}lock_range_t;
+
+/**
+ * @brief The locks of a batch, filled in by #lockRequestBatch
+ *
+ * Overlapping and adjacent ranges are merged first, so a batch may hold
+ * fewer locks than it was given ranges. The batch holds its ranges once
+ * every handle is granted, see #lockBatchGranted.
+ **/
+typedef struct lock_batch_s{
+  unsigned int count;
+  lock_handle_t handle[LOCK_BATCH_MAX];
+}lock_batch_t;
+
 /**
  * @brief Return the larger of two signed values
  * 
@@ -83,6 +224,16 @@ typedef struct tree_node_s{
  **/
 #define MAX(a, b) ((a) >= (b) ? (a): (b))
 
+/**
+ * @brief Return the smaller of two values
+ *
+ * @param[in] a Value to compare
+ * @param[in] b Value to compare
+ *
+ * @reval The smaller of a or b
+ **/
+#define MIN(a, b) ((a) <= (b) ? (a): (b))
+
 /**
  * @brief: Extra the height from the specified tree node
  *
@@ -94,11 +245,27 @@ typedef struct tree_node_s{
 #define height(p)  ((p) != NULL ? (p)->height: -1)
 
 /**
- * @brief Maximum number of supported tree nodes
+ * @brief Default number of supported tree nodes, see #treeInitCapacity
  *
  **/
 #define MAX_NODES 150
 
+/**
+ * @brief Namespace IDs the lock manager takes: those below #MAX_NAMESPACE_ID
+ * always exist, the others once attached with #lockNamespaceAttach
+ **/
+#define LOCK_NAMESPACE_LIMIT (1u << 16)
+
+/**
+ * @brief Most shards a namespace can be split into, see #lockNamespaceShards
+ **/
+#define LOCK_SHARDS_MAX 64
+
+/**
+ * @brief Size of a cache line, used to keep per namespace state apart.
+ **/
+#define CACHE_LINE_SIZE 64
+
 /**
  * @brief Array element index of the left child.
  */
@@ -110,6 +277,25 @@ typedef struct tree_node_s{
 #define RIGHT 1
 
 
+/**
+ * @brief Life cycle of a tree node
+ **/
+enum LOCK_STATE{
+  LOCK_FREE,          //0 -- @brief The node is in the arena or a magazine.
+  LOCK_QUEUED,        //1 -- @brief The node waits on the pending list of a granted lock.
+  LOCK_GRANTED,       //2 -- @brief The node is held in the tree.
+  LOCK_RELEASING      //3 -- @brief The node is still in the tree while its waiters are granted, it blocks nothing.
+};
+
+/**
+ * @brief How a queued lock learns of its grant
+ **/
+enum LOCK_NOTIFY{
+  LOCK_NOTIFY_WAKE,   //0 -- @brief Wake the thread sleeping in #lockWait, if any.
+  LOCK_NOTIFY_CQ,     //1 -- @brief Post the cookie to the completion queue, see #lockRequestAsync.
+  LOCK_NOTIFY_CALL    //2 -- @brief Call the granted hook of the node, see #lockRequestNode.
+};
+
 /**
  * @brief definitions for return value of insertion
  *
@@ -122,12 +308,126 @@ enum NODE_INSERT_RESULT{
 };
 
 
-extern tree_node_t nodes[MAX_NODES];
+/**
+ * @brief One entry of a #lock_cq_t ring
+ **/
+typedef struct lock_cq_slot_s{
+  /*
+   * position + 1 once the cookie of that position is written
+   */
+  unsigned long long sequence;
+  unsigned long long cookie;
+}lock_cq_slot_t;
+
+/**
+ * @brief Completion queue of the grants of #lockRequestAsync requests
+ *
+ * Releases in any namespace post the cookies of the asynchronous requests
+ * they grant to a lock-free ring, and signal the eventfd only when the
+ * consumer has armed it by draining the ring empty, so a burst of grants
+ * costs one wake-up. One thread, typically an event loop polling fd,
+ * drains the queue with #lockCqDrain.
+ **/
+typedef struct lock_cq_s{
+  /*
+   * eventfd, readable once cookies are waiting
+   */
+  int fd;
+
+  /*
+   * ring size - 1, the ring size is a power of 2
+   */
+  unsigned int mask;
+
+  /*
+   * asynchronous requests that may still post, at most the ring size
+   */
+  unsigned int reserved;
+
+  /*
+   * set while the consumer waits for the eventfd
+   */
+  unsigned int armed;
+
+  lock_cq_slot_t *slot;
+
+  /*
+   * next position to drain, only touched by the consumer
+   */
+  unsigned long long head __attribute__((aligned(CACHE_LINE_SIZE)));
+
+  /*
+   * next position to post to
+   */
+  unsigned long long tail __attribute__((aligned(CACHE_LINE_SIZE)));
+}lock_cq_t;
+
+/**
+ * @brief Lock state of one namespace.
+ *
+ * Every namespace is an independent shard with its own tree, event index
+ * counter and mutex, so requests to different namespaces never share a
+ * lock or a cache line. A namespace may in turn be split by LBA into
+ * shards of the same structure, see #lockNamespaceShards; the namespace
+ * itself is then the first shard. Namespaces past #MAX_NAMESPACE_ID are
+ * allocated when attached, see #lockNamespaceAttach.
+ **/
+typedef struct lock_namespace_s{
+  /**
+   * @brief Serializes the tree operations of this namespace
+   */
+  pthread_mutex_t mutex;
+
+  /**
+   * @brief Shards of a split namespace: their number, 0 or 1 if not split,
+   * log2 of the LBAs each covers, and the shards past the first
+   */
+  unsigned int shardCount;
+  unsigned int shardShift;
+  struct lock_namespace_s *shards;
+
+  /**
+   * @brief Last event index handed out in this namespace
+   */
+  unsigned long long next_index;
+
+  /**
+   * @brief Number of times the mutex was found held by another thread
+   */
+  unsigned long contended;
+
+  /**
+   * @brief Sequence count of the tree, odd while the mutex holder rewrites it
+   *
+   * Kept on its own cache line with the root, the only part of the
+   * namespace #probeRange reads, so probes never pull in the mutex line.
+   */
+  unsigned int seq __attribute__((aligned(CACHE_LINE_SIZE)));
+
+  /**
+   * @brief Root of the AVL tree of held locks
+   */
+  tree_node_t *root;
+} __attribute__((aligned(CACHE_LINE_SIZE))) lock_namespace_t;
+
+extern lock_namespace_t namespaces[MAX_NAMESPACE_ID];
 
-extern list_head_t freeNodes;
+extern unsigned int nodeCapacity;
 
 void treeInit(void);
 
+void treeInitCapacity(unsigned int capacity);
+
+int lockNamespaceShards(unsigned int namespaceID, unsigned int shardCount, unsigned int shardShift);
+
+int lockNamespaceAttach(unsigned int namespaceID);
+
+int lockNamespaceDetach(unsigned int namespaceID);
+
+lock_namespace_t *lockNamespaceGet(unsigned int namespaceID);
+
+tree_node_t *lockNodeAt(unsigned int index);
+
 tree_node_t *allocNodes();
 
 void freeNode(tree_node_t *node);
@@ -142,5 +442,40 @@ extern enum NODE_INSERT_RESULT insertNode(tree_node_t **root, tree_node_t *newNo
 
 void removeNode(tree_node_t **root, tree_node_t *node);
 
-void obtainEventInexMarker(tree_node_t *root);
+void treeDump(tree_node_t *root);
+
+int isInAVL(tree_node_t *root, tree_node_t *node);
+
+enum NODE_INSERT_RESULT lockRequest(unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned queue, unsigned int namespaceID, lock_handle_t *handle);
+
+void lockRelease(const lock_handle_t *handle);
+
+int lockWait(const lock_handle_t *handle);
+
+int lockGranted(const lock_handle_t *handle);
+
+int probeRange(unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned int namespaceID);
+
+enum NODE_INSERT_RESULT lockRange(unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned int namespaceID, lock_handle_t *handle);
+
+lock_cq_t *lockCqCreate(unsigned int capacity);
+
+void lockCqDestroy(lock_cq_t *cq);
+
+unsigned int lockCqDrain(lock_cq_t *cq, unsigned long long *cookies, unsigned int max);
+
+enum NODE_INSERT_RESULT lockRequestAsync(unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned int namespaceID, lock_cq_t *cq, unsigned long long cookie, lock_handle_t *handle);
+
+enum NODE_INSERT_RESULT lockRequestNode(tree_node_t *node, unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned int namespaceID, void (*granted)(tree_node_t *node), lock_handle_t *handle);
+
+void lockReleaseNode(const lock_handle_t *handle);
+
+enum NODE_INSERT_RESULT lockRequestBatch(const lock_range_t *ranges, unsigned int count, unsigned queue, lock_batch_t *batch);
+
+int lockBatchGranted(const lock_batch_t *batch);
+
+void lockReleaseBatch(const lock_batch_t *batch);
+#ifdef __cplusplus
+}
+#endif
 #endif//lock_manager.h
@@ -0,0 +1,316 @@
+#include<stdlib.h>
+#include<stdio.h>
+#include<string.h>
+#include<unistd.h>
+#include"lock_manager.h"
+#include"lock_engine.h"
+
+/**
+ * @file
+ * @brief Replay a block I/O trace through a lock engine
+ *
+ * The trace is text, one I/O per line, '#' starts a comment:
+ *
+ *     <issue ns> <namespace> <start lba> <blocks> <R|W> <completion ns>
+ *
+ * for example converted from blkparse output with
+ *
+ *     blkparse -f "%T%t %a %S %n %d\n" ... | awk '$2=="D"{d[$3]=$1; t[$3]=$5}
+ *       $2=="C"&&($3 in d){print d[$3]*1e9, 0, $3, $4, substr(t[$3],1,1), $1*1e9; delete d[$3]}'
+ *
+ * The trace time drives a simulated clock. An I/O that has to wait for its
+ * lock starts its service when the lock is granted and keeps the service
+ * time of the trace, completion - issue, so lock waits push the rest of
+ * the trace back like they would on the device. At most depth I/Os are in
+ * flight; an I/O issued into a full window waits for a completion.
+ *
+ * Namespaces go up to #LOCK_NAMESPACE_LIMIT - 1. The AVL manager attaches
+ * those past #MAX_NAMESPACE_ID before the replay; the other engines only
+ * take the ones below.
+ *
+ * usage: lock_replay [-e engine] [-q depth] <trace file>
+ **/
+
+/**
+ * @brief One I/O of the trace and its simulated life
+ **/
+typedef struct replay_io_s{
+  unsigned long long issue;
+  unsigned long long service;
+  unsigned int namespaceID;
+  unsigned int start_lba;
+  unsigned int end_lba;
+  unsigned int type;
+  /*
+   * simulated time the lock was requested and granted, and the service ends
+   */
+  unsigned long long requested;
+  unsigned long long granted;
+  unsigned long long completion;
+  union{
+    lock_handle_t avl;
+    unsigned char opaque[LOCK_ENGINE_HANDLE_SIZE];
+  }handle;
+}replay_io_t;
+
+static replay_io_t *ios;
+static size_t ioCount;
+
+/**
+ * @brief Min-heap of the granted I/Os by completion time
+ **/
+static size_t *heap;
+static size_t heapSize;
+
+static void heapPush(size_t io){
+  size_t n = heapSize++, parent;
+  for(; n > 0 && ios[heap[parent = (n - 1) / 2]].completion > ios[io].completion; n = parent)
+    heap[n] = heap[parent];
+  heap[n] = io;
+}
+
+static size_t heapPop(void){
+  size_t top = heap[0], last = heap[--heapSize], n = 0, child;
+  while((child = 2 * n + 1) < heapSize){
+    if(child + 1 < heapSize && ios[heap[child + 1]].completion < ios[heap[child]].completion)
+      child++;
+    if(ios[heap[child]].completion >= ios[last].completion)
+      break;
+    heap[n] = heap[child];
+    n = child;
+  }
+  heap[n] = last;
+  return top;
+}
+
+/**
+ * @brief I/Os waiting for their lock
+ **/
+static size_t *waiting;
+static size_t waitingCount;
+
+static const lock_engine_t *engine;
+
+/**
+ * @brief Simulation results
+ **/
+static unsigned long long *grantWait;
+static unsigned int *queueLength;
+static size_t queuedCount;
+static unsigned int peakHeld, peakWaiting, peakInflight;
+static unsigned int *held, *peakTree, namespaceCount;
+
+/**
+ * @brief Start the service of an I/O whose lock was granted at time now
+ **/
+static void grant(size_t io, unsigned long long now){
+  ios[io].granted    = now;
+  ios[io].completion = now + ios[io].service;
+  heapPush(io);
+  peakHeld = MAX(peakHeld, heapSize);
+  held[ios[io].namespaceID]++;
+  peakTree[ios[io].namespaceID] = MAX(peakTree[ios[io].namespaceID], held[ios[io].namespaceID]);
+}
+
+/**
+ * @brief Complete the next I/O and grant the locks its release frees up
+ *
+ * @retval Simulated time of the completion
+ **/
+static unsigned long long complete(void){
+  size_t io = heapPop(), n, kept = 0;
+  unsigned long long now = ios[io].completion;
+
+  engine->release(&ios[io].handle);
+  held[ios[io].namespaceID]--;
+  for(n = 0; n < waitingCount; n++){
+    if(engine->granted(&ios[waiting[n]].handle))
+      grant(waiting[n], now);
+    else
+      waiting[kept++] = waiting[n];
+  }
+  waitingCount = kept;
+  return now;
+}
+
+static int compareIssue(const void *a, const void *b){
+  const replay_io_t *x = a, *y = b;
+  return (x->issue > y->issue) - (x->issue < y->issue);
+}
+
+static int compareU64(const void *a, const void *b){
+  unsigned long long x = *(const unsigned long long *) a, y = *(const unsigned long long *) b;
+  return (x > y) - (x < y);
+}
+
+static int compareU32(const void *a, const void *b){
+  unsigned int x = *(const unsigned int *) a, y = *(const unsigned int *) b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * @brief Read the trace into #ios, sorted by issue time
+ *
+ * @retval 0 on success, -1 on a malformed line or out of memory
+ **/
+static int loadTrace(FILE *in, const char *path){
+  replay_io_t *grown;
+  size_t allocated = 0;
+  unsigned long line = 0;
+  char buf[256];
+
+  while(fgets(buf, sizeof(buf), in)){
+    unsigned long long issue, completion, blocks;
+    unsigned int namespaceID, start;
+    char rw;
+    line++;
+    if(buf[strspn(buf, " \t")] == '#' || buf[strspn(buf, " \t\r\n")] == '\0')
+      continue;
+    if(sscanf(buf, "%llu %u %u %llu %c %llu", &issue, &namespaceID, &start, &blocks, &rw, &completion) != 6 ||
+       blocks == 0 || start + (blocks - 1) > 0xffffffffull || completion < issue || namespaceID >= LOCK_NAMESPACE_LIMIT ||
+       (rw != 'R' && rw != 'W' && rw != 'r' && rw != 'w')){
+      fprintf(stderr, "%s:%lu: malformed I/O\n", path, line);
+      return -1;
+    }
+    if(ioCount == allocated){
+      allocated = allocated ? allocated * 2 : 4096;
+      if((grown = realloc(ios, allocated * sizeof(replay_io_t))) == NULL){
+	fprintf(stderr, "%s:%lu: out of memory for %zu I/Os\n", path, line, allocated);
+	return -1;
+      }
+      ios = grown;
+    }
+    memset(&ios[ioCount], 0, sizeof(replay_io_t));
+    ios[ioCount].issue       = issue;
+    ios[ioCount].service     = completion - issue;
+    ios[ioCount].namespaceID = namespaceID;
+    ios[ioCount].start_lba   = start;
+    ios[ioCount].end_lba     = start + (blocks - 1);
+    ios[ioCount].type        = rw == 'W' || rw == 'w';
+    namespaceCount = MAX(namespaceCount, namespaceID + 1);
+    ioCount++;
+  }
+  qsort(ios, ioCount, sizeof(replay_io_t), compareIssue);
+  return 0;
+}
+
+static void usage(const char *prog){
+  fprintf(stderr, "usage: %s [-e ", prog);
+  lockEngineList(stderr);
+  fprintf(stderr, "] [-q depth] <trace file>\n");
+  exit(1);
+}
+
+int main(int argc, char **argv){
+  unsigned int depth = 32, peakNamespace = 0;
+  unsigned long long now = 0, waitSum = 0;
+  size_t n, waited = 0;
+  FILE *in;
+  int opt;
+
+  engine = &lockEngines[0];
+  while((opt = getopt(argc, argv, "e:q:")) != -1){
+    switch(opt){
+    case 'e':
+      if((engine = lockEngineFind(optarg)) == NULL)
+	usage(argv[0]);
+      break;
+    case 'q': depth = strtoul(optarg, NULL, 0); break;
+    default: usage(argv[0]);
+    }
+  }
+  if(optind != argc - 1 || depth == 0)
+    usage(argv[0]);
+  if((in = fopen(argv[optind], "r")) == NULL){
+    fprintf(stderr, "%s: can not open trace file %s\n", argv[0], argv[optind]);
+    return 1;
+  }
+  if(loadTrace(in, argv[optind]) != 0)
+    return 1;
+  fclose(in);
+  if(ioCount == 0){
+    fprintf(stderr, "%s: no I/O in %s\n", argv[0], argv[optind]);
+    return 1;
+  }
+
+  engine->init(depth);
+  heap        = malloc(sizeof(size_t) * depth);
+  waiting     = malloc(sizeof(size_t) * depth);
+  grantWait    = malloc(sizeof(unsigned long long) * ioCount);
+  queueLength = malloc(sizeof(unsigned int) * ioCount);
+  held        = calloc(namespaceCount, sizeof(unsigned int));
+  peakTree    = calloc(namespaceCount, sizeof(unsigned int));
+  if(!heap || !waiting || !grantWait || !queueLength || !held || !peakTree){
+    fprintf(stderr, "%s: out of memory for %zu I/Os\n", argv[0], ioCount);
+    return 1;
+  }
+
+  /*
+   * only the AVL manager attaches namespaces past MAX_NAMESPACE_ID
+   */
+  for(n = 0; n < ioCount; n++){
+    if(ios[n].namespaceID < MAX_NAMESPACE_ID || lockNamespaceGet(ios[n].namespaceID))
+      continue;
+    if(engine != &lockEngines[0] || lockNamespaceAttach(ios[n].namespaceID) != 0){
+      fprintf(stderr, "%s: engine %s can not take namespace %u\n", argv[0], engine->name, ios[n].namespaceID);
+      return 1;
+    }
+  }
+
+  for(n = 0; n < ioCount; n++){
+    replay_io_t *io = &ios[n];
+    enum NODE_INSERT_RESULT ret;
+
+    /*
+     * finish what completed before the issue, then wait for room in the window
+     */
+    while(heapSize && ios[heap[0]].completion <= io->issue)
+      now = complete();
+    while(heapSize + waitingCount == depth)
+      now = complete();
+    io->requested = MAX(now, io->issue);
+
+    ret = engine->request(io->start_lba, io->end_lba, io->type, io->namespaceID, &io->handle);
+    if(ret == NODE_ADDED)
+      grant(n, io->requested);
+    else if(ret == NODE_QUEUED){
+      if(engine->queueLength)
+	queueLength[queuedCount] = engine->queueLength(&io->handle);
+      queuedCount++;
+      waiting[waitingCount++] = n;
+    }
+    else{
+      fprintf(stderr, "%s: lock request of I/O %zu failed\n", argv[0], n);
+      return 1;
+    }
+    peakWaiting  = MAX(peakWaiting, waitingCount);
+    peakInflight = MAX(peakInflight, heapSize + waitingCount);
+  }
+  while(heapSize)
+    now = complete();
+
+  for(n = 0; n < ioCount; n++){
+    grantWait[n] = ios[n].granted - ios[n].requested;
+    waitSum += grantWait[n];
+    waited  += grantWait[n] != 0;
+  }
+  qsort(grantWait, ioCount, sizeof(unsigned long long), compareU64);
+  for(n = 1; n < namespaceCount; n++)
+    if(peakTree[n] > peakTree[peakNamespace])
+      peakNamespace = n;
+
+  printf("engine %s depth %u: %zu I/Os, %.1f%% waited for their lock, trace time %.3f s replayed in %.3f s\n",
+	 engine->name, depth, ioCount, 100.0 * waited / ioCount,
+	 (ios[ioCount - 1].issue - ios[0].issue) / 1e9, (now - ios[0].issue) / 1e9);
+  printf("lock wait  mean %llu ns  p50 %llu ns  p90 %llu ns  p99 %llu ns  p999 %llu ns  max %llu ns\n",
+	 waitSum / ioCount, grantWait[ioCount / 2], grantWait[ioCount * 9 / 10],
+	 grantWait[ioCount * 99 / 100], grantWait[ioCount * 999 / 1000], grantWait[ioCount - 1]);
+  printf("peak locks held %u, largest tree %u (namespace %u), peak waiting %u, peak nodes in use %u\n",
+	 peakHeld, peakTree[peakNamespace], peakNamespace, peakWaiting, peakInflight);
+  if(queuedCount && engine->queueLength){
+    qsort(queueLength, queuedCount, sizeof(unsigned int), compareU32);
+    printf("pending list length at queueing  p50 %u  p99 %u  max %u\n",
+	   queueLength[queuedCount / 2], queueLength[queuedCount * 99 / 100], queueLength[queuedCount - 1]);
+  }
+  return 0;
+}
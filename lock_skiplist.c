@@ -0,0 +1,328 @@
+#include<stdlib.h>
+#include<string.h>
+#include<sched.h>
+#include"lock_manager.h"
+#include"lock_epoch.h"
+#include"lock_skiplist.h"
+
+/**
+ * @brief Mark bit of a link, set on the links of a deleted node
+ **/
+#define SKIP_MARK ((uintptr_t) 1)
+
+static inline skip_node_t *skipPtr(uintptr_t link){
+  return (skip_node_t *) (link & ~SKIP_MARK);
+}
+
+/**
+ * @brief Skip list of one namespace
+ **/
+typedef struct skip_namespace_s{
+  skip_node_t *head;
+}__attribute__((aligned(CACHE_LINE_SIZE))) skip_namespace_t;
+
+static skip_namespace_t skipNamespaces[MAX_NAMESPACE_ID];
+
+static __thread unsigned int skipSeed;
+
+/**
+ * @brief Draw the level of a new node, xorshift32
+ **/
+static unsigned int skipLevel(void){
+  unsigned int x = skipSeed ? skipSeed : ((unsigned int) (uintptr_t) &skipSeed | 1);
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  skipSeed = x;
+  return 1 + __builtin_ctz(x | 1u << (2 * (SKIP_LEVELS - 1))) / 2;
+}
+
+/**
+ * @brief Find the last node before key and the first one from key on, on every level
+ *
+ * Unlinks the deleted nodes it meets on the way; restarts from the head
+ * whenever the predecessor it unlinks from changed under it.
+ *
+ * @param[in]  head  -- sentinel of the namespace
+ * @param[in]  key   -- start LBA searched for, one past it to step over the nodes starting there
+ * @param[out] preds -- last node starting before key on each level, or head
+ * @param[out] succs -- the node after preds on each level, NULL at the end
+ **/
+static void skipFind(skip_node_t *head, unsigned long long key, skip_node_t **preds, skip_node_t **succs){
+  skip_node_t *pred, *cur;
+  uintptr_t link;
+  int level;
+
+retry:
+  pred = head;
+  for(level = SKIP_LEVELS - 1; level >= 0; level--){
+    cur = skipPtr(__atomic_load_n(&pred->next[level], __ATOMIC_ACQUIRE));
+    while(cur){
+      link = __atomic_load_n(&cur->next[level], __ATOMIC_ACQUIRE);
+      if(link & SKIP_MARK){
+	uintptr_t expected = (uintptr_t) cur;
+	if(!__atomic_compare_exchange_n(&pred->next[level], &expected, link & ~SKIP_MARK, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+	  goto retry;
+	cur = skipPtr(link);
+	continue;
+      }
+      if(cur->start_lba >= key)
+	break;
+      pred = cur;
+      cur  = skipPtr(link);
+    }
+    preds[level] = pred;
+    succs[level] = cur;
+  }
+}
+
+/**
+ * @brief Try to grant a request without waiting
+ *
+ * Links the request in as an entry if its range overlaps no entry, or adds
+ * a read to the granted read that contains it. A new entry takes no holder
+ * until it is linked on every level, so nobody can remove it half linked.
+ *
+ * @retval NULL -- granted, req->entry is set
+ * @retval The entry the range conflicts with
+ **/
+static skip_node_t *skipAcquire(skip_namespace_t *ns, skip_node_t *req){
+  skip_node_t *preds[SKIP_LEVELS], *succs[SKIP_LEVELS], *pred, *succ, *hit;
+  unsigned int level, holders;
+  uintptr_t expected;
+
+  for(;;){
+    skipFind(ns->head, req->start_lba, preds, succs);
+    pred = preds[0];
+    succ = succs[0];
+    hit  = NULL;
+    /*
+     * entries never overlap, only the two neighbours can
+     */
+    if(pred != ns->head && pred->end_lba >= req->start_lba)
+      hit = pred;
+    if(succ && succ->start_lba <= req->end_lba){
+      if(hit)
+	return hit;
+      hit = succ;
+    }
+    if(hit){
+      /*
+       * no joining a read a writer already waits for
+       */
+      if(req->type || hit->type || hit->start_lba > req->start_lba || hit->end_lba < req->end_lba ||
+	 __atomic_load_n(&hit->waitHead, __ATOMIC_RELAXED))
+	return hit;
+      holders = __atomic_load_n(&hit->holders, __ATOMIC_ACQUIRE);
+      while(holders)
+	if(__atomic_compare_exchange_n(&hit->holders, &holders, holders + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+	  req->entry = hit;
+	  return NULL;
+	}
+      return hit;
+    }
+
+    for(level = 0; level < req->level; level++)
+      __atomic_store_n(&req->next[level], (uintptr_t) succs[level], __ATOMIC_RELAXED);
+    expected = (uintptr_t) succ;
+    if(!__atomic_compare_exchange_n(&pred->next[0], &expected, (uintptr_t) req, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      continue;
+
+    for(level = 1; level < req->level; level++){
+      for(;;){
+	expected = (uintptr_t) succs[level];
+	if(__atomic_compare_exchange_n(&preds[level]->next[level], &expected, (uintptr_t) req, 0,
+				       __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+	  break;
+	skipFind(ns->head, req->start_lba, preds, succs);
+	__atomic_store_n(&req->next[level], (uintptr_t) succs[level], __ATOMIC_RELAXED);
+      }
+    }
+    req->entry = req;
+    __atomic_store_n(&req->holders, 1, __ATOMIC_RELEASE);
+    return NULL;
+  }
+}
+
+/**
+ * @brief Take the wait list lock of an entry, held for a few stores at most
+ **/
+static inline void skipWaitLock(skip_node_t *entry){
+  while(__atomic_exchange_n(&entry->waitLock, 1, __ATOMIC_ACQUIRE))
+    while(__atomic_load_n(&entry->waitLock, __ATOMIC_RELAXED))
+      sched_yield();
+}
+
+static inline void skipWaitUnlock(skip_node_t *entry){
+  __atomic_store_n(&entry->waitLock, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Grant a request, or queue it on the entry it conflicts with
+ *
+ * An entry closes its wait list under the list lock once it is deleted, so
+ * a request either gets on the list before the release takes it over, or
+ * finds it closed and tries again.
+ *
+ * @retval 1 -- granted
+ * @retval 0 -- queued
+ **/
+static int skipAcquireOrWait(skip_namespace_t *ns, skip_node_t *req){
+  skip_node_t *hit;
+
+  while((hit = skipAcquire(ns, req)) != NULL){
+    skipWaitLock(hit);
+    if(!hit->closed){
+      req->waitNext = NULL;
+      if(hit->waitTail)
+	hit->waitTail->waitNext = req;
+      else
+	__atomic_store_n(&hit->waitHead, req, __ATOMIC_RELAXED);
+      hit->waitTail = req;
+      skipWaitUnlock(hit);
+      return 0;
+    }
+    skipWaitUnlock(hit);
+  }
+  return 1;
+}
+
+/**
+ * @brief Delete an entry whose last holder let go, unlink it from every level, then retry its waiters
+ *
+ * Marking level 0 is the release. The search walks over every node starting
+ * at the entry's LBA, so it also unlinks the entry behind a node that was
+ * linked in front of it meanwhile; after it the entry is unreachable.
+ * The waiters are retried in the order they queued, each is granted or
+ * queued again on the next entry in its way.
+ **/
+static void skipRemove(skip_namespace_t *ns, skip_node_t *entry){
+  skip_node_t *preds[SKIP_LEVELS], *succs[SKIP_LEVELS], *waiter, *next;
+  uintptr_t link;
+  int level;
+
+  for(level = entry->level - 1; level >= 0; level--){
+    link = __atomic_load_n(&entry->next[level], __ATOMIC_RELAXED);
+    while(!(link & SKIP_MARK) &&
+	  !__atomic_compare_exchange_n(&entry->next[level], &link, link | SKIP_MARK, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+      continue;
+  }
+  skipFind(ns->head, entry->start_lba + 1ull, preds, succs);
+
+  skipWaitLock(entry);
+  entry->closed = 1;
+  waiter = entry->waitHead;
+  skipWaitUnlock(entry);
+  for(; waiter; waiter = next){
+    next = waiter->waitNext;
+    if(skipAcquireOrWait(ns, waiter))
+      __atomic_store_n(&waiter->state, LOCK_GRANTED, __ATOMIC_RELEASE);
+  }
+}
+
+/**
+ * @brief Free the waiters of an entry, then the entry
+ **/
+static void skipFreeEntry(skip_node_t *entry){
+  skip_node_t *waiter, *next;
+  for(waiter = entry->waitHead; waiter; waiter = next){
+    next = waiter->waitNext;
+    free(waiter);
+  }
+  free(entry);
+}
+
+/**
+ * @brief Reset the engine, every lock must be released
+ *
+ * Nodes come from malloc, capacity is not a limit here.
+ **/
+void skipListInit(unsigned int capacity){
+  skip_namespace_t *ns;
+  skip_node_t *node, *next;
+
+  (void) capacity;
+  for(ns = skipNamespaces; ns < skipNamespaces + MAX_NAMESPACE_ID; ns++){
+    if(ns->head == NULL){
+      if((ns->head = calloc(1, sizeof(skip_node_t) + SKIP_LEVELS * sizeof(uintptr_t))) == NULL)
+	abort();
+      ns->head->level = SKIP_LEVELS;
+    }
+    for(node = skipPtr(ns->head->next[0]); node; node = next){
+      next = skipPtr(node->next[0]);
+      skipFreeEntry(node);
+    }
+    memset(ns->head->next, 0, SKIP_LEVELS * sizeof(uintptr_t));
+  }
+  epochBarrier();
+}
+
+/**
+ * @brief Request a lock, see #lock_engine_t
+ *
+ * @param[out] handle -- a #skip_handle_t
+ **/
+enum NODE_INSERT_RESULT skipListRequest(unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned int namespaceID, void *handle){
+  skip_handle_t *h = handle;
+  unsigned int level;
+  skip_node_t *req;
+  int granted;
+
+  if(namespaceID >= MAX_NAMESPACE_ID || start_lba > end_lba)
+    return NODE_FAILED;
+  level = skipLevel();
+  if((req = malloc(sizeof(skip_node_t) + level * sizeof(uintptr_t))) == NULL)
+    return NODE_FAILED;
+  req->start_lba = start_lba;
+  req->end_lba   = end_lba;
+  req->type      = type;
+  req->level     = level;
+  req->state     = LOCK_QUEUED;
+  req->waitLock  = 0;
+  req->closed    = 0;
+  req->holders   = 0;
+  req->entry     = NULL;
+  req->waitHead  = NULL;
+  req->waitTail  = NULL;
+  req->waitNext  = NULL;
+  h->node        = req;
+  h->namespaceID = namespaceID;
+
+  /*
+   * a queued request may be granted by another thread before this returns
+   */
+  epochEnter();
+  granted = skipAcquireOrWait(&skipNamespaces[namespaceID], req);
+  epochExit();
+  if(!granted)
+    return NODE_QUEUED;
+  req->state = LOCK_GRANTED;
+  return NODE_ADDED;
+}
+
+/**
+ * @brief Nonzero once the request behind the handle holds its lock
+ **/
+int skipListGranted(void *handle){
+  return __atomic_load_n(&((skip_handle_t *) handle)->node->state, __ATOMIC_ACQUIRE) == LOCK_GRANTED;
+}
+
+/**
+ * @brief Release a granted lock
+ *
+ * The last holder of an entry removes it and retries the requests waiting on it.
+ **/
+void skipListRelease(void *handle){
+  skip_handle_t *h = handle;
+  skip_node_t *node = h->node, *entry = node->entry;
+
+  epochEnter();
+  if(__atomic_sub_fetch(&entry->holders, 1, __ATOMIC_ACQ_REL) == 0){
+    skipRemove(&skipNamespaces[h->namespaceID], entry);
+    epochRetire(entry);
+  }
+  if(node != entry)
+    free(node);
+  epochExit();
+}
@@ -0,0 +1,86 @@
+#ifndef LOCK_SKIPLIST_H
+#define LOCK_SKIPLIST_H
+#include <stdint.h>
+#include "lock_manager.h"
+#ifdef __cplusplus
+extern "C" {
+#endif
+/**
+ * @file
+ * @brief Lock-free skip list range lock engine
+ *
+ * Granted ranges sit in one skip list per namespace ordered by start LBA,
+ * no two of them overlapping, so a request only has to look at its two
+ * neighbours: a range that overlaps neither is linked in with a CAS, and
+ * requests on disjoint ranges never wait on each other. A read contained in
+ * a granted read joins it. Anything else conflicts and takes the slow path:
+ * it waits on the entry it collided with, and the release that removes the
+ * entry retries its waiters, which may go on to wait on another entry.
+ *
+ * Unlike the AVL manager a new request is only held back by granted
+ * ranges, not by queued ones it overlaps; a read may still not join a read
+ * that has waiters. Reads partly overlapping a granted read queue behind
+ * it rather than sharing.
+ **/
+
+/**
+ * @brief Skip levels, a node gets level l with probability 4^-l
+ **/
+#define SKIP_LEVELS 12
+
+/**
+ * @brief A lock request, and the skip list entry of the range it was granted by itself
+ **/
+typedef struct skip_node_s{
+  unsigned int start_lba;
+  unsigned int end_lba;
+  unsigned char type;
+  /*
+   * number of links in next
+   */
+  unsigned char level;
+  unsigned char state;
+  /*
+   * entry: guards its wait list, closed once the entry is deleted
+   */
+  unsigned char waitLock;
+  unsigned char closed;
+  /*
+   * entry: requests holding it, set once linked on every level, 0 once it dies
+   */
+  unsigned int holders;
+  /*
+   * request: the entry its lock is held on, itself unless it joined a read
+   */
+  struct skip_node_s *entry;
+  /*
+   * entry: FIFO of the requests waiting for it to go, linked through waitNext
+   */
+  struct skip_node_s *waitHead;
+  struct skip_node_s *waitTail;
+  struct skip_node_s *waitNext;
+  /*
+   * successor on each level, bit 0 set once the node is deleted from that level
+   */
+  uintptr_t next[];
+}skip_node_t;
+
+/**
+ * @brief Handle of a skip list lock
+ **/
+typedef struct skip_handle_s{
+  skip_node_t *node;
+  unsigned int namespaceID;
+}skip_handle_t;
+
+void skipListInit(unsigned int capacity);
+
+enum NODE_INSERT_RESULT skipListRequest(unsigned int start_lba, unsigned int end_lba, unsigned int type, unsigned int namespaceID, void *handle);
+
+int skipListGranted(void *handle);
+
+void skipListRelease(void *handle);
+#ifdef __cplusplus
+}
+#endif
+#endif//lock_skiplist.h
@@ -0,0 +1,221 @@
+#include<stdlib.h>
+#include<string.h>
+#include<time.h>
+#include<pthread.h>
+#include"lock_manager.h"
+#include"lock_stats.h"
+
+/**
+ * @brief Statistics block of one thread
+ *
+ * Cache line aligned, and the counters start a line of their own, so
+ * neither another thread's allocation nor a neighbour relinking the
+ * registry touches a line the thread counts into.
+ */
+typedef struct lock_stats_thread_s{
+  struct lock_stats_thread_s *next;
+  struct lock_stats_thread_s *prev;
+  lock_stats_t ns[MAX_NAMESPACE_ID] __attribute__((aligned(CACHE_LINE_SIZE)));
+}__attribute__((aligned(CACHE_LINE_SIZE))) lock_stats_thread_t;
+
+/**
+ * @brief Registry of the live thread blocks, and the sums of the threads that exited
+ */
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+static lock_stats_thread_t statsThreads = { &statsThreads, &statsThreads };
+static lock_stats_t statsRetired[MAX_NAMESPACE_ID];
+
+static __thread lock_stats_thread_t *statsThread;
+static pthread_key_t statsKey;
+static pthread_once_t statsOnce = PTHREAD_ONCE_INIT;
+
+int lockStatsTimed;
+
+#define STATS_COUNTERS (sizeof(lock_stats_t) / sizeof(unsigned long long))
+
+/**
+ * @brief Add every counter of src to dst
+ **/
+static void statsAdd(lock_stats_t *dst, const lock_stats_t *src){
+  unsigned long long *d = (unsigned long long *) dst;
+  const unsigned long long *s = (const unsigned long long *) src;
+  size_t n;
+  for(n = 0; n < STATS_COUNTERS; n++)
+    d[n] += __atomic_load_n(&s[n], __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Thread exit hook, folds the thread's counts into #statsRetired
+ **/
+static void statsThreadExit(void *arg){
+  lock_stats_thread_t *thread = arg;
+  unsigned int n;
+
+  pthread_mutex_lock(&statsLock);
+  for(n = 0; n < MAX_NAMESPACE_ID; n++)
+    statsAdd(&statsRetired[n], &thread->ns[n]);
+  thread->prev->next = thread->next;
+  thread->next->prev = thread->prev;
+  pthread_mutex_unlock(&statsLock);
+  free(thread);
+  statsThread = NULL;
+}
+
+static void statsKeyCreate(void){
+  pthread_key_create(&statsKey, statsThreadExit);
+}
+
+/**
+ * @brief Get the statistics block of the calling thread, registering it on first use
+ *
+ * @retval Pointer to the block, NULL if it could not be allocated
+ **/
+static lock_stats_thread_t *statsLocal(void){
+  lock_stats_thread_t *thread = statsThread;
+  if(thread == NULL && (thread = aligned_alloc(CACHE_LINE_SIZE, sizeof(lock_stats_thread_t))) != NULL){
+    memset(thread, 0, sizeof(lock_stats_thread_t));
+    pthread_once(&statsOnce, statsKeyCreate);
+    pthread_setspecific(statsKey, thread);
+    pthread_mutex_lock(&statsLock);
+    thread->next = statsThreads.next;
+    thread->prev = &statsThreads;
+    thread->next->prev = thread;
+    statsThreads.next = thread;
+    pthread_mutex_unlock(&statsLock);
+    statsThread = thread;
+  }
+  return thread;
+}
+
+/**
+ * @brief Count one event, see #STATS_COUNT
+ *
+ * @param[in] namespaceID -- namespace of the event
+ * @param[in] counter     -- offset of the counter in #lock_stats_t
+ **/
+void lockStatsCount(unsigned int namespaceID, size_t counter){
+  lock_stats_thread_t *thread = statsLocal();
+  unsigned long long *c;
+  if(thread == NULL || namespaceID >= MAX_NAMESPACE_ID)
+    return;
+  c = (unsigned long long *) ((char *) &thread->ns[namespaceID] + counter);
+  __atomic_store_n(c, *c + 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds
+ **/
+unsigned long long lockStatsNow(void){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+/**
+ * @brief Count the time between two stamps in its log2 bucket, see #STATS_TIME_AT
+ *
+ * An interval with either end stamped while timing was off is not counted.
+ *
+ * @param[in] namespaceID -- namespace of the event
+ * @param[in] hist        -- offset of the histogram in #lock_stats_t
+ * @param[in] since       -- #lockStatsNow when the interval started
+ * @param[in] now         -- #lockStatsNow when the interval ended
+ **/
+void lockStatsTimeAt(unsigned int namespaceID, size_t hist, unsigned long long since, unsigned long long now){
+  unsigned long long nanos = now - since;
+  unsigned int bucket = 63 - __builtin_clzll(nanos | 1);
+  if(since == 0 || now == 0)
+    return;
+  lockStatsCount(namespaceID, hist + sizeof(unsigned long long) * MIN(bucket, LOCK_STATS_BUCKETS - 1));
+}
+
+/**
+ * @brief Count the time since a stamp in its log2 bucket, see #STATS_TIME
+ *
+ * @param[in] namespaceID -- namespace of the event
+ * @param[in] hist        -- offset of the histogram in #lock_stats_t
+ * @param[in] since       -- #lockStatsNow when the interval started
+ **/
+void lockStatsTime(unsigned int namespaceID, size_t hist, unsigned long long since){
+  if(since)
+    lockStatsTimeAt(namespaceID, hist, since, lockStatsNow());
+}
+
+/**
+ * @brief Switch the wait and hold histograms on or off
+ *
+ * Off by default: a request or release then costs no clock read. Locks
+ * requested while timing was off are not timed when they are granted or
+ * released.
+ *
+ * @param[in] enable -- nonzero to time the requests from now on
+ **/
+void lockStatsTiming(int enable){
+  __atomic_store_n(&lockStatsTimed, enable != 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Sum the counters of a namespace over all threads
+ *
+ * The threads keep counting while the snapshot is taken, so counters read
+ * at slightly different times may not add up exactly.
+ *
+ * @param[in]  namespaceID -- the namespace
+ * @param[out] stats       -- the summed counters
+ **/
+void lockStatsSnapshot(unsigned int namespaceID, lock_stats_t *stats){
+  lock_stats_thread_t *thread;
+
+  memset(stats, 0, sizeof(lock_stats_t));
+  if(namespaceID >= MAX_NAMESPACE_ID)
+    return;
+  pthread_mutex_lock(&statsLock);
+  statsAdd(stats, &statsRetired[namespaceID]);
+  for(thread = statsThreads.next; thread != &statsThreads; thread = thread->next)
+    statsAdd(stats, &thread->ns[namespaceID]);
+  pthread_mutex_unlock(&statsLock);
+}
+
+/**
+ * @brief Zero the counters of every namespace
+ *
+ * Counts made while resetting may survive it.
+ **/
+void lockStatsReset(void){
+  lock_stats_thread_t *thread;
+  unsigned long long *c;
+  size_t n;
+
+  pthread_mutex_lock(&statsLock);
+  memset(statsRetired, 0, sizeof(statsRetired));
+  for(thread = statsThreads.next; thread != &statsThreads; thread = thread->next){
+    c = (unsigned long long *) thread->ns;
+    for(n = 0; n < STATS_COUNTERS * MAX_NAMESPACE_ID; n++)
+      __atomic_store_n(&c[n], 0, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&statsLock);
+}
+
+/**
+ * @brief Estimate a percentile of a histogram
+ *
+ * @param[in] hist       -- #LOCK_STATS_BUCKETS buckets
+ * @param[in] percentile -- 0 to 100
+ *
+ * @retval Upper bound of the bucket holding the percentile in nanoseconds, 0 for an empty histogram
+ **/
+unsigned long long lockStatsPercentile(const unsigned long long *hist, double percentile){
+  unsigned long long total = 0, seen = 0;
+  unsigned int b;
+
+  for(b = 0; b < LOCK_STATS_BUCKETS; b++)
+    total += hist[b];
+  if(total == 0)
+    return 0;
+  for(b = 0; b < LOCK_STATS_BUCKETS - 1; b++){
+    seen += hist[b];
+    if(seen * 100.0 >= total * percentile)
+      break;
+  }
+  return (2ull << b) - 1;
+}
@@ -0,0 +1,137 @@
+#ifndef LOCK_STATS_H
+#define LOCK_STATS_H
+#include <stddef.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+/**
+ * @file
+ * @brief Lock Manager statistics
+ *
+ * Every thread counts into its own cache line aligned block, one per
+ * namespace; the blocks are only summed up when #lockStatsSnapshot is
+ * called, so counting never shares a cache line between threads. Only the namespaces below
+ * #MAX_NAMESPACE_ID are counted, so a thread's block stays a fixed size
+ * however many namespaces are attached.
+ *
+ * The counters are always kept. The wait and hold histograms need a clock
+ * read on every request and release, so they are only filled while timing
+ * is switched on with #lockStatsTiming.
+ **/
+
+/**
+ * @brief Statistics compiled in, build with -DLOCK_STATS=0 to drop them
+ **/
+#ifndef LOCK_STATS
+#define LOCK_STATS 1
+#endif
+
+/**
+ * @brief Number of histogram buckets, bucket b counts times of 2^b to 2^(b+1) - 1 nanoseconds
+ **/
+#define LOCK_STATS_BUCKETS 40
+
+/**
+ * @brief Counters of one namespace
+ **/
+typedef struct lock_stats_s{
+  /*
+   * lockRequest calls
+   */
+  unsigned long long requests;
+  /*
+   * requests granted immediately, NODE_ADDED
+   */
+  unsigned long long added;
+  /*
+   * requests put on a pending list, NODE_QUEUED
+   */
+  unsigned long long queued;
+  /*
+   * requests refused, NODE_COLLISION
+   */
+  unsigned long long collisions;
+  /*
+   * requests without a free node, NODE_FAILED
+   */
+  unsigned long long failed;
+  /*
+   * granted locks released
+   */
+  unsigned long long releases;
+  /*
+   * queued locks granted by a release
+   */
+  unsigned long long promotions;
+  /*
+   * lockWait calls that outlasted their spin and slept on the futex
+   */
+  unsigned long long parks;
+  /*
+   * probeRange calls, and those that gave up on the sequence count and took the mutex
+   */
+  unsigned long long probes;
+  unsigned long long probesLocked;
+  /*
+   * time from NODE_QUEUED to the grant
+   */
+  unsigned long long waitHist[LOCK_STATS_BUCKETS];
+  /*
+   * time from the grant to the release
+   */
+  unsigned long long holdHist[LOCK_STATS_BUCKETS];
+}lock_stats_t;
+
+void lockStatsSnapshot(unsigned int namespaceID, lock_stats_t *stats);
+
+void lockStatsReset(void);
+
+unsigned long long lockStatsPercentile(const unsigned long long *hist, double percentile);
+
+void lockStatsTiming(int enable);
+
+/**
+ * @brief Set while the histograms are filled, see #lockStatsTiming
+ **/
+extern int lockStatsTimed;
+
+#if LOCK_STATS
+void lockStatsCount(unsigned int namespaceID, size_t counter);
+
+void lockStatsTime(unsigned int namespaceID, size_t hist, unsigned long long since);
+
+void lockStatsTimeAt(unsigned int namespaceID, size_t hist, unsigned long long since, unsigned long long now);
+
+unsigned long long lockStatsNow(void);
+
+/**
+ * @brief Count one event of a #lock_stats_t counter
+ **/
+#define STATS_COUNT(ns, counter)   lockStatsCount(ns, offsetof(lock_stats_t, counter))
+
+/**
+ * @brief Add the time since a #STATS_STAMP to a #lock_stats_t histogram
+ **/
+#define STATS_TIME(ns, hist, since) lockStatsTime(ns, offsetof(lock_stats_t, hist), since)
+
+/**
+ * @brief Add the time between a #STATS_STAMP and a later one to a #lock_stats_t histogram,
+ * for timing a batch of events against one clock read
+ **/
+#define STATS_TIME_AT(ns, hist, since, now) lockStatsTimeAt(ns, offsetof(lock_stats_t, hist), since, now)
+
+/**
+ * @brief Current time for #STATS_TIME, 0 while timing is off
+ **/
+#define STATS_STAMP()              (__atomic_load_n(&lockStatsTimed, __ATOMIC_RELAXED) ? lockStatsNow() : 0)
+#else
+#define STATS_COUNT(ns, counter)   do{ }while(0)
+#define STATS_TIME(ns, hist, since) do{ }while(0)
+#define STATS_TIME_AT(ns, hist, since, now) do{ }while(0)
+#define STATS_STAMP()              0
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif//lock_stats.h
@@ -0,0 +1,144 @@
+#include<stdlib.h>
+#include<string.h>
+#include<stdio.h>
+#include<time.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<pthread.h>
+#include<sys/mman.h>
+#include<sys/syscall.h>
+#include"lock_trace.h"
+
+#ifdef LOCK_TRACE_RING
+/**
+ * @brief The mapped trace file, NULL while tracing is off
+ */
+static lock_trace_file_t *traceFile;
+
+/**
+ * @brief Ring of the calling thread, claimed on its first record
+ */
+static __thread lock_trace_ring_t *traceRing;
+static __thread lock_trace_file_t *traceRingFile;
+
+static pthread_key_t traceKey;
+static pthread_once_t traceOnce = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief Thread exit hook, gives the thread's ring back to the file it still traces into
+ **/
+static void traceThreadExit(void *arg){
+  lock_trace_file_t *file = traceRingFile;
+  (void) arg;
+  if(traceRing && file && file == __atomic_load_n(&traceFile, __ATOMIC_ACQUIRE))
+    __atomic_fetch_and(&file->owned, ~(1ull << (traceRing - file->ring)), __ATOMIC_RELEASE);
+  traceRing = NULL;
+  traceRingFile = NULL;
+}
+
+static void traceKeyCreate(void){
+  pthread_key_create(&traceKey, traceThreadExit);
+}
+
+/**
+ * @brief Claim the lowest free ring of a file for the calling thread
+ *
+ * @retval Pointer to the ring, NULL if every ring is owned
+ **/
+static lock_trace_ring_t *traceClaim(lock_trace_file_t *file){
+  uint64_t owned = __atomic_load_n(&file->owned, __ATOMIC_RELAXED);
+  uint32_t n, claimed;
+
+  do{
+    if(owned == ~0ull)
+      return NULL;
+    n = __builtin_ctzll(~owned);
+  }while(!__atomic_compare_exchange_n(&file->owned, &owned, owned | (1ull << n), 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+  claimed = __atomic_load_n(&file->claimed, __ATOMIC_RELAXED);
+  while(claimed <= n && !__atomic_compare_exchange_n(&file->claimed, &claimed, n + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    continue;
+  pthread_once(&traceOnce, traceKeyCreate);
+  pthread_setspecific(traceKey, &file->ring[n]);
+  file->ring[n].tid = syscall(SYS_gettid);
+  return &file->ring[n];
+}
+
+/**
+ * @brief Create the trace file and start recording into it
+ *
+ * Every thread gets its own ring in a shared mapping of the file, so the
+ * records are in the file even if the process dies, and lock_tracedump
+ * can read them at any time.
+ *
+ * @param[in] path -- the trace file, truncated if it exists
+ *
+ * @retval 0 on success, -1 if the file could not be created or mapped
+ **/
+int lockTraceOpen(const char *path){
+  lock_trace_file_t *file;
+  int fd;
+
+  if((fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+    return -1;
+  if(ftruncate(fd, sizeof(lock_trace_file_t)) != 0 ||
+     (file = mmap(NULL, sizeof(lock_trace_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED){
+    close(fd);
+    return -1;
+  }
+  close(fd);
+  file->ringSize = LOCK_TRACE_RING_SIZE;
+  file->rings    = LOCK_TRACE_RINGS;
+  __atomic_store_n(&file->magic, LOCK_TRACE_MAGIC, __ATOMIC_RELEASE);
+  lockTraceClose();
+  __atomic_store_n(&traceFile, file, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/**
+ * @brief Stop recording and unmap the trace file
+ *
+ * Must not race with threads still recording.
+ **/
+void lockTraceClose(void){
+  lock_trace_file_t *file = __atomic_exchange_n(&traceFile, NULL, __ATOMIC_ACQ_REL);
+  if(file)
+    munmap(file, sizeof(lock_trace_file_t));
+}
+
+/**
+ * @brief Append a record to the calling thread's ring
+ *
+ * Only the owning thread writes a ring, so appending is a plain store of
+ * the record followed by a release store of the head. A thread without a
+ * ring tries to claim one on every record, and counts the record dropped
+ * while none is free.
+ **/
+void lockTraceRecord(unsigned int op, unsigned int namespaceID, unsigned int start_lba, unsigned int end_lba, uint64_t eventIndex, unsigned int result){
+  lock_trace_file_t *file = __atomic_load_n(&traceFile, __ATOMIC_ACQUIRE);
+  lock_trace_record_t *record;
+  struct timespec now;
+
+  if(file == NULL)
+    return;
+  if(traceRingFile != file){
+    traceRingFile = file;
+    traceRing = NULL;
+  }
+  if(traceRing == NULL && (traceRing = traceClaim(file)) == NULL){
+    __atomic_fetch_add(&file->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  record = &traceRing->record[traceRing->head & (LOCK_TRACE_RING_SIZE - 1)];
+  record->timestamp   = now.tv_sec * 1000000000ull + now.tv_nsec;
+  record->eventIndex  = eventIndex;
+  record->start_lba   = start_lba;
+  record->end_lba     = end_lba;
+  record->tid         = traceRing->tid;
+  record->namespaceID = namespaceID;
+  record->op          = op;
+  record->result      = result;
+  __atomic_store_n(&traceRing->head, traceRing->head + 1, __ATOMIC_RELEASE);
+}
+#endif
@@ -0,0 +1,160 @@
+#ifndef LOCK_TRACE_H
+#define LOCK_TRACE_H
+#include <stdio.h>
+#include <stdint.h>
+#ifdef __cplusplus
+extern "C" {
+#endif
+/**
+ * @file
+ * @brief Lock Manager diagnostics: compile time trace levels and the binary trace ring
+ **/
+
+/**
+ * @brief Trace levels, each level prints everything the lower ones do
+ **/
+#define LOCK_TRACE_NONE   0
+#define LOCK_TRACE_ERROR  1
+#define LOCK_TRACE_INFO   2
+#define LOCK_TRACE_DEBUG  3
+
+/**
+ * @brief Trace level compiled in, release builds print nothing
+ **/
+#ifndef LOCK_TRACE_LEVEL
+#define LOCK_TRACE_LEVEL LOCK_TRACE_NONE
+#endif
+
+/**
+ * @brief printf style diagnostics, compiled out below #LOCK_TRACE_LEVEL
+ **/
+#if LOCK_TRACE_LEVEL >= LOCK_TRACE_ERROR
+#define TRACE_ERROR(...)  printf(__VA_ARGS__)
+#else
+#define TRACE_ERROR(...)  do{ }while(0)
+#endif
+
+#if LOCK_TRACE_LEVEL >= LOCK_TRACE_INFO
+#define TRACE_INFO(...)   printf(__VA_ARGS__)
+#else
+#define TRACE_INFO(...)   do{ }while(0)
+#endif
+
+#if LOCK_TRACE_LEVEL >= LOCK_TRACE_DEBUG
+#define TRACE_DEBUG(...)  printf(__VA_ARGS__)
+#else
+#define TRACE_DEBUG(...)  do{ }while(0)
+#endif
+
+/**
+ * @brief Operations recorded in the trace ring
+ **/
+enum LOCK_TRACE_OP{
+  LOCK_OP_REQUEST,    //0 -- @brief lockRequest, result is the #NODE_INSERT_RESULT
+  LOCK_OP_RELEASE,    //1 -- @brief lockRelease of a granted lock
+  LOCK_OP_GRANT       //2 -- @brief a queued lock was granted by a release
+};
+
+/**
+ * @brief One binary trace record, 32 bytes
+ **/
+typedef struct lock_trace_record_s{
+  /*
+   * CLOCK_MONOTONIC time in nanoseconds
+   */
+  uint64_t timestamp;
+  /*
+   * event index of the node, 64 bits like tree_node_t::eventIndex
+   */
+  uint64_t eventIndex;
+  uint32_t start_lba;
+  uint32_t end_lba;
+  /*
+   * thread that wrote the record, a ring outlives the threads owning it
+   */
+  uint32_t tid;
+  uint16_t namespaceID;
+  /*
+   * one of #LOCK_TRACE_OP
+   */
+  uint8_t  op;
+  uint8_t  result;
+}lock_trace_record_t;
+
+/**
+ * @brief Number of records kept per thread, a power of two
+ **/
+#define LOCK_TRACE_RING_SIZE 4096
+
+/**
+ * @brief Number of threads that can trace into one trace file at the same time, at most 64
+ *
+ * A thread claims a ring on its first record and gives it back when it
+ * exits, so a recycled thread pool keeps tracing; the records of a thread
+ * that finds every ring taken are dropped and counted in
+ * lock_trace_file_t::dropped.
+ **/
+#define LOCK_TRACE_RINGS     64
+
+/**
+ * @brief Trace file magic, "LKT3": changed when the file layout changed
+ **/
+#define LOCK_TRACE_MAGIC     0x4c4b5433
+
+/**
+ * @brief Ring of one thread at a time, only the owning thread writes it
+ **/
+typedef struct lock_trace_ring_s{
+  /*
+   * number of records ever written, the next one goes to head % LOCK_TRACE_RING_SIZE
+   */
+  uint64_t head;
+  /*
+   * thread owning the ring last
+   */
+  uint32_t tid;
+  uint32_t reserved;
+  lock_trace_record_t record[LOCK_TRACE_RING_SIZE];
+}lock_trace_ring_t;
+
+/**
+ * @brief Layout of the trace file, mapped shared so the records survive a crash
+ **/
+typedef struct lock_trace_file_s{
+  uint32_t magic;
+  uint32_t ringSize;
+  uint32_t rings;
+  /*
+   * number of rings ever handed out to threads, the rings past it are empty
+   */
+  uint32_t claimed;
+  /*
+   * rings owned by live threads, one bit each
+   */
+  uint64_t owned;
+  /*
+   * records dropped because every ring was owned
+   */
+  uint64_t dropped;
+  lock_trace_ring_t ring[LOCK_TRACE_RINGS];
+}lock_trace_file_t;
+
+#ifdef LOCK_TRACE_RING
+int lockTraceOpen(const char *path);
+
+void lockTraceClose(void);
+
+void lockTraceRecord(unsigned int op, unsigned int namespaceID, unsigned int start_lba, unsigned int end_lba, uint64_t eventIndex, unsigned int result);
+
+/**
+ * @brief Record an operation in the calling thread's ring
+ **/
+#define TRACE_RING(op, ns, start, end, index, result) lockTraceRecord(op, ns, start, end, index, result)
+#else
+#define TRACE_RING(op, ns, start, end, index, result) do{ }while(0)
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+#endif//lock_trace.h
@@ -0,0 +1,80 @@
+#include<stdlib.h>
+#include<stdio.h>
+#include<fcntl.h>
+#include<unistd.h>
+#include<sys/mman.h>
+#include<sys/stat.h>
+#include"lock_manager.h"
+#include"lock_trace.h"
+
+/**
+ * @file
+ * @brief Print the records of a trace file written by a LOCK_TRACE_RING build, oldest first
+ *
+ * Records dropped while every ring was owned are counted on stderr.
+ *
+ * usage: lock_tracedump <trace file>
+ **/
+
+static const char *opName[] = { "REQUEST", "RELEASE", "GRANT" };
+static const char *resultName[] = { "ADDED", "COLLISION", "QUEUED", "FAILED" };
+
+/**
+ * @brief order records by time stamp
+ **/
+static int recordCompare(const void *a, const void *b){
+  const lock_trace_record_t *r1 = a, *r2 = b;
+  return (r1->timestamp > r2->timestamp) - (r1->timestamp < r2->timestamp);
+}
+
+int main(int argc, char **argv){
+  lock_trace_file_t *file;
+  lock_trace_record_t *records;
+  struct stat st;
+  size_t count = 0, n;
+  unsigned int r;
+  int fd;
+
+  if(argc != 2){
+    fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+    return 1;
+  }
+  if((fd = open(argv[1], O_RDONLY)) < 0 || fstat(fd, &st) != 0 || st.st_size < (off_t) sizeof(lock_trace_file_t)){
+    fprintf(stderr, "%s: can not open trace file %s\n", argv[0], argv[1]);
+    return 1;
+  }
+  if((file = mmap(NULL, sizeof(lock_trace_file_t), PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED ||
+     file->magic != LOCK_TRACE_MAGIC || file->ringSize != LOCK_TRACE_RING_SIZE || file->rings != LOCK_TRACE_RINGS){
+    fprintf(stderr, "%s: %s is not a trace file of this build\n", argv[0], argv[1]);
+    return 1;
+  }
+
+  /*
+   * copy out the live part of every ring, a ring that wrapped keeps its last LOCK_TRACE_RING_SIZE records
+   */
+  records = malloc(sizeof(lock_trace_record_t) * LOCK_TRACE_RING_SIZE * LOCK_TRACE_RINGS);
+  for(r = 0; r < LOCK_TRACE_RINGS && r < file->claimed; r++){
+    const lock_trace_ring_t *ring = &file->ring[r];
+    unsigned long long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned long long first = head > LOCK_TRACE_RING_SIZE ? head - LOCK_TRACE_RING_SIZE : 0;
+    for(; first < head; first++)
+      records[count++] = ring->record[first & (LOCK_TRACE_RING_SIZE - 1)];
+  }
+  qsort(records, count, sizeof(lock_trace_record_t), recordCompare);
+
+  for(n = 0; n < count; n++){
+    const lock_trace_record_t *rec = &records[n];
+    printf("%llu.%09llu tid %u ns %u %-7s index %llu [%u -- %u]",
+	   (unsigned long long) rec->timestamp / 1000000000ull, (unsigned long long) rec->timestamp % 1000000000ull,
+	   rec->tid, rec->namespaceID, rec->op <= LOCK_OP_GRANT ? opName[rec->op] : "?",
+	   (unsigned long long) rec->eventIndex, rec->start_lba, rec->end_lba);
+    if(rec->op == LOCK_OP_REQUEST)
+      printf(" %s", rec->result <= NODE_FAILED ? resultName[rec->result] : "?");
+    printf("\n");
+  }
+  if(file->dropped)
+    fprintf(stderr, "%s: %llu records dropped, more than %u threads traced at once\n",
+	    argv[0], (unsigned long long) file->dropped, LOCK_TRACE_RINGS);
+  free(records);
+  return 0;
+}
@@ -0,0 +1,172 @@
+#ifndef RANGE_LOCK_CORO_HPP
+#define RANGE_LOCK_CORO_HPP
+/**
+ * @file
+ * @brief C++20 coroutine awaitable range locks on the lock manager namespaces
+ *
+ *     RangeLock lock = locks.lock(ns, start, end, RangeLock::WRITE);
+ *     if(!co_await lock)
+ *       ...;                        // no such namespace
+ *     ...                           // the range is held
+ *     lock.unlock();                // or let the destructor release it
+ *
+ * A lock granted at once does not suspend. A queued lock suspends the
+ * coroutine, and the release that grants it resumes it in the releasing
+ * thread once the namespace mutex is dropped, or hands it to the executor
+ * of the manager. The tree node lives inside the RangeLock, so awaiting
+ * costs no allocation; a RangeLock can not move and has to be a named
+ * object that outlives its lock, awaiting a temporary does not compile.
+ **/
+#include <coroutine>
+#include <type_traits>
+#include "lock_manager.h"
+
+class RangeLock;
+
+/**
+ * @brief Hands out RangeLocks, and resumes the coroutines of queued locks
+ **/
+class RangeLockManager{
+public:
+  /**
+   * @brief Executor hook, resumes coroutine on a thread of its choice
+   **/
+  typedef void (*Executor)(std::coroutine_handle<> coroutine, void *context);
+
+  /**
+   * @brief Resume granted coroutines inline, or through executor if it is set
+   **/
+  explicit RangeLockManager(Executor executor = NULL, void *context = NULL)
+    : executor_(executor), context_(context){
+  }
+
+  RangeLockManager(const RangeLockManager &) = delete;
+  RangeLockManager &operator=(const RangeLockManager &) = delete;
+
+  inline RangeLock lock(unsigned int namespaceID, unsigned int start, unsigned int end, bool write);
+
+private:
+  friend class RangeLock;
+
+  void resume(std::coroutine_handle<> coroutine){
+    if(executor_)
+      executor_(coroutine, context_);
+    else
+      coroutine.resume();
+  }
+
+  Executor executor_;
+  void *context_;
+};
+
+/**
+ * @brief A range lock with its tree node, await it to acquire the range
+ **/
+class RangeLock{
+public:
+  static const bool READ  = false;
+  static const bool WRITE = true;
+
+  RangeLock(RangeLockManager &manager, unsigned int namespaceID, unsigned int start, unsigned int end, bool write)
+    : node_(), manager_(&manager), handle_(), coroutine_(), namespaceID_(namespaceID), start_(start), end_(end),
+      write_(write), result_(NODE_FAILED){
+  }
+
+  RangeLock(const RangeLock &) = delete;
+  RangeLock &operator=(const RangeLock &) = delete;
+
+  /**
+   * @brief Release the range if it is held; a lock still queued must not be destroyed
+   **/
+  ~RangeLock(){
+    unlock();
+  }
+
+  /**
+   * @brief Awaiter of a RangeLock, resumes with true once the range is held
+   **/
+  class Awaiter{
+  public:
+    explicit Awaiter(RangeLock &lock) : lock_(lock){
+    }
+
+    bool await_ready() const noexcept{
+      return false;
+    }
+
+    /**
+     * @brief Request the lock, staying suspended only if it was queued
+     *
+     * A queued lock may be granted, and the coroutine resumed in another
+     * thread, before the request returns, so the lock is not touched after
+     * NODE_QUEUED.
+     **/
+    bool await_suspend(std::coroutine_handle<> coroutine) noexcept{
+      enum NODE_INSERT_RESULT ret;
+      lock_.coroutine_ = coroutine;
+      ret = lockRequestNode(&lock_.node_, lock_.start_, lock_.end_, lock_.write_, lock_.namespaceID_,
+			    &RangeLock::granted, &lock_.handle_);
+      if(ret == NODE_QUEUED)
+	return true;
+      lock_.result_ = ret;
+      return false;
+    }
+
+    bool await_resume() const noexcept{
+      return lock_.held();
+    }
+
+  private:
+    RangeLock &lock_;
+  };
+
+  Awaiter operator co_await() &{
+    return Awaiter(*this);
+  }
+  Awaiter operator co_await() && = delete;
+
+  /**
+   * @brief Test whether the range is held
+   **/
+  bool held() const{
+    return result_ == NODE_ADDED;
+  }
+
+  /**
+   * @brief Release the range if it is held, the RangeLock may then be awaited again
+   **/
+  void unlock(){
+    if(held()){
+      result_ = NODE_FAILED;
+      lockReleaseNode(&handle_);
+    }
+  }
+
+private:
+  /**
+   * @brief Granted hook of the node, node_ is the first member of a standard layout class
+   **/
+  static void granted(tree_node_t *node){
+    RangeLock *lock = reinterpret_cast<RangeLock *>(node);
+    lock->result_ = NODE_ADDED;
+    lock->manager_->resume(lock->coroutine_);
+  }
+
+  tree_node_t node_;
+  RangeLockManager *manager_;
+  lock_handle_t handle_;
+  std::coroutine_handle<> coroutine_;
+  unsigned int namespaceID_;
+  unsigned int start_;
+  unsigned int end_;
+  bool write_;
+  enum NODE_INSERT_RESULT result_;
+};
+
+static_assert(std::is_standard_layout<RangeLock>::value, "RangeLock::granted finds the lock from its node");
+
+inline RangeLock RangeLockManager::lock(unsigned int namespaceID, unsigned int start, unsigned int end, bool write){
+  return RangeLock(*this, namespaceID, start, end, write);
+}
+
+#endif//range_lock_coro.hpp
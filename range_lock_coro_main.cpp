@@ -0,0 +1,160 @@
+#include "range_lock_coro.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+/**
+ * @brief Heap allocations made by the test, to check awaiting allocates nothing
+ **/
+static unsigned long allocations;
+
+void *operator new(std::size_t size){
+  void *p;
+  allocations++;
+  if((p = std::malloc(size ? size : 1)) == NULL)
+    throw std::bad_alloc();
+  return p;
+}
+
+void operator delete(void *p) noexcept{
+  std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept{
+  std::free(p);
+}
+
+/**
+ * @brief Coroutine started eagerly and freed when it finishes
+ **/
+struct Task{
+  struct promise_type{
+    Task get_return_object(){ return Task(); }
+    std::suspend_never initial_suspend() noexcept{ return std::suspend_never(); }
+    std::suspend_never final_suspend() noexcept{ return std::suspend_never(); }
+    void return_void(){}
+    void unhandled_exception(){ std::abort(); }
+  };
+};
+
+/**
+ * @brief Take a range, then keep it until the test lets go of the write
+ * lock it holds on LBA 0 of namespace 1, noting the step reached
+ **/
+Task hold_range(RangeLockManager &locks, unsigned int start, unsigned int end, bool write, int *step){
+  RangeLock lock = locks.lock(0, start, end, write);
+  RangeLock gate = locks.lock(1, 0, 0, RangeLock::READ);
+  *step = 1;
+  if(!co_await lock)
+    co_return;
+  *step = 2;
+  co_await gate;
+  *step = 3;
+}
+
+/**
+ * @brief Take and release the same range count times
+ **/
+Task relock(RangeLockManager &locks, unsigned int count, unsigned long *allocated){
+  RangeLock lock = locks.lock(0, 500, 599, RangeLock::WRITE);
+  unsigned long before = allocations;
+  unsigned int i;
+  for(i = 0; i < count; i++){
+    co_await lock;
+    lock.unlock();
+  }
+  *allocated = allocations - before;
+}
+
+/**
+ * @brief Executor hook that parks the coroutines until the test runs them
+ **/
+static void defer(std::coroutine_handle<> coroutine, void *context){
+  static_cast<std::vector<std::coroutine_handle<> > *>(context)->push_back(coroutine);
+}
+
+/**
+ * @brief Run the oldest deferred coroutine, which may defer others
+ **/
+static void resume_next(std::vector<std::coroutine_handle<> > &ready){
+  std::coroutine_handle<> coroutine = ready.front();
+  ready.erase(ready.begin());
+  coroutine.resume();
+}
+
+/**
+ * @brief: a free range is taken without suspending, a queued one suspends
+ * and resumes inline in the thread of the release that grants it.
+ */
+bool test_await_inline(){
+  RangeLockManager locks;
+  lock_handle_t writer;
+  int first = 0, second = 0, third = 0;
+  bool ok = true;
+
+  treeInit();
+  hold_range(locks, 0, 99, RangeLock::READ, &first);
+  ok &= first == 3 && namespaces[0].root == NULL;
+
+  lockRequest(0, 99, 1, 1, 0, &writer);
+  hold_range(locks, 50, 59, RangeLock::READ, &second);
+  hold_range(locks, 90, 150, RangeLock::WRITE, &third);
+  ok &= second == 1 && third == 1;
+  lockRelease(&writer);
+  ok &= second == 3 && third == 3 && namespaces[0].root == NULL;
+  return ok;
+}
+
+/**
+ * @brief: an executor hook gets the granted coroutines instead, and a
+ * coroutine releasing its range from there hands it to the next waiter.
+ */
+bool test_await_executor(){
+  std::vector<std::coroutine_handle<> > ready;
+  RangeLockManager locks(defer, &ready);
+  lock_handle_t writer, gate;
+  int first = 0, second = 0;
+  bool ok = true;
+
+  treeInit();
+  ready.reserve(4);
+  lockRequest(0, 99, 1, 1, 0, &writer);
+  lockRequest(0, 0, 1, 1, 1, &gate);
+  hold_range(locks, 0, 9, RangeLock::WRITE, &first);
+  hold_range(locks, 5, 20, RangeLock::WRITE, &second);
+  lockRelease(&writer);
+  ok &= first == 1 && second == 1 && ready.size() == 1;
+
+  /*
+   * the first waiter runs up to the gate, the second still waits on it
+   */
+  resume_next(ready);
+  ok &= first == 2 && second == 1 && ready.empty();
+
+  lockRelease(&gate);
+  ok &= first == 2 && ready.size() == 1;
+  resume_next(ready);
+  ok &= first == 3 && second == 1 && ready.size() == 1;
+  resume_next(ready);
+  ok &= second == 3 && ready.empty() && namespaces[0].root == NULL && namespaces[1].root == NULL;
+  return ok;
+}
+
+/**
+ * @brief: awaiting and releasing a RangeLock allocates nothing
+ */
+bool test_await_allocations(){
+  RangeLockManager locks;
+  unsigned long allocated = ~0ul;
+  treeInit();
+  relock(locks, 10000, &allocated);
+  return allocated == 0 && namespaces[0].root == NULL;
+}
+
+int main(){
+  printf("queued coroutine resumed inline by the release? %s\n", test_await_inline() ? "Y" : "N");
+  printf("granted coroutine handed to the executor? %s\n", test_await_executor() ? "Y" : "N");
+  printf("awaiting a range lock allocates nothing? %s\n", test_await_allocations() ? "Y" : "N");
+  return 0;
+}
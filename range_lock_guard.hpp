@@ -0,0 +1,227 @@
+#ifndef RANGE_LOCK_GUARD_HPP
+#define RANGE_LOCK_GUARD_HPP
+/**
+ * @file
+ * @brief RAII guards and standard lockable objects over lockRequest()/lockRelease()
+ *
+ *     {
+ *       RangeLockGuard<> guard(ns, start, end, true);   // released on every path out
+ *     }
+ *
+ *     RangeMutex<> range(ns, start, end);
+ *     std::unique_lock<RangeMutex<> > writer(range);    // lock(), a write lock
+ *     std::shared_lock<RangeMutex<> > reader(range);    // lock_shared(), a read lock
+ *
+ * A RangeMutex names a range and can be shared between threads like a
+ * std::shared_mutex: it keeps the handle of its exclusive owner, and each
+ * shared owner's handle is kept by the owning thread. Everything is inline
+ * and the policies are template parameters, so a guard compiles down to
+ * the C calls it replaces.
+ **/
+#include <cerrno>
+#include <sched.h>
+#include <system_error>
+#include <utility>
+#include <vector>
+#include "lock_manager.h"
+
+/**
+ * @brief Fairness policy: queue behind earlier requests and sleep until granted, see lockRange()
+ *
+ * Requests are granted in arrival order, a writer is never starved by a
+ * stream of readers.
+ **/
+struct FifoFairness{
+  static enum NODE_INSERT_RESULT acquire(unsigned int namespaceID, unsigned int start, unsigned int end, bool write, lock_handle_t *handle){
+    return lockRange(start, end, write, namespaceID, handle);
+  }
+};
+
+/**
+ * @brief Fairness policy: never queue, poll until no older overlapping request remains
+ *
+ * Each try is a lockRequest() that does not queue, so it collides with
+ * older overlapping requests held or queued alike and can not overtake a
+ * queued writer. The caller yields the CPU between tries instead of
+ * sleeping in the lock manager: it holds no node while it waits, but a
+ * request arriving after it may still get in first, and under contention
+ * it costs more than #FifoFairness.
+ **/
+struct BargingFairness{
+  static enum NODE_INSERT_RESULT acquire(unsigned int namespaceID, unsigned int start, unsigned int end, bool write, lock_handle_t *handle){
+    enum NODE_INSERT_RESULT ret;
+    while((ret = lockRequest(start, end, write, 0, namespaceID, handle)) == NODE_COLLISION)
+      sched_yield();
+    return ret;
+  }
+};
+
+/**
+ * @brief Reader/writer policy: shared owners take read locks and run together
+ **/
+struct SharedReads{
+  static const bool sharedWrite = false;
+};
+
+/**
+ * @brief Reader/writer policy: shared owners take write locks too, every owner is exclusive
+ **/
+struct ExclusiveReads{
+  static const bool sharedWrite = true;
+};
+
+/**
+ * @brief Move-only owner of one range lock, released when the guard goes
+ **/
+template <class Fairness = FifoFairness>
+class RangeLockGuard{
+public:
+  /**
+   * @brief Block until the range is held
+   *
+   * @throw std::system_error -- no free node or a bad namespace
+   **/
+  RangeLockGuard(unsigned int namespaceID, unsigned int start, unsigned int end, bool write) : owns_(false){
+    if(Fairness::acquire(namespaceID, start, end, write, &handle_) != NODE_ADDED)
+      throw std::system_error(EAGAIN, std::generic_category(), "range lock");
+    owns_ = true;
+  }
+
+  RangeLockGuard(RangeLockGuard &&other) noexcept : handle_(other.handle_), owns_(other.owns_){
+    other.owns_ = false;
+  }
+
+  RangeLockGuard &operator=(RangeLockGuard &&other) noexcept{
+    if(this != &other){
+      unlock();
+      handle_ = other.handle_;
+      owns_   = other.owns_;
+      other.owns_ = false;
+    }
+    return *this;
+  }
+
+  RangeLockGuard(const RangeLockGuard &) = delete;
+  RangeLockGuard &operator=(const RangeLockGuard &) = delete;
+
+  ~RangeLockGuard(){
+    unlock();
+  }
+
+  /**
+   * @brief Release the range early, the guard then owns nothing
+   **/
+  void unlock(){
+    if(owns_){
+      owns_ = false;
+      lockRelease(&handle_);
+    }
+  }
+
+  bool owns_lock() const{
+    return owns_;
+  }
+
+  explicit operator bool() const{
+    return owns_;
+  }
+
+private:
+  lock_handle_t handle_;
+  bool owns_;
+};
+
+/**
+ * @brief A range of a namespace as a Lockable and SharedLockable object
+ *
+ * lock() takes a write lock, lock_shared() a read lock, or a write lock
+ * under #ExclusiveReads. The exclusive owner's handle is kept in the
+ * object. Any number of threads may own it shared at once; each keeps the
+ * handles of its shared locks in a list of its own, so unlock_shared()
+ * must come from the thread that took the lock, as for std::shared_mutex.
+ **/
+template <class Fairness = FifoFairness, class Sharing = SharedReads>
+class RangeMutex{
+public:
+  RangeMutex(unsigned int namespaceID, unsigned int start, unsigned int end)
+    : handle_(), namespaceID_(namespaceID), start_(start), end_(end){
+  }
+
+  RangeMutex(const RangeMutex &) = delete;
+  RangeMutex &operator=(const RangeMutex &) = delete;
+
+  void lock(){
+    acquire(true);
+  }
+
+  bool try_lock(){
+    return lockRequest(start_, end_, 1, 0, namespaceID_, &handle_) == NODE_ADDED;
+  }
+
+  void unlock(){
+    lockRelease(&handle_);
+  }
+
+  void lock_shared(){
+    std::vector<SharedOwner> &owners = sharedOwners();
+    SharedOwner owner = { this, lock_handle_t() };
+    owners.reserve(owners.size() + 1);
+    acquire(Sharing::sharedWrite, &owner.handle);
+    owners.push_back(owner);
+  }
+
+  bool try_lock_shared(){
+    std::vector<SharedOwner> &owners = sharedOwners();
+    SharedOwner owner = { this, lock_handle_t() };
+    owners.reserve(owners.size() + 1);
+    if(lockRequest(start_, end_, Sharing::sharedWrite, 0, namespaceID_, &owner.handle) != NODE_ADDED)
+      return false;
+    owners.push_back(owner);
+    return true;
+  }
+
+  void unlock_shared(){
+    std::vector<SharedOwner> &owners = sharedOwners();
+    for(size_t n = owners.size(); n-- > 0; ){
+      if(owners[n].mutex == this){
+	lockRelease(&owners[n].handle);
+	owners[n] = owners.back();
+	owners.pop_back();
+	return;
+      }
+    }
+  }
+
+private:
+  /**
+   * @brief A shared lock the calling thread holds, and the object it took it on
+   **/
+  struct SharedOwner{
+    const RangeMutex *mutex;
+    lock_handle_t handle;
+  };
+
+  /**
+   * @brief Shared locks of the calling thread, a thread rarely holds more than a few
+   **/
+  static std::vector<SharedOwner> &sharedOwners(){
+    static thread_local std::vector<SharedOwner> owners;
+    return owners;
+  }
+
+  void acquire(bool write){
+    acquire(write, &handle_);
+  }
+
+  void acquire(bool write, lock_handle_t *handle){
+    if(Fairness::acquire(namespaceID_, start_, end_, write, handle) != NODE_ADDED)
+      throw std::system_error(EAGAIN, std::generic_category(), "range lock");
+  }
+
+  lock_handle_t handle_;
+  unsigned int namespaceID_;
+  unsigned int start_;
+  unsigned int end_;
+};
+
+#endif//range_lock_guard.hpp
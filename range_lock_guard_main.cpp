@@ -0,0 +1,207 @@
+#include "range_lock_guard.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <thread>
+
+static unsigned long long now_nanos(){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void fail_while_holding(unsigned int start){
+  RangeLockGuard<> guard(0, start, start + 7, true);
+  throw std::runtime_error("I/O error");
+}
+
+/**
+ * @brief: a guard releases its range on every way out of its scope, and
+ * moving it hands the range over without releasing it.
+ */
+bool test_guard_scope(){
+  bool ok = true;
+
+  treeInit();
+  try{
+    fail_while_holding(100);
+  }
+  catch(const std::runtime_error &){
+  }
+  ok &= namespaces[0].root == NULL;
+  {
+    RangeLockGuard<> outer(0, 0, 9, true);
+    {
+      RangeLockGuard<> inner(std::move(outer));
+      ok &= inner.owns_lock() && !outer.owns_lock();
+      RangeLockGuard<> probe(0, 10, 19, false);
+      probe = std::move(inner);
+      ok &= probe && !inner && lockRequest(5, 5, 0, 0, 0, NULL) == NODE_COLLISION;
+    }
+    ok &= namespaces[0].root == NULL && !outer.owns_lock();
+  }
+  try{
+    RangeLockGuard<> bad(MAX_NAMESPACE_ID, 0, 0, true);
+    ok = false;
+  }
+  catch(const std::system_error &){
+  }
+  return ok;
+}
+
+/**
+ * @brief: std::unique_lock takes write locks and std::shared_lock read
+ * locks, or write locks under ExclusiveReads; try_lock refuses a range in
+ * use instead of queueing.
+ */
+bool test_standard_locks(){
+  RangeMutex<> a(0, 0, 99), b(0, 50, 149), c(0, 90, 99);
+  RangeMutex<BargingFairness, ExclusiveReads> d(1, 0, 99), e(1, 0, 99);
+  bool ok = true;
+
+  treeInit();
+  {
+    std::shared_lock<RangeMutex<> > ra(a), rb(b);
+    ok &= ra.owns_lock() && rb.owns_lock() && !c.try_lock() && c.try_lock_shared();
+    c.unlock_shared();
+  }
+  {
+    std::unique_lock<RangeMutex<> > wa(a);
+    std::unique_lock<RangeMutex<> > wc(c, std::try_to_lock);
+    ok &= wa.owns_lock() && !wc.owns_lock();
+  }
+  {
+    std::shared_lock<RangeMutex<BargingFairness, ExclusiveReads> > rd(d);
+    std::shared_lock<RangeMutex<BargingFairness, ExclusiveReads> > re(e, std::try_to_lock);
+    ok &= rd.owns_lock() && !re.owns_lock();
+  }
+  ok &= namespaces[0].root == NULL && namespaces[1].root == NULL;
+  return ok;
+}
+
+/**
+ * @brief: a BargingFairness request polls past a held reader but not past
+ * an older writer queued behind it; it is granted once that writer is
+ * done.
+ */
+bool test_barging_order(){
+  RangeMutex<BargingFairness> range(2, 0, 9);
+  std::atomic<bool> writerDone(false), granted(false), inOrder(false);
+  lock_handle_t reader, writer;
+  bool ok = true;
+
+  treeInit();
+  ok &= lockRequest(0, 9, 0, 1, 2, &reader) == NODE_ADDED;
+  ok &= lockRequest(0, 9, 1, 1, 2, &writer) == NODE_QUEUED;
+  std::thread barger([&]{
+      std::shared_lock<RangeMutex<BargingFairness> > shared(range);
+      inOrder = writerDone.load();
+      granted = true;
+    });
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  ok &= !granted;
+  lockRelease(&reader);
+  ok &= lockGranted(&writer) && !granted;
+  writerDone = true;
+  lockRelease(&writer);
+  barger.join();
+  ok &= granted && inOrder && namespaces[2].root == NULL;
+  return ok;
+}
+
+#define TEST_SHARED_THREADS 4
+
+/**
+ * @brief: threads share one RangeMutex. Shared owners hold it together
+ * under SharedReads and one at a time under ExclusiveReads, and each
+ * releases its own lock.
+ */
+bool test_shared_owners(){
+  RangeMutex<> reads(0, 0, 99);
+  RangeMutex<FifoFairness, ExclusiveReads> writes(1, 0, 99);
+  std::atomic<unsigned int> together(0), inside(0), most(0);
+  std::thread thread[TEST_SHARED_THREADS];
+  unsigned long long deadline = now_nanos() + 2000000000ull;
+  bool ok = true;
+  unsigned int n;
+
+  treeInit();
+  for(n = 0; n < TEST_SHARED_THREADS; n++)
+    thread[n] = std::thread([&]{
+	{
+	  std::shared_lock<RangeMutex<> > reader(reads);
+	  together++;
+	  while(together < TEST_SHARED_THREADS && now_nanos() < deadline)
+	    std::this_thread::yield();
+	}
+	for(unsigned int i = 0; i < 100; i++){
+	  std::shared_lock<RangeMutex<FifoFairness, ExclusiveReads> > writer(writes);
+	  unsigned int now = ++inside;
+	  unsigned int seen = most;
+	  while(now > seen && !most.compare_exchange_weak(seen, now))
+	    continue;
+	  std::this_thread::yield();
+	  inside--;
+	}
+      });
+  for(n = 0; n < TEST_SHARED_THREADS; n++)
+    thread[n].join();
+  ok &= together == TEST_SHARED_THREADS && most == 1;
+  ok &= reads.try_lock();
+  reads.unlock();
+  ok &= namespaces[0].root == NULL && namespaces[1].root == NULL;
+  return ok;
+}
+
+#define BENCH_OPS 200000
+
+/**
+ * @brief: lock and unlock one range through the raw C calls and through
+ * each wrapper, keeping the best of several rounds of each.
+ */
+void bench_guard_cost(){
+  const char *name[] = { "lockRange/lockRelease", "RangeLockGuard", "std::unique_lock", "std::shared_lock" };
+  unsigned long long best[4] = { ~0ull, ~0ull, ~0ull, ~0ull }, t0;
+  RangeMutex<> range(0, 1000, 1007);
+  lock_handle_t handle;
+  unsigned int round, i, way;
+
+  treeInit();
+  for(round = 0; round < 25; round++){
+    for(way = 0; way < 4; way++){
+      t0 = now_nanos();
+      for(i = 0; i < BENCH_OPS; i++){
+	if(way == 0){
+	  if(lockRange(1000, 1007, 1, 0, &handle) == NODE_ADDED)
+	    lockRelease(&handle);
+	}
+	else if(way == 1){
+	  RangeLockGuard<> guard(0, 1000, 1007, true);
+	}
+	else if(way == 2){
+	  std::unique_lock<RangeMutex<> > writer(range);
+	}
+	else{
+	  std::shared_lock<RangeMutex<> > reader(range);
+	}
+      }
+      t0 = now_nanos() - t0;
+      best[way] = t0 < best[way] ? t0 : best[way];
+    }
+  }
+  for(way = 0; way < 4; way++)
+    fprintf(stderr, "%-22s %.1f ns per lock+unlock\n", name[way], (double) best[way] / BENCH_OPS);
+}
+
+int main(){
+  printf("range lock guards released on every path? %s\n", test_guard_scope() ? "Y" : "N");
+  printf("std::unique_lock and std::shared_lock take range locks? %s\n", test_standard_locks() ? "Y" : "N");
+  printf("threads share one RangeMutex? %s\n", test_shared_owners() ? "Y" : "N");
+  printf("barging requests wait for older queued writers? %s\n", test_barging_order() ? "Y" : "N");
+  bench_guard_cost();
+  return 0;
+}
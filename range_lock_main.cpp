@@ -0,0 +1,113 @@
+#include "range_lock_table.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+/**
+ * @brief Lock request kept by the test to check the table against
+ **/
+template <typename Key>
+struct TestLock{
+  typename RangeLockTable<Key, int>::Handle handle;
+  Key start;
+  Key end;
+  bool write;
+};
+
+/**
+ * @brief Brute force check for a lock blocking a new request, every live lock arrived earlier
+ **/
+template <typename Key>
+bool test_blocked(const std::vector<TestLock<Key> > &live, Key start, Key end, bool write){
+  for(std::size_t i = 0; i < live.size(); i++)
+    if(start <= live[i].end && end >= live[i].start && (write || live[i].write))
+      return true;
+  return false;
+}
+
+/**
+ * @brief: random requests and releases checked against a brute force
+ * search, with ranges placed base keys apart so 64 bit tables see keys past
+ * 2^32.
+ */
+template <typename Key>
+bool random_test(Key base){
+  RangeLockTable<Key, int> table(256);
+  std::vector<TestLock<Key> > live;
+  int i, granted = 0, errors = 0;
+
+  for(i = 0; i < 20000; i++){
+    if(rand()%3 && live.size() < 200){
+      TestLock<Key> lock;
+      lock.start = base * (rand()%64) + rand()%64;
+      lock.end   = lock.start + rand()%(base + 64);
+      lock.write = rand()%2;
+
+      /*
+       * a probe that can not queue is only refused if something blocks it
+       */
+      bool blocked = test_blocked(live, lock.start, lock.end, lock.write);
+      enum NODE_INSERT_RESULT ret = table.request(lock.start, lock.end, lock.write, false, i, &lock.handle);
+      if((ret == NODE_COLLISION) != blocked)
+	errors++;
+      if(ret == NODE_ADDED)
+	live.push_back(lock);
+      else if(table.request(lock.start, lock.end, lock.write, true, i, &lock.handle) == NODE_QUEUED)
+	live.push_back(lock);
+    }
+    else if(!live.empty()){
+      std::size_t n = rand()%live.size();
+      if(table.granted(live[n].handle)){
+	table.release(live[n].handle, [&](int){ granted++; });
+
+	/*
+	 * the handle is stale once released
+	 */
+	if(table.release(live[n].handle))
+	  errors++;
+	live.erase(live.begin() + n);
+      }
+    }
+  }
+
+  /*
+   * draining the granted locks grants every queued one
+   */
+  while(!live.empty()){
+    std::size_t n;
+    for(n = 0; n < live.size() && !table.granted(live[n].handle); n++)
+      continue;
+    if(n == live.size()){
+      errors++;
+      break;
+    }
+    table.release(live[n].handle);
+    live.erase(live.begin() + n);
+  }
+  return !errors && table.size() == 0 && granted > 0;
+}
+
+/**
+ * @brief: ranges that only differ above bit 31 do not collide in a 64 bit table
+ */
+bool test_wide_keys(){
+  RangeLockTable64<> table(4);
+  RangeLockTable64<>::Handle a = {}, b = {};
+  bool ok = true;
+
+  ok &= table.request(0x100000000ull, 0x1000000ffull, true, false, NULL, &a) == NODE_ADDED;
+  ok &= table.request(0x000000000ull, 0x0000000ffull, true, false, NULL, &b) == NODE_ADDED;
+  ok &= table.request(0x0000000f0ull, 0x100000000ull, false, false, NULL, NULL) == NODE_COLLISION;
+  ok &= table.release(a) && !table.release(a) && table.release(b);
+  return ok && sizeof(RangeLockTable32<>::Node) < sizeof(RangeLockTable64<>::Node);
+}
+
+int main(){
+  srand(1);
+  printf("32 bit range lock table matches brute force? %s\n", random_test<std::uint32_t>(1000) ? "Y" : "N");
+  printf("64 bit range lock table matches brute force? %s\n", random_test<std::uint64_t>(1ull << 33) ? "Y" : "N");
+  printf("64 bit keys above 2^32 kept apart? %s\n", test_wide_keys() ? "Y" : "N");
+  printf("node size %zu bytes with 32 bit keys, %zu bytes with 64 bit keys\n",
+	 sizeof(RangeLockTable32<>::Node), sizeof(RangeLockTable64<>::Node));
+  return 0;
+}
@@ -0,0 +1,424 @@
+#ifndef RANGE_LOCK_TABLE_HPP
+#define RANGE_LOCK_TABLE_HPP
+/**
+ * @file
+ * @brief Range lock table templated on the key width
+ *
+ * The interval tree of lock_manager.c as a class template, so the same
+ * engine locks 32 bit LBAs, 64 bit LBAs or file byte offsets. The key type
+ * picks the node layout at compile time: a 32 bit table keeps 32 bit
+ * ranges and sequence numbers, a 64 bit table widens both.
+ *
+ * A table is one shard: it does no locking of its own and the caller
+ * serializes calls the way lockRequest() does with the namespace mutex.
+ **/
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include "lock_manager.h"
+
+/**
+ * @brief Types that depend on the key width, only 32 and 64 bit keys are supported
+ **/
+template <typename Key> struct RangeKeyTraits;
+
+template <> struct RangeKeyTraits<std::uint32_t>{
+  typedef std::uint32_t Seq;
+  typedef std::int32_t  SeqDiff;
+};
+
+template <> struct RangeKeyTraits<std::uint64_t>{
+  typedef std::uint64_t Seq;
+  typedef std::int64_t  SeqDiff;
+};
+
+template <typename Key, typename Payload = void *>
+class RangeLockTable{
+public:
+  typedef typename RangeKeyTraits<Key>::Seq     Seq;
+  typedef typename RangeKeyTraits<Key>::SeqDiff SeqDiff;
+
+  /**
+   * @brief Tree node, the counterpart of tree_node_t
+   **/
+  struct Node{
+    /*
+     * pending list of a granted node, circular through the node itself,
+     * or the free list
+     */
+    Node *next;
+    Node *prev;
+
+    Node *parent;
+    Node *child[2];
+
+    Key start;
+    Key end;
+
+    /*
+     * hull of every range held or queued in this subtree
+     */
+    Key minStart;
+    Key maxEnd;
+
+    /*
+     * hull of the pending list, valid while it is not empty
+     */
+    Key pendingStart;
+    Key pendingEnd;
+
+    /*
+     * arrival order, compared with serial number arithmetic
+     */
+    Seq seq;
+
+    unsigned int generation;
+    signed char height;
+    unsigned char type;
+    unsigned char state;
+    /*
+     * set if a write lock is on the pending list
+     */
+    unsigned char pendingWrites;
+    Payload payload;
+  };
+
+  /**
+   * @brief Reference to a requested lock, see lock_handle_t
+   **/
+  struct Handle{
+    Node *node;
+    unsigned int generation;
+  };
+
+  /**
+   * @brief Create a table holding at most capacity locks, granted or queued
+   **/
+  explicit RangeLockTable(std::size_t capacity)
+    : pool_(new Node[capacity]()), free_(NULL), root_(NULL), nextSeq_(0), used_(0){
+    for(std::size_t n = capacity; n > 0; n--){
+      pool_[n - 1].next = free_;
+      free_ = &pool_[n - 1];
+    }
+  }
+
+  RangeLockTable(const RangeLockTable &) = delete;
+  RangeLockTable &operator=(const RangeLockTable &) = delete;
+
+  /**
+   * @brief Request a lock on [start, end], see lockRequest()
+   *
+   * @param[in]  start   -- first key of the range
+   * @param[in]  end     -- last key of the range
+   * @param[in]  write   -- set for an exclusive lock
+   * @param[in]  queue   -- queue the request if it can not be granted
+   * @param[in]  payload -- handed back when a queued lock is granted
+   * @param[out] handle  -- set to the handle of the lock, may be NULL
+   *
+   * @retval The insertion result.
+   **/
+  enum NODE_INSERT_RESULT request(Key start, Key end, bool write, bool queue, Payload payload, Handle *handle){
+    Node *node = free_;
+    enum NODE_INSERT_RESULT ret;
+    if(node == NULL)
+      return NODE_FAILED;
+    free_ = node->next;
+
+    node->start   = start;
+    node->end     = end;
+    node->type    = write;
+    node->payload = payload;
+    node->seq     = ++nextSeq_;
+    node->next = node->prev = node;
+    if((ret = insert(node, queue)) == NODE_COLLISION){
+      freeNode(node);
+      return ret;
+    }
+    used_++;
+    if(handle){
+      handle->node       = node;
+      handle->generation = node->generation;
+    }
+    return ret;
+  }
+
+  /**
+   * @brief Release a granted lock, see lockRelease()
+   *
+   * @param[in] handle  -- handle filled in by #request
+   * @param[in] onGrant -- called with the payload of every queued lock granted by this release
+   *
+   * @retval false -- the handle is stale or its lock is still queued
+   **/
+  template <typename OnGrant>
+  bool release(const Handle &handle, OnGrant onGrant){
+    Node *node = handle.node;
+    if(node->generation != handle.generation || node->state != LOCK_GRANTED)
+      return false;
+    remove(node);
+
+    /*
+     * retry the pending locks in arrival order
+     */
+    Node *pending = node->next;
+    while(pending != node){
+      Node *next = pending->next;
+      pending->next = pending->prev = pending;
+      if(insert(pending, true) == NODE_ADDED)
+	onGrant(pending->payload);
+      pending = next;
+    }
+    used_--;
+    freeNode(node);
+    return true;
+  }
+
+  bool release(const Handle &handle){
+    return release(handle, [](Payload){});
+  }
+
+  /**
+   * @brief Test whether the lock of a handle is held
+   **/
+  bool granted(const Handle &handle) const{
+    return handle.node->generation == handle.generation && handle.node->state == LOCK_GRANTED;
+  }
+
+  /**
+   * @brief Number of granted and queued locks
+   **/
+  std::size_t size() const{
+    return used_;
+  }
+
+private:
+  static bool before(Seq a, Seq b){
+    return static_cast<SeqDiff>(a - b) < 0;
+  }
+
+  void freeNode(Node *node){
+    node->child[LEFT] = node->child[RIGHT] = node->parent = NULL;
+    node->height = 0;
+    node->state  = LOCK_FREE;
+    node->generation++;
+    node->next = free_;
+    free_ = node;
+  }
+
+  static void updateSpan(Node *node){
+    Key lo = node->start;
+    Key hi = node->end;
+    if(node->next != node){
+      lo = MIN(lo, node->pendingStart);
+      hi = MAX(hi, node->pendingEnd);
+    }
+    for(int side = LEFT; side <= RIGHT; side++){
+      if(node->child[side]){
+	lo = MIN(lo, node->child[side]->minStart);
+	hi = MAX(hi, node->child[side]->maxEnd);
+      }
+    }
+    node->minStart = lo;
+    node->maxEnd   = hi;
+  }
+
+  static void widenSpan(Node *node, Key start, Key end){
+    for(; node; node = node->parent){
+      if(node->minStart <= start && node->maxEnd >= end)
+	break;
+      node->minStart = MIN(node->minStart, start);
+      node->maxEnd   = MAX(node->maxEnd, end);
+    }
+  }
+
+  Node *rotateNode(Node *subTreeRoot, int direction){
+    Node *pivot = subTreeRoot->child[!direction];
+    subTreeRoot->child[!direction] = pivot->child[direction];
+    pivot->child[direction] = subTreeRoot;
+
+    if(subTreeRoot->child[!direction])
+      subTreeRoot->child[!direction]->parent = subTreeRoot;
+    pivot->parent = subTreeRoot->parent;
+    subTreeRoot->parent = pivot;
+    if(pivot->parent)
+      pivot->parent->child[pivot->parent->child[RIGHT] == subTreeRoot] = pivot;
+    else
+      root_ = pivot;
+
+    subTreeRoot->height = MAX(height(subTreeRoot->child[LEFT]), height(subTreeRoot->child[RIGHT])) + 1;
+    pivot->height = MAX(height(pivot->child[LEFT]), height(pivot->child[RIGHT])) + 1;
+    updateSpan(subTreeRoot);
+    updateSpan(pivot);
+    return pivot;
+  }
+
+  Node *rotateDouble(Node *subTreeRoot, int direction){
+    rotateNode(subTreeRoot->child[!direction], !direction);
+    return rotateNode(subTreeRoot, direction);
+  }
+
+  void rebalance(Node *node){
+    for(; node; node = node->parent){
+      node->height = MAX(height(node->child[LEFT]), height(node->child[RIGHT])) + 1;
+      if(height(node->child[RIGHT]) - height(node->child[LEFT]) >= 2){
+	if(height(node->child[RIGHT]->child[RIGHT]) >= height(node->child[RIGHT]->child[LEFT]))
+	  node = rotateNode(node, LEFT);
+	else
+	  node = rotateDouble(node, LEFT);
+      }
+      else if(height(node->child[RIGHT]) - height(node->child[LEFT]) <= -2){
+	if(height(node->child[LEFT]->child[RIGHT]) <= height(node->child[LEFT]->child[LEFT]))
+	  node = rotateNode(node, RIGHT);
+	else
+	  node = rotateDouble(node, RIGHT);
+      }
+      else
+	updateSpan(node);
+    }
+  }
+
+  static bool blocks(const Node *lock, bool queued, const Node *node){
+    if(node->start > lock->end || node->end < lock->start)
+      return false;
+    if(!lock->type && !node->type)
+      return false;
+    return !queued || before(lock->seq, node->seq);
+  }
+
+  static bool spanOverlap(const Node *subtree, const Node *node){
+    return node->start <= subtree->maxEnd && node->end >= subtree->minStart;
+  }
+
+  static bool pendingMayBlock(const Node *holder, const Node *node){
+    return holder->next != holder && node->start <= holder->pendingEnd && node->end >= holder->pendingStart &&
+      (node->type || holder->pendingWrites);
+  }
+
+  static Node *findCollision(Node *iter, const Node *node){
+    while(iter != NULL && spanOverlap(iter, node)){
+      if(iter->child[LEFT] && spanOverlap(iter->child[LEFT], node)){
+	Node *found = findCollision(iter->child[LEFT], node);
+	if(found)
+	  return found;
+      }
+      if(blocks(iter, false, node))
+	return iter;
+      if(pendingMayBlock(iter, node)){
+	for(Node *pnode = iter->next; pnode != iter; pnode = pnode->next)
+	  if(blocks(pnode, true, node))
+	    return iter;
+      }
+      iter = iter->child[RIGHT];
+    }
+    return NULL;
+  }
+
+  /*
+   * queue behind holder in arrival order, searching from the tail since
+   * sequence numbers are handed out in order, and grow the hull of the list
+   */
+  static void addPending(Node *holder, Node *node){
+    Node *iter = holder->prev;
+    if(holder->next == holder){
+      holder->pendingStart  = node->start;
+      holder->pendingEnd    = node->end;
+      holder->pendingWrites = 0;
+    }
+    else{
+      holder->pendingStart = MIN(holder->pendingStart, node->start);
+      holder->pendingEnd   = MAX(holder->pendingEnd, node->end);
+    }
+    holder->pendingWrites |= node->type;
+    while(iter != holder && before(node->seq, iter->seq))
+      iter = iter->prev;
+    node->prev = iter;
+    node->next = iter->next;
+    iter->next->prev = node;
+    iter->next = node;
+  }
+
+  enum NODE_INSERT_RESULT insert(Node *node, bool canQueue){
+    Node *prev, *iter;
+    int direction = LEFT;
+
+    node->child[LEFT] = node->child[RIGHT] = NULL;
+    node->height   = 0;
+    node->minStart = node->start;
+    node->maxEnd   = node->end;
+
+    if((prev = findCollision(root_, node)) != NULL){
+      if(!canQueue)
+	return NODE_COLLISION;
+      addPending(prev, node);
+      widenSpan(prev, node->start, node->end);
+      node->state = LOCK_QUEUED;
+      return NODE_QUEUED;
+    }
+
+    prev = NULL;
+    for(iter = root_; iter != NULL; iter = iter->child[direction]){
+      prev = iter;
+      direction = (node->start > iter->start) ? RIGHT : LEFT;
+    }
+    node->parent = prev;
+    if(prev){
+      prev->child[direction] = node;
+      rebalance(prev);
+    }
+    else
+      root_ = node;
+    node->state = LOCK_GRANTED;
+    return NODE_ADDED;
+  }
+
+  void replaceChild(Node *node, Node *replace){
+    if(node->parent)
+      node->parent->child[node->parent->child[RIGHT] == node] = replace;
+    else
+      root_ = replace;
+    if(replace)
+      replace->parent = node->parent;
+  }
+
+  void remove(Node *node){
+    Node *fix;
+    if(node->child[LEFT] && node->child[RIGHT]){
+      Node *replace;
+      for(replace = node->child[LEFT]; replace->child[RIGHT]; replace = replace->child[RIGHT])
+	continue;
+      if(replace->parent != node){
+	fix = replace->parent;
+	if((fix->child[RIGHT] = replace->child[LEFT]) != NULL)
+	  fix->child[RIGHT]->parent = fix;
+	replace->child[LEFT] = node->child[LEFT];
+	replace->child[LEFT]->parent = replace;
+      }
+      else
+	fix = replace;
+      replace->child[RIGHT] = node->child[RIGHT];
+      replace->child[RIGHT]->parent = replace;
+      replaceChild(node, replace);
+      replace->height = node->height;
+    }
+    else{
+      fix = node->parent;
+      replaceChild(node, node->child[node->child[LEFT] == NULL]);
+    }
+    node->child[LEFT] = node->child[RIGHT] = node->parent = NULL;
+    rebalance(fix);
+  }
+
+  std::unique_ptr<Node[]> pool_;
+  Node *free_;
+  Node *root_;
+  Seq nextSeq_;
+  std::size_t used_;
+};
+
+/**
+ * @brief The two supported widths
+ **/
+template <typename Payload = void *> using RangeLockTable32 = RangeLockTable<std::uint32_t, Payload>;
+template <typename Payload = void *> using RangeLockTable64 = RangeLockTable<std::uint64_t, Payload>;
+
+#endif//range_lock_table.hpp